@@ -26,6 +26,7 @@
 
 #include "tty.h"
 #include "sdl.h"
+#include "clk.h"
 #include "boo.h"
 
 static char *menu[24] = {
@@ -70,36 +71,37 @@ int ewm_boo_main(int argc, char **argv) {
       return 1;
    }
 
-   SDL_Renderer *renderer = SDL_CreateRenderer(window, -1, SDL_RENDERER_ACCELERATED);
-   if (renderer == NULL) {
-      fprintf(stderr, "Failed to create renderer: %s\n", SDL_GetError());
+   struct ewm_sdl_display_t *display = ewm_sdl_display_create(window, 280, 192);
+   if (display == NULL) {
+      fprintf(stderr, "Failed to create display: %s\n", SDL_GetError());
       return 1;
    }
 
-   if (ewm_sdl_check_renderer(renderer) != 0) {
-      fprintf(stderr, "ewm: boo: unsupported renderer\n");
-      return 1;
-   }
-
-   SDL_RenderSetLogicalSize(renderer, 280, 192);
-
    // We only need a tty to display the menu
 
    SDL_Color green = {255,255,0,255};
-   struct ewm_tty_t *tty = ewm_tty_create(renderer, green);
+   struct ewm_tty_t *tty = ewm_tty_create(display->renderer, green);
+
+   for (int i = 0; i < 24; i++) {
+      ewm_tty_set_line(tty, i, menu[i]);
+   }
+
+   tty->screen_cursor_column = 34;
+   tty->screen_cursor_row = 9;
 
    // Main loop
 
-   uint32_t ticks = SDL_GetTicks();
+   uint64_t ticks = ewm_clk_now();
    uint32_t phase = 1;
 
    int result = -1;
 
    while (result == -1) {
-      // Handle the next event
+      // Handle events, sleeping until the next frame is due if there
+      // are none
 
       SDL_Event event;
-      while (SDL_PollEvent(&event) != 0) {
+      for (int ready = ewm_sdl_wait_event(&event, ticks + (1000000000 / EWM_BOO_FPS)); ready != 0; ready = SDL_PollEvent(&event)) {
          switch (event.type) {
             case SDL_QUIT:
                result = EWM_BOO_QUIT;
@@ -128,33 +130,17 @@ int ewm_boo_main(int argc, char **argv) {
 
       // Update the screen
 
-      if ((SDL_GetTicks() - ticks) >= (1000 / EWM_BOO_FPS)) {
-         if (tty->screen_dirty || (phase == 0) || ((phase % (EWM_BOO_FPS / 4)) == 0)) {
-            SDL_SetRenderDrawColor(tty->renderer, 0, 0, 0, 255);
-            SDL_RenderClear(tty->renderer);
-
-            for (int i = 0; i < 24; i++) {
-               char *p = (char*) tty->screen_buffer;
-               p += (i * 40);
-               memcpy(p, menu[i], 40);
-            }
-
-            tty->screen_cursor_column = 34;
-            tty->screen_cursor_row = 9;
-
+      if ((ewm_clk_now() - ticks) >= (1000000000 / EWM_BOO_FPS)) {
+         bool visible = ewm_sdl_window_visible(window);
+         if (visible && (tty->screen_dirty || (phase == 0) || ((phase % (EWM_BOO_FPS / 4)) == 0))) {
             ewm_tty_refresh(tty, phase, EWM_BOO_FPS);
             tty->screen_dirty = false;
 
-            SDL_Texture *texture = SDL_CreateTextureFromSurface(tty->renderer, tty->surface);
-            if (texture != NULL) {
-               SDL_RenderCopy(tty->renderer, texture, NULL, NULL);
-               SDL_DestroyTexture(texture);
-            }
-
-            SDL_RenderPresent(tty->renderer);
+            ewm_sdl_display_draw(display, tty->surface, NULL);
+            ewm_sdl_display_present(display);
          }
 
-         ticks = SDL_GetTicks();
+         ticks = ewm_clk_now();
 
          phase += 1;
          if (phase == EWM_BOO_FPS) {
@@ -165,8 +151,8 @@ int ewm_boo_main(int argc, char **argv) {
 
    // Destroy SDL
 
+   ewm_sdl_display_destroy(display);
    SDL_DestroyWindow(window);
-   SDL_DestroyRenderer(renderer);
    SDL_Quit();
 
    return result;
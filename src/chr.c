@@ -61,42 +61,6 @@ static int _load_rom_data(char *rom_path, uint8_t rom_data[2048]) {
    return 0;
 }
 
-static void _set_pixel(SDL_Surface * surface, int x, int y, Uint32 color) {
-   uint32_t *pixel = (uint32_t*) ((uint8_t*) surface->pixels + (y * surface->pitch) + (x * sizeof(uint32_t)));
-   *pixel = color;
-}
-
-static SDL_Texture *_generate_texture(SDL_Renderer *renderer, uint8_t rom_data[2048], int c, bool inverse) {
-   SDL_Texture *texture = NULL;
-
-   uint8_t character_data[8];
-   for (int i = 0; i < 8; i++) {
-      character_data[i] = rom_data[(c * 8) + i + 1];
-      if (inverse) {
-         character_data[i] ^= 0xff;
-      }
-   }
-
-   SDL_Surface *surface = SDL_CreateRGBSurface(0, 7, 8, 32, 0x000000ff, 0x0000ff00, 0x00ff0000, 0xff000000);
-   if (surface != NULL) {
-      for (int y = 0; y < 8; y++) {
-         for (int x = 0; x < 7; x++) {
-            if (character_data[y] & (1 << x)) {
-               _set_pixel(surface, (6-x), y, 0xffffffff);
-            }
-         }
-      }
-      texture = SDL_CreateTextureFromSurface(renderer, surface);
-      if (texture == NULL) {
-         fprintf(stderr, "Cannot generate RGBSurface: %s\n", SDL_GetError());
-      }
-   } else {
-      fprintf(stderr, "Cannot generate Texture: %s\n", SDL_GetError());
-   }
-
-   return texture;
-}
-
 static uint32_t *_generate_bitmap(struct ewm_chr_t *chr, uint8_t rom_data[2048], int c, bool inverse) {
    uint32_t *pixels = (uint32_t*) malloc(4 * ewm_chr_width(chr) * ewm_chr_height(chr));
    if (pixels != NULL) {
@@ -125,6 +89,45 @@ static uint32_t *_generate_bitmap(struct ewm_chr_t *chr, uint8_t rom_data[2048],
    return pixels;
 }
 
+static SDL_Texture *_generate_atlas(struct ewm_chr_t *chr, SDL_Renderer *renderer) {
+   int width = EWM_CHR_ATLAS_COLUMNS * ewm_chr_width(chr);
+   int height = EWM_CHR_ATLAS_ROWS * ewm_chr_height(chr);
+
+   uint32_t *pixels = calloc(width * height, sizeof(uint32_t));
+   if (pixels == NULL) {
+      return NULL;
+   }
+
+   // Glyphs are white on a transparent background so that the color
+   // can be supplied per vertex when drawing.
+
+   for (int c = 0; c <= EWM_CHR_ATLAS_SOLID; c++) {
+      uint32_t *src = (c < 256) ? chr->bitmaps[c] : NULL;
+      if (c < 256 && src == NULL) {
+         continue;
+      }
+      uint32_t *dst = pixels + ((c / EWM_CHR_ATLAS_COLUMNS) * ewm_chr_height(chr) * width) + ((c % EWM_CHR_ATLAS_COLUMNS) * ewm_chr_width(chr));
+      for (int y = 0; y < ewm_chr_height(chr); y++) {
+         for (int x = 0; x < ewm_chr_width(chr); x++) {
+            dst[x] = (src == NULL || *src++ != 0) ? 0xffffffff : 0x00000000;
+         }
+         dst += width;
+      }
+   }
+
+   SDL_Texture *texture = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_ARGB8888, SDL_TEXTUREACCESS_STATIC, width, height);
+   if (texture == NULL) {
+      fprintf(stderr, "Cannot generate atlas Texture: %s\n", SDL_GetError());
+   } else {
+      SDL_UpdateTexture(texture, NULL, pixels, width * sizeof(uint32_t));
+      SDL_SetTextureBlendMode(texture, SDL_BLENDMODE_BLEND);
+   }
+
+   free(pixels);
+
+   return texture;
+}
+
 static int ewm_chr_init(struct ewm_chr_t *chr, char *rom_path, int rom_type, SDL_Renderer *renderer) {
    if (rom_type != EWM_CHR_ROM_TYPE_2716) {
       return -1;
@@ -165,30 +168,13 @@ static int ewm_chr_init(struct ewm_chr_t *chr, char *rom_path, int rom_type, SDL
       chr->bitmaps[0x60 + (c-32)] = _generate_bitmap(chr, rom_data, c, true);
    }
 
-   // Textures
-
-   // Normal Text
-   for (int c = 0; c < 32; c++) {
-      chr->textures[0xc0 + c] = _generate_texture(renderer, rom_data, c, false);
-   }
-   for (int c = 32; c < 64; c++) {
-      chr->textures[0xa0 + (c-32)] = _generate_texture(renderer, rom_data, c, false);
-   }
-
-   // Inverse Text
-   for (int c = 0; c < 32; c++) {
-      chr->textures[0x00 + c] = _generate_texture(renderer, rom_data, c, true);
-   }
-   for (int c = 32; c < 64; c++) {
-      chr->textures[0x20 + (c-32)] = _generate_texture(renderer, rom_data, c, true);
-   }
+   // Atlas, only needed when drawing through a renderer
 
-   // TODO Flashing - Currently simply rendered as inverse
-   for (int c = 0; c < 32; c++) {
-      chr->textures[0x40 + c] = _generate_texture(renderer, rom_data, c, true);
-   }
-   for (int c = 32; c < 64; c++) {
-      chr->textures[0x60 + (c-32)] = _generate_texture(renderer, rom_data, c, true);
+   if (renderer != NULL) {
+      chr->atlas = _generate_atlas(chr, renderer);
+      if (chr->atlas == NULL) {
+         return -1;
+      }
    }
 
    return 0;
@@ -213,7 +199,8 @@ int ewm_chr_height(struct ewm_chr_t* chr) {
 }
 
 void ewm_chr_set_color(struct ewm_chr_t* chr, uint32_t color) {
-   for (int i = 0; i < 255; i++) {
+   chr->color = color;
+   for (int i = 0; i < 256; i++) {
       uint32_t *bitmap = chr->bitmaps[i];
       if (bitmap != NULL) {
          for (int j = 0; j < ewm_chr_width(chr) * ewm_chr_height(chr); j++) {
@@ -224,3 +211,135 @@ void ewm_chr_set_color(struct ewm_chr_t* chr, uint32_t color) {
       }
    }
 }
+
+// Batched drawing from the atlas
+
+struct ewm_chr_batch_t *ewm_chr_batch_create() {
+   struct ewm_chr_batch_t *batch = (struct ewm_chr_batch_t*) malloc(sizeof(struct ewm_chr_batch_t));
+   if (batch != NULL) {
+      memset(batch, 0x00, sizeof(struct ewm_chr_batch_t));
+      for (int q = 0; q < EWM_CHR_BATCH_MAX_QUADS; q++) {
+         int *indices = &batch->indices[q * 6];
+         indices[0] = (q * 4) + 0;
+         indices[1] = (q * 4) + 1;
+         indices[2] = (q * 4) + 2;
+         indices[3] = (q * 4) + 2;
+         indices[4] = (q * 4) + 3;
+         indices[5] = (q * 4) + 0;
+      }
+   }
+   return batch;
+}
+
+void ewm_chr_batch_reset(struct ewm_chr_batch_t *batch) {
+   batch->quads = 0;
+}
+
+static void _batch_add_cell(struct ewm_chr_t *chr, struct ewm_chr_batch_t *batch, int cell, SDL_Rect *dst, SDL_Color color) {
+   if (batch->quads == EWM_CHR_BATCH_MAX_QUADS) {
+      return;
+   }
+
+   float u0 = (float) (cell % EWM_CHR_ATLAS_COLUMNS) / EWM_CHR_ATLAS_COLUMNS;
+   float v0 = (float) (cell / EWM_CHR_ATLAS_COLUMNS) / EWM_CHR_ATLAS_ROWS;
+   float u1 = u0 + (1.0f / EWM_CHR_ATLAS_COLUMNS);
+   float v1 = v0 + (1.0f / EWM_CHR_ATLAS_ROWS);
+
+   SDL_Vertex *v = &batch->vertices[batch->quads * 4];
+   v[0] = (SDL_Vertex) { { dst->x,          dst->y          }, color, { u0, v0 } };
+   v[1] = (SDL_Vertex) { { dst->x + dst->w, dst->y          }, color, { u1, v0 } };
+   v[2] = (SDL_Vertex) { { dst->x + dst->w, dst->y + dst->h }, color, { u1, v1 } };
+   v[3] = (SDL_Vertex) { { dst->x,          dst->y + dst->h }, color, { u0, v1 } };
+
+   batch->quads++;
+}
+
+void ewm_chr_batch_add_rect(struct ewm_chr_t *chr, struct ewm_chr_batch_t *batch, SDL_Rect *dst, SDL_Color color) {
+   _batch_add_cell(chr, batch, EWM_CHR_ATLAS_SOLID, dst, color);
+}
+
+void ewm_chr_batch_add_character(struct ewm_chr_t *chr, struct ewm_chr_batch_t *batch, uint8_t c, SDL_Rect *dst, SDL_Color color) {
+   if (chr->bitmaps[c] != NULL) {
+      _batch_add_cell(chr, batch, c, dst, color);
+   }
+}
+
+void ewm_chr_batch_add_string(struct ewm_chr_t *chr, struct ewm_chr_batch_t *batch, int x, int y, int scale, char *s, SDL_Color color) {
+   SDL_Rect dst = { .x = x, .y = y, .w = ewm_chr_width(chr) * scale, .h = ewm_chr_height(chr) * scale };
+   while (*s != 0x00) {
+      ewm_chr_batch_add_character(chr, batch, *s++ + 0x80, &dst, color);
+      dst.x += dst.w;
+   }
+}
+
+int ewm_chr_batch_render(struct ewm_chr_t *chr, struct ewm_chr_batch_t *batch) {
+   if (batch->quads == 0) {
+      return 0;
+   }
+   return SDL_RenderGeometry(chr->renderer, chr->atlas, batch->vertices, batch->quads * 4, batch->indices, batch->quads * 6);
+}
+
+// Draw the batch directly into a 32 bit surface. This is used when
+// there is no renderer. Quad coordinates are multiplied by scale. The
+// part of the surface that was drawn over is returned in bounds.
+
+int ewm_chr_batch_blit(struct ewm_chr_t *chr, struct ewm_chr_batch_t *batch, SDL_Surface *surface, int scale, SDL_Rect *bounds) {
+   *bounds = (SDL_Rect) { .x = 0, .y = 0, .w = 0, .h = 0 };
+
+   if (surface->format->BytesPerPixel != 4) {
+      return -1;
+   }
+
+   if (SDL_MUSTLOCK(surface)) {
+      SDL_LockSurface(surface);
+   }
+
+   for (int q = 0; q < batch->quads; q++) {
+      SDL_Vertex *v = &batch->vertices[q * 4];
+
+      int cell = (int) (v[0].tex_coord.x * EWM_CHR_ATLAS_COLUMNS + 0.5f)
+         + ((int) (v[0].tex_coord.y * EWM_CHR_ATLAS_ROWS + 0.5f) * EWM_CHR_ATLAS_COLUMNS);
+      uint32_t *bitmap = (cell < 256) ? chr->bitmaps[cell] : NULL;
+
+      int x0 = v[0].position.x * scale, y0 = v[0].position.y * scale;
+      int x1 = v[2].position.x * scale, y1 = v[2].position.y * scale;
+      if (x1 <= x0 || y1 <= y0) {
+         continue;
+      }
+
+      SDL_Rect quad = { .x = x0, .y = y0, .w = x1 - x0, .h = y1 - y0 };
+      SDL_UnionRect(bounds, &quad, bounds);
+
+      SDL_Color c = v[0].color;
+      uint32_t color = SDL_MapRGB(surface->format, c.r, c.g, c.b);
+
+      for (int y = SDL_max(y0, 0); y < SDL_min(y1, surface->h); y++) {
+         uint32_t *dst = (uint32_t*) ((uint8_t*) surface->pixels + (y * surface->pitch));
+         int gy = ((y - y0) * ewm_chr_height(chr)) / (y1 - y0);
+         for (int x = SDL_max(x0, 0); x < SDL_min(x1, surface->w); x++) {
+            if (bitmap != NULL) {
+               int gx = ((x - x0) * ewm_chr_width(chr)) / (x1 - x0);
+               if (bitmap[(gy * ewm_chr_width(chr)) + gx] == 0) {
+                  continue;
+               }
+            }
+            if (c.a == 255) {
+               dst[x] = color;
+            } else {
+               uint8_t r, g, b;
+               SDL_GetRGB(dst[x], surface->format, &r, &g, &b);
+               dst[x] = SDL_MapRGB(surface->format,
+                  ((c.r * c.a) + (r * (255 - c.a))) / 255,
+                  ((c.g * c.a) + (g * (255 - c.a))) / 255,
+                  ((c.b * c.a) + (b * (255 - c.a))) / 255);
+            }
+         }
+      }
+   }
+
+   if (SDL_MUSTLOCK(surface)) {
+      SDL_UnlockSurface(surface);
+   }
+
+   return 0;
+}
@@ -27,16 +27,42 @@
 
 #define EWM_CHR_ROM_TYPE_2716 (2716)
 
+// The atlas is a 16x16 grid of 7x8 glyphs, followed by one extra row
+// that has a solid cell, which is used to draw filled rectangles.
+
+#define EWM_CHR_ATLAS_COLUMNS (16)
+#define EWM_CHR_ATLAS_ROWS    (17)
+#define EWM_CHR_ATLAS_SOLID   (256)
+
+#define EWM_CHR_BATCH_MAX_QUADS (1024)
+
 struct ewm_chr_t {
    SDL_Renderer *renderer;
-   SDL_Texture *textures[256];
+   SDL_Texture *atlas;
    uint32_t *bitmaps[256];
    uint32_t color;
 };
 
+// A batch collects textured quads from the atlas so that a whole
+// status bar or overlay can be submitted with a single draw call.
+
+struct ewm_chr_batch_t {
+   int quads;
+   SDL_Vertex vertices[EWM_CHR_BATCH_MAX_QUADS * 4];
+   int indices[EWM_CHR_BATCH_MAX_QUADS * 6];
+};
+
 struct ewm_chr_t* ewm_chr_create(char *rom_path, int rom_type, SDL_Renderer *renderer);
 int ewm_chr_width(struct ewm_chr_t* chr);
 int ewm_chr_height(struct ewm_chr_t* chr);
 void ewm_chr_set_color(struct ewm_chr_t* chr, uint32_t color);
 
+struct ewm_chr_batch_t *ewm_chr_batch_create();
+void ewm_chr_batch_reset(struct ewm_chr_batch_t *batch);
+void ewm_chr_batch_add_rect(struct ewm_chr_t *chr, struct ewm_chr_batch_t *batch, SDL_Rect *dst, SDL_Color color);
+void ewm_chr_batch_add_character(struct ewm_chr_t *chr, struct ewm_chr_batch_t *batch, uint8_t c, SDL_Rect *dst, SDL_Color color);
+void ewm_chr_batch_add_string(struct ewm_chr_t *chr, struct ewm_chr_batch_t *batch, int x, int y, int scale, char *s, SDL_Color color);
+int ewm_chr_batch_render(struct ewm_chr_t *chr, struct ewm_chr_batch_t *batch);
+int ewm_chr_batch_blit(struct ewm_chr_t *chr, struct ewm_chr_batch_t *batch, SDL_Surface *surface, int scale, SDL_Rect *bounds);
+
 #endif
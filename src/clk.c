@@ -0,0 +1,175 @@
+// The MIT License (MIT)
+//
+// Copyright (c) 2017 Stefan Arentz - http://github.com/st3fan/ewm
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <SDL2/SDL.h>
+
+#include "clk.h"
+
+static int ewm_clk_init(struct ewm_clk_t *clk, uint64_t hz, int fps, double speed) {
+   memset(clk, 0x00, sizeof(struct ewm_clk_t));
+   clk->hz = hz;
+   clk->fps = fps;
+   clk->speed = speed;
+   clk->slices = 1;
+   ewm_clk_reset(clk, 0);
+   return 0;
+}
+
+struct ewm_clk_t *ewm_clk_create(uint64_t hz, int fps, double speed) {
+   struct ewm_clk_t *clk = (struct ewm_clk_t*) malloc(sizeof(struct ewm_clk_t));
+   if (ewm_clk_init(clk, hz, fps, speed) != 0) {
+      free(clk);
+      clk = NULL;
+   }
+   return clk;
+}
+
+void ewm_clk_destroy(struct ewm_clk_t *clk) {
+   free(clk);
+}
+
+// Monotonic wall time in nanoseconds
+
+uint64_t ewm_clk_now() {
+   uint64_t counter = SDL_GetPerformanceCounter();
+   uint64_t frequency = SDL_GetPerformanceFrequency();
+   return ((counter / frequency) * 1000000000ull) + (((counter % frequency) * 1000000000ull) / frequency);
+}
+
+// Sleep until the deadline. This rounds up to whole milliseconds, the
+// clock makes up for sleeping a little too long.
+
+void ewm_clk_sleep_until(uint64_t deadline) {
+   uint64_t now = ewm_clk_now();
+   if (deadline > now) {
+      SDL_Delay((uint32_t) ((deadline - now + 999999) / 1000000));
+   }
+}
+
+void ewm_clk_reset(struct ewm_clk_t *clk, uint64_t cycles) {
+   clk->anchor_time = ewm_clk_now();
+   clk->anchor_cycles = cycles;
+   clk->frame_deadline = clk->anchor_time + (1000000000ull / clk->fps);
+   clk->slice_deadline = clk->anchor_time + (1000000000ull / (clk->fps * clk->slices));
+}
+
+void ewm_clk_set_speed(struct ewm_clk_t *clk, double speed, uint64_t cycles) {
+   clk->speed = speed;
+   ewm_clk_reset(clk, cycles);
+}
+
+void ewm_clk_set_turbo(struct ewm_clk_t *clk, bool turbo, uint64_t cycles) {
+   clk->turbo = turbo;
+   ewm_clk_reset(clk, cycles);
+}
+
+void ewm_clk_set_warp(struct ewm_clk_t *clk, bool warp, uint64_t cycles) {
+   clk->warp = warp;
+   ewm_clk_reset(clk, cycles);
+}
+
+void ewm_clk_set_slices(struct ewm_clk_t *clk, int slices, uint64_t cycles) {
+   clk->slices = slices;
+   ewm_clk_reset(clk, cycles);
+}
+
+bool ewm_clk_throttled(struct ewm_clk_t *clk) {
+   return clk->speed != EWM_CLK_SPEED_UNLIMITED && !clk->turbo && !clk->warp;
+}
+
+// Returns the number of cycles to run to catch up with wall time. When
+// unthrottled this is simply a slice worth of cycles at 1x, so that
+// the caller gets to handle events and render regularly.
+
+uint64_t ewm_clk_cycles_due(struct ewm_clk_t *clk, uint64_t cycles) {
+   if (!ewm_clk_throttled(clk)) {
+      return clk->hz / (clk->fps * clk->slices);
+   }
+
+   double rate = (clk->hz * clk->speed) / 1000000000.0; // Cycles per ns
+
+   uint64_t target = clk->anchor_cycles + (uint64_t) ((ewm_clk_now() - clk->anchor_time) * rate);
+   if (target > cycles + (uint64_t) (EWM_CLK_MAX_BACKLOG_NS * rate)) {
+      ewm_clk_reset(clk, cycles);
+      return (uint64_t) ((clk->hz * clk->speed) / clk->fps);
+   }
+
+   return (target > cycles) ? (target - cycles) : 0;
+}
+
+bool ewm_clk_frame_due(struct ewm_clk_t *clk) {
+   return ewm_clk_now() >= clk->frame_deadline;
+}
+
+// Frames are scheduled on a fixed grid. If we fell behind by more than
+// a frame, for example in turbo mode, the grid restarts from now.
+
+void ewm_clk_next_frame(struct ewm_clk_t *clk) {
+   uint64_t frame_time = 1000000000ull / clk->fps;
+   uint64_t now = ewm_clk_now();
+   clk->frame_deadline += frame_time;
+   if (clk->frame_deadline + frame_time < now) {
+      clk->frame_deadline = now + frame_time;
+   }
+}
+
+bool ewm_clk_slice_due(struct ewm_clk_t *clk) {
+   return ewm_clk_now() >= clk->slice_deadline;
+}
+
+// Slices follow each other until the end of the frame. The last slice
+// of a frame ends exactly on the frame deadline, so that the screen is
+// rendered right after the cpu caught up.
+
+void ewm_clk_next_slice(struct ewm_clk_t *clk) {
+   uint64_t slice_time = 1000000000ull / (clk->fps * clk->slices);
+   uint64_t now = ewm_clk_now();
+   clk->slice_deadline += slice_time;
+   if (clk->slice_deadline + slice_time < now) {
+      clk->slice_deadline = now + slice_time;
+   }
+   if (clk->slice_deadline > clk->frame_deadline) {
+      clk->slice_deadline = clk->frame_deadline;
+   }
+}
+
+// Parse a --speed argument, which is a multiplier like 0.5 or 2, or
+// unlimited.
+
+int ewm_clk_parse_speed(char *s, double *speed) {
+   if (strcmp(s, "unlimited") == 0) {
+      *speed = EWM_CLK_SPEED_UNLIMITED;
+      return 0;
+   }
+
+   char *end = NULL;
+   double v = strtod(s, &end);
+   if (end == s || *end != 0x00 || v <= 0.0) {
+      return -1;
+   }
+
+   *speed = v;
+   return 0;
+}
@@ -0,0 +1,73 @@
+// The MIT License (MIT)
+//
+// Copyright (c) 2017 Stefan Arentz - http://github.com/st3fan/ewm
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#ifndef EWM_CLK_H
+#define EWM_CLK_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Throttles emulation to wall clock time. Emulated time is anchored to
+// a moment in wall time and the number of cycles due is calculated
+// from the time passed since then, so fractional cycles are never lost
+// and emulated time does not drift.
+
+#define EWM_CLK_SPEED_UNLIMITED (0.0)
+
+// How far emulation may fall behind before the backlog is dropped,
+// for example after the host was suspended or the machine was paused.
+#define EWM_CLK_MAX_BACKLOG_NS (250000000ull)
+
+struct ewm_clk_t {
+   uint64_t hz;             // Emulated cycles per second at 1x
+   int fps;                 // Frames rendered per second
+   int slices;              // Cpu time slices per frame
+   double speed;            // Speed multiplier or EWM_CLK_SPEED_UNLIMITED
+   bool turbo;              // Temporarily unthrottled by the user
+   bool warp;               // Temporarily unthrottled by the machine
+   uint64_t anchor_time;    // Wall time in ns at which ...
+   uint64_t anchor_cycles;  // ... the cpu was at this cycle
+   uint64_t frame_deadline; // Wall time in ns at which the next frame is due
+   uint64_t slice_deadline; // Wall time in ns at which the next slice is due
+};
+
+struct ewm_clk_t *ewm_clk_create(uint64_t hz, int fps, double speed);
+void ewm_clk_destroy(struct ewm_clk_t *clk);
+
+uint64_t ewm_clk_now();
+void ewm_clk_sleep_until(uint64_t deadline);
+
+void ewm_clk_reset(struct ewm_clk_t *clk, uint64_t cycles);
+void ewm_clk_set_speed(struct ewm_clk_t *clk, double speed, uint64_t cycles);
+void ewm_clk_set_turbo(struct ewm_clk_t *clk, bool turbo, uint64_t cycles);
+void ewm_clk_set_warp(struct ewm_clk_t *clk, bool warp, uint64_t cycles);
+void ewm_clk_set_slices(struct ewm_clk_t *clk, int slices, uint64_t cycles);
+bool ewm_clk_throttled(struct ewm_clk_t *clk);
+uint64_t ewm_clk_cycles_due(struct ewm_clk_t *clk, uint64_t cycles);
+bool ewm_clk_frame_due(struct ewm_clk_t *clk);
+void ewm_clk_next_frame(struct ewm_clk_t *clk);
+bool ewm_clk_slice_due(struct ewm_clk_t *clk);
+void ewm_clk_next_slice(struct ewm_clk_t *clk);
+
+int ewm_clk_parse_speed(char *s, double *speed);
+
+#endif // EWM_CLK_H
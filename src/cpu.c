@@ -97,7 +97,164 @@ void _cpu_set_status(struct cpu_t *cpu, uint8_t status) {
   cpu->state.c = (status & (1 << 0));
 }
 
+// Idle loop detection. Programs spend most of their time polling the
+// keyboard in a tight loop. When a backwards BPL or BMI is taken we
+// check if it closes such a loop around a read of one of the idle
+// addresses, which must be free of side effects.
+
+static bool _cpu_is_idle_address(struct cpu_t *cpu, uint16_t addr) {
+   for (int i = 0; i < cpu->idle_addresses_count; i++) {
+      if (cpu->idle_addresses[i] == addr) {
+         return true;
+      }
+   }
+   return false;
+}
+
+static bool _cpu_is_idle_poll(struct cpu_t *cpu, uint16_t pc) {
+   switch (mem_get_byte(cpu, pc)) {
+      case 0xad: // LDA abs
+      case 0xae: // LDX abs
+      case 0xac: // LDY abs
+      case 0x2c: // BIT abs
+         return _cpu_is_idle_address(cpu, mem_get_word(cpu, pc + 1));
+   }
+   return false;
+}
+
+static bool _cpu_detect_idle_loop(struct cpu_t *cpu, uint16_t start, uint16_t branch) {
+   struct cpu_idle_loop_t *loop = &cpu->idle_loop;
+
+   if (branch == start + 3 && _cpu_is_idle_poll(cpu, start)) {
+      loop->type = EWM_CPU_IDLE_LOOP_POLL;
+      loop->cycles = cpu->instructions[mem_get_byte(cpu, start)].cycles
+         + cpu->instructions[mem_get_byte(cpu, branch)].cycles;
+      loop->carry_cycles = 0;
+      return true;
+   }
+
+   // The Apple II Monitor KEYIN routine also increments a random seed
+   if (branch == start + 9 && mem_get_byte(cpu, start) == 0xe6 && mem_get_word(cpu, start + 2) == 0x02d0
+         && mem_get_byte(cpu, start + 4) == 0xe6 && _cpu_is_idle_poll(cpu, start + 6)) {
+      loop->type = EWM_CPU_IDLE_LOOP_KEYIN;
+      loop->lo = mem_get_byte(cpu, start + 1);
+      loop->hi = mem_get_byte(cpu, start + 5);
+      if (loop->lo == loop->hi) {
+         return false;
+      }
+      loop->carry_cycles = cpu->instructions[0xe6].cycles;
+      loop->cycles = (2 * cpu->instructions[0xe6].cycles) - loop->carry_cycles
+         + cpu->instructions[0xd0].cycles
+         + cpu->instructions[mem_get_byte(cpu, start + 6)].cycles
+         + cpu->instructions[mem_get_byte(cpu, branch)].cycles;
+      return true;
+   }
+
+   return false;
+}
+
+// Delay loop detection. When a backwards BNE is taken we check if it
+// closes a loop that only counts down a register. These touch nothing
+// but registers and flags (and one stack byte for WAIT) so their end
+// state can be computed directly.
+
+static bool _cpu_detect_delay_loop(struct cpu_t *cpu, uint16_t start, uint16_t branch) {
+   struct cpu_idle_loop_t *loop = &cpu->idle_loop;
+   struct cpu_instruction_t *instructions = cpu->instructions;
+
+   loop->start = start;
+   loop->exit = branch + 2;
+
+   switch (branch - start) {
+      case 1: {
+         // DEX / BNE or DEY / BNE
+         uint8_t op = mem_get_byte(cpu, start);
+         if (op != 0xca && op != 0x88) {
+            return false;
+         }
+         loop->type = EWM_CPU_IDLE_LOOP_COUNT;
+         loop->count = (op == 0xca) ? &cpu->state.x : &cpu->state.y;
+         loop->cycles = instructions[op].cycles + instructions[0xd0].cycles;
+         return true;
+      }
+
+      case 2: {
+         // SBC #1 / BNE, only exact with carry set in binary mode
+         if (mem_get_word(cpu, start) != 0x01e9 || cpu->state.c == 0 || cpu->state.d) {
+            return false;
+         }
+         loop->type = EWM_CPU_IDLE_LOOP_SBC;
+         loop->cycles = instructions[0xe9].cycles + instructions[0xd0].cycles;
+         return true;
+      }
+
+      case 4: {
+         // DEY / BNE / DEX / BNE or DEX / BNE / DEY / BNE
+         uint8_t inner = mem_get_byte(cpu, start), outer = mem_get_byte(cpu, start + 3);
+         if (!((inner == 0x88 && outer == 0xca) || (inner == 0xca && outer == 0x88)) || mem_get_word(cpu, start + 1) != 0xfdd0) {
+            return false;
+         }
+         loop->type = EWM_CPU_IDLE_LOOP_NEST;
+         loop->count = (outer == 0xca) ? &cpu->state.x : &cpu->state.y;
+         loop->inner = (inner == 0xca) ? &cpu->state.x : &cpu->state.y;
+         if (*loop->inner != 0) {
+            return false;
+         }
+         loop->cycles = 256 * (instructions[inner].cycles + instructions[0xd0].cycles)
+            + instructions[outer].cycles + instructions[0xd0].cycles;
+         return true;
+      }
+
+      case 8: {
+         // PHA / SBC #1 / BNE / PLA / SBC #1 / BNE, the outer loop of WAIT
+         if (mem_get_byte(cpu, start) != 0x48 || mem_get_word(cpu, start + 1) != 0x01e9 || mem_get_word(cpu, start + 3) != 0xfcd0
+               || mem_get_byte(cpu, start + 5) != 0x68 || mem_get_word(cpu, start + 6) != 0x01e9 || cpu->state.c == 0 || cpu->state.d) {
+            return false;
+         }
+         loop->type = EWM_CPU_IDLE_LOOP_WAIT;
+         loop->cycles = instructions[0xe9].cycles + instructions[0xd0].cycles;
+         loop->carry_cycles = instructions[0x48].cycles + instructions[0x68].cycles
+            + instructions[0xe9].cycles + instructions[0xd0].cycles;
+         return true;
+      }
+   }
+
+   return false;
+}
+
+static bool _cpu_has_no_hooks(struct cpu_t *cpu) {
+#if defined(EWM_LUA)
+   return cpu->lua == NULL;
+#else
+   (void) cpu;
+   return true;
+#endif
+}
+
+// The counter is what devices and the clock use for timing. With an
+// accelerator the cpu runs several cycles for every cycle counted,
+// unless it was slowed down for a device that needs normal speed.
+
+static inline void _cpu_count_cycles(struct cpu_t *cpu, uint64_t cycles) {
+   if (cpu->accel == 1 || cpu->counter < cpu->accel_slow_until) {
+      cpu->counter += cycles;
+   } else {
+      uint64_t total = cpu->accel_cycles + cycles;
+      cpu->counter += total / cpu->accel;
+      cpu->accel_cycles = total % cpu->accel;
+   }
+}
+
 static int cpu_execute_instruction(struct cpu_t *cpu) {
+   // A trap replaces the code at its address, unless it declines
+   if (cpu->trap_handler != NULL && cpu->state.pc == cpu->trap_address) {
+      int cycles = cpu->trap_handler(cpu, cpu->trap_obj);
+      if (cycles >= 0) {
+         _cpu_count_cycles(cpu, cycles);
+         return cycles;
+      }
+   }
+
    // Fetch instruction
    struct cpu_instruction_t *i = &cpu->instructions[mem_get_byte(cpu, cpu->state.pc)];
 
@@ -162,7 +319,16 @@ static int cpu_execute_instruction(struct cpu_t *cpu) {
    }
 #endif
 
-   cpu->counter += i->cycles;
+   // Tracing and scripts need to see every instruction
+   if (cpu->state.pc < pc && cpu->trace == NULL && _cpu_has_no_hooks(cpu)) {
+      if (i->opcode == 0xd0) {
+         cpu->idle = _cpu_detect_delay_loop(cpu, cpu->state.pc, pc);
+      } else if (cpu->idle_addresses_count != 0 && (i->opcode == 0x10 || i->opcode == 0x30)) {
+         cpu->idle = _cpu_detect_idle_loop(cpu, cpu->state.pc, pc);
+      }
+   }
+
+   _cpu_count_cycles(cpu, i->cycles);
 
    return i->cycles;
 }
@@ -187,6 +353,7 @@ static int cpu_init(struct cpu_t *cpu, int model) {
 
    memset(cpu, 0x00, sizeof(struct cpu_t));
    cpu->model = model;
+   cpu->accel = 1;
    cpu->instructions = malloc(sizeof instructions);
    memcpy(cpu->instructions, (cpu->model == EWM_CPU_MODEL_6502) ? instructions : instructions_65C02, sizeof instructions);
 
@@ -376,6 +543,32 @@ void cpu_strict(struct cpu_t *cpu, bool strict) {
    cpu->strict = strict;
 }
 
+// Run factor cycles for every cycle of the counter, like an accelerator
+// card. Devices still see time pass at the normal rate.
+
+void cpu_accelerate(struct cpu_t *cpu, int factor) {
+   cpu->accel = factor < 1 ? 1 : factor;
+   cpu->accel_cycles = 0;
+}
+
+// Call handler when the cpu is about to execute the instruction at
+// address. There is one trap, setting a new one replaces it.
+
+void cpu_set_trap(struct cpu_t *cpu, uint16_t address, cpu_trap_handler_t handler, void *obj) {
+   cpu->trap_address = address;
+   cpu->trap_handler = handler;
+   cpu->trap_obj = obj;
+}
+
+// Run at normal speed for at least cycles, for devices that depend on
+// the timing of the code that uses them, like the disk and speaker.
+
+void cpu_slow_down(struct cpu_t *cpu, uint64_t cycles) {
+   if (cpu->accel != 1 && cpu->counter + cycles > cpu->accel_slow_until) {
+      cpu->accel_slow_until = cpu->counter + cycles;
+   }
+}
+
 int cpu_trace(struct cpu_t *cpu, char *path) {
    if (cpu->trace != NULL) {
       (void) fclose(cpu->trace);
@@ -392,6 +585,23 @@ int cpu_trace(struct cpu_t *cpu, char *path) {
    return 0;
 }
 
+// Devices that skip work must not do so while something is watching
+// every instruction
+bool cpu_is_observed(struct cpu_t *cpu) {
+   return cpu->trace != NULL || !_cpu_has_no_hooks(cpu);
+}
+
+// Devices with state that is not part of a snapshot, like disk contents,
+// call this before they change anything. When running ahead it stops
+// the cpu after the current instruction and returns true, in which case
+// the device must ignore the access.
+bool cpu_stop_ahead(struct cpu_t *cpu) {
+   if (cpu->ahead) {
+      cpu->ahead_stopped = true;
+   }
+   return cpu->ahead;
+}
+
 void cpu_reset(struct cpu_t *cpu) {
    cpu->state.pc = mem_get_word(cpu, EWM_VECTOR_RES);
    cpu->state.a = 0x00;
@@ -439,6 +649,205 @@ int cpu_step(struct cpu_t *cpu) {
    return cpu_execute_instruction(cpu);
 }
 
+// Snapshots store the enabled state and flags of every memory region,
+// followed by its contents if it is RAM. Soft switches that bank memory
+// in and out are covered by this. ROM and IO are not copied.
+
+static size_t _cpu_snapshot_length(struct cpu_t *cpu) {
+   size_t length = 0;
+   for (struct mem_t *mem = cpu->mem; mem != NULL; mem = mem->next) {
+      length += 2;
+      if (mem->write_handler == _ram_write) {
+         length += mem->end - mem->start + 1;
+      }
+   }
+   return length;
+}
+
+struct cpu_snapshot_t *cpu_snapshot_create(struct cpu_t *cpu) {
+   struct cpu_snapshot_t *snapshot = (struct cpu_snapshot_t*) malloc(sizeof(struct cpu_snapshot_t));
+   memset(snapshot, 0, sizeof(struct cpu_snapshot_t));
+   snapshot->length = _cpu_snapshot_length(cpu);
+   snapshot->data = malloc(snapshot->length);
+   if (snapshot->data == NULL) {
+      free(snapshot);
+      return NULL;
+   }
+   return snapshot;
+}
+
+void cpu_snapshot_destroy(struct cpu_snapshot_t *snapshot) {
+   free(snapshot->data);
+   free(snapshot);
+}
+
+void cpu_snapshot_save(struct cpu_t *cpu, struct cpu_snapshot_t *snapshot) {
+   snapshot->cpu = *cpu;
+   uint8_t *p = snapshot->data;
+   for (struct mem_t *mem = cpu->mem; mem != NULL; mem = mem->next) {
+      *p++ = mem->enabled;
+      *p++ = mem->flags;
+      if (mem->write_handler == _ram_write) {
+         size_t length = mem->end - mem->start + 1;
+         memcpy(p, mem->obj, length);
+         p += length;
+      }
+   }
+}
+
+void cpu_snapshot_restore(struct cpu_t *cpu, struct cpu_snapshot_t *snapshot) {
+   *cpu = snapshot->cpu;
+   uint8_t *p = snapshot->data;
+   for (struct mem_t *mem = cpu->mem; mem != NULL; mem = mem->next) {
+      mem->enabled = *p++;
+      mem->flags = *p++;
+      if (mem->write_handler == _ram_write) {
+         size_t length = mem->end - mem->start + 1;
+         memcpy(mem->obj, p, length);
+         p += length;
+      }
+   }
+}
+
+int cpu_add_idle_address(struct cpu_t *cpu, uint16_t addr) {
+   if (cpu->idle_addresses_count == EWM_CPU_IDLE_ADDRESSES_MAX) {
+      return -1;
+   }
+   cpu->idle_addresses[cpu->idle_addresses_count++] = addr;
+   return 0;
+}
+
+// Run the idle loop the cpu just entered for at least the given number
+// of cycles, in whole iterations. The keyboard cannot change while we
+// do this, so the result is exactly what executing the loop would have
+// done. Returns the number of cycles that were skipped.
+
+static uint64_t _cpu_idle_forward_poll(struct cpu_t *cpu, uint64_t cycles) {
+   struct cpu_idle_loop_t *loop = &cpu->idle_loop;
+   uint64_t iterations = (cycles + loop->cycles - 1) / loop->cycles;
+   if (iterations == 0) {
+      return 0;
+   }
+
+   uint64_t skipped = iterations * loop->cycles;
+
+   if (loop->type == EWM_CPU_IDLE_LOOP_KEYIN) {
+      uint64_t lo = mem_get_byte(cpu, loop->lo) + iterations;
+      mem_set_byte(cpu, loop->lo, lo & 0xff);
+      mem_set_byte(cpu, loop->hi, mem_get_byte(cpu, loop->hi) + (lo / 256));
+      skipped += (lo / 256) * loop->carry_cycles;
+   }
+
+   cpu->idle_hits++;
+   cpu->idle_cycles += skipped;
+
+   return skipped;
+}
+
+// SBC #1 from a with the carry set, flags as set by adc()
+
+static void _cpu_sbc_one_result(struct cpu_t *cpu, uint8_t a) {
+   uint8_t r = a - 1;
+   cpu->state.a = r;
+   cpu->state.c = 1;
+   cpu->state.v = (a ^ r) & (0xfe ^ r) & 0x80;
+   cpu->state.z = (r == 0x00);
+   cpu->state.n = (r & 0x80);
+}
+
+// Same for delay loops, except that we stop early when the loop ends,
+// in which case the pc moves past the final BNE.
+
+static uint64_t _cpu_idle_forward_delay(struct cpu_t *cpu, uint64_t cycles) {
+   struct cpu_idle_loop_t *loop = &cpu->idle_loop;
+   uint64_t skipped = 0;
+
+   switch (loop->type) {
+      case EWM_CPU_IDLE_LOOP_COUNT:
+      case EWM_CPU_IDLE_LOOP_NEST: {
+         // The loop runs until the register is zero, 256 times if it starts at zero
+         uint64_t remaining = (*loop->count == 0) ? 256 : *loop->count;
+         uint64_t iterations = (cycles + loop->cycles - 1) / loop->cycles;
+         if (iterations > remaining) {
+            iterations = remaining;
+         }
+         if (iterations == 0) {
+            return 0;
+         }
+         *loop->count -= iterations;
+         cpu->state.z = (*loop->count == 0x00);
+         cpu->state.n = (*loop->count & 0x80);
+         skipped = iterations * loop->cycles;
+         break;
+      }
+
+      case EWM_CPU_IDLE_LOOP_SBC: {
+         uint64_t remaining = (cpu->state.a == 0) ? 256 : cpu->state.a;
+         uint64_t iterations = (cycles + loop->cycles - 1) / loop->cycles;
+         if (iterations > remaining) {
+            iterations = remaining;
+         }
+         if (iterations == 0) {
+            return 0;
+         }
+         _cpu_sbc_one_result(cpu, cpu->state.a - (iterations - 1));
+         skipped = iterations * loop->cycles;
+         break;
+      }
+
+      case EWM_CPU_IDLE_LOOP_WAIT: {
+         // Each outer iteration pushes A, counts it down to zero, pulls
+         // it and decrements it. The last value pushed stays on the stack.
+         if (cycles == 0) {
+            return 0;
+         }
+         uint8_t a = cpu->state.a;
+         do {
+            int inner = (a == 0) ? 256 : a;
+            skipped += inner * loop->cycles + loop->carry_cycles;
+            mem_set_byte(cpu, 0x0100 + cpu->state.sp, a);
+            _cpu_sbc_one_result(cpu, a);
+            a = cpu->state.a;
+         } while (a != 0 && skipped < cycles);
+         break;
+      }
+   }
+
+   if (cpu->state.z) {
+      cpu->state.pc = loop->exit;
+   }
+
+   cpu->delay_hits++;
+   cpu->delay_cycles += skipped;
+
+   return skipped;
+}
+
+uint64_t cpu_idle_forward(struct cpu_t *cpu, uint64_t cycles) {
+   cpu->idle = false;
+
+   // The budget is in counter cycles, loops run in cpu cycles
+   if (cpu->accel != 1 && cpu->counter >= cpu->accel_slow_until) {
+      cycles *= cpu->accel;
+   }
+
+   uint64_t skipped;
+   switch (cpu->idle_loop.type) {
+      case EWM_CPU_IDLE_LOOP_POLL:
+      case EWM_CPU_IDLE_LOOP_KEYIN:
+         skipped = _cpu_idle_forward_poll(cpu, cycles);
+         break;
+      default:
+         skipped = _cpu_idle_forward_delay(cpu, cycles);
+         break;
+   }
+
+   uint64_t counter = cpu->counter;
+   _cpu_count_cycles(cpu, skipped);
+
+   return cpu->counter - counter;
+}
+
 #if defined(EWM_LUA)
 
 //
@@ -488,6 +897,26 @@ static int cpu_lua_index(lua_State *state) {
       return 1;
    }
 
+   if (strcmp(name, "idle_hits") == 0) {
+      lua_pushnumber(state, cpu->idle_hits);
+      return 1;
+   }
+
+   if (strcmp(name, "idle_cycles") == 0) {
+      lua_pushnumber(state, cpu->idle_cycles);
+      return 1;
+   }
+
+   if (strcmp(name, "delay_hits") == 0) {
+      lua_pushnumber(state, cpu->delay_hits);
+      return 1;
+   }
+
+   if (strcmp(name, "delay_cycles") == 0) {
+      lua_pushnumber(state, cpu->delay_cycles);
+      return 1;
+   }
+
    if (strcmp(name, "model") == 0) {
       switch (cpu->model) {
          case EWM_CPU_MODEL_6502:
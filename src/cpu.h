@@ -38,8 +38,37 @@
 #define EWM_VECTOR_RES 0xfffc
 #define EWM_VECTOR_IRQ 0xfffe
 
+#define EWM_CPU_IDLE_ADDRESSES_MAX (4)
+
+#define EWM_CPU_IDLE_LOOP_POLL  (0) // LDA port / BPL
+#define EWM_CPU_IDLE_LOOP_KEYIN (1) // INC RNDL / BNE / INC RNDH / BIT port / BPL
+#define EWM_CPU_IDLE_LOOP_COUNT (2) // DEX / BNE or DEY / BNE
+#define EWM_CPU_IDLE_LOOP_NEST  (3) // DEY / BNE / DEX / BNE or DEX / BNE / DEY / BNE
+#define EWM_CPU_IDLE_LOOP_SBC   (4) // SBC #1 / BNE
+#define EWM_CPU_IDLE_LOOP_WAIT  (5) // PHA / SBC #1 / BNE / PLA / SBC #1 / BNE, the Monitor WAIT
+
 struct cpu_instruction_t;
 struct ewm_lua_t;
+struct cpu_t;
+
+// Called instead of the instruction at the trap address. Returns the
+// cycles it took, or -1 to run the instruction as usual.
+typedef int (*cpu_trap_handler_t)(struct cpu_t *cpu, void *obj);
+
+// A loop that does nothing but wait for a keyboard soft switch or
+// count down a register. The machine can fast forward through it
+// until the end of its frame or the end of the loop.
+
+struct cpu_idle_loop_t {
+   int type;
+   int cycles;       // Cycles per iteration, or per inner iteration for WAIT
+   int carry_cycles; // Extra cycles when the low byte of the counter wraps
+   uint8_t lo, hi;   // Zero page counter updated by KEYIN
+   uint8_t *count;   // Register counted down by COUNT and NEST
+   uint8_t *inner;   // Inner register of NEST
+   uint16_t start;   // Loop start, the pc while the loop runs
+   uint16_t exit;    // The pc after the loop ends
+};
 
 struct cpu_state_t {
   uint8_t a, x, y, s, sp;
@@ -59,11 +88,40 @@ struct cpu_t {
    uint8_t *ram;
    size_t ram_size;
 
+   uint16_t idle_addresses[EWM_CPU_IDLE_ADDRESSES_MAX];
+   int idle_addresses_count;
+   bool idle;                  // Set when the cpu entered an idle loop
+   struct cpu_idle_loop_t idle_loop;
+   uint64_t idle_hits;         // Number of times an idle loop was skipped
+   uint64_t idle_cycles;       // Cycles skipped in idle loops
+   uint64_t delay_hits;        // Number of times a delay loop was skipped
+   uint64_t delay_cycles;      // Cycles skipped in delay loops
+
+   int accel;                  // Cpu cycles per counter cycle, 1 when not accelerated
+   int accel_cycles;           // Cpu cycles not counted yet
+   uint64_t accel_slow_until;  // Run at normal speed until the counter reaches this
+
+   bool ahead;                 // Running ahead, everything is undone with a snapshot
+   bool ahead_stopped;         // Touched a device that a snapshot cannot undo
+
+   uint16_t trap_address;
+   cpu_trap_handler_t trap_handler;
+   void *trap_obj;
+
 #if defined(EWM_LUA)
    struct ewm_lua_t *lua;
 #endif
 };
 
+// A copy of the cpu and the contents and state of all its memory
+// regions. Only valid for the memory layout it was created for.
+
+struct cpu_snapshot_t {
+   struct cpu_t cpu;
+   size_t length;
+   uint8_t *data;
+};
+
 typedef void (*cpu_instruction_handler_t)(struct cpu_t *cpu);
 typedef void (*cpu_instruction_handler_byte_t)(struct cpu_t *cpu, uint8_t oper);
 typedef void (*cpu_instruction_handler_word_t)(struct cpu_t *cpu, uint16_t oper);
@@ -113,7 +171,12 @@ struct mem_t *cpu_add_iom(struct cpu_t *cpu, uint16_t start, uint16_t end, void
 void cpu_optimize_memory(struct cpu_t *cpu);
 
 void cpu_strict(struct cpu_t *cpu, bool strict);
+void cpu_accelerate(struct cpu_t *cpu, int factor);
+void cpu_slow_down(struct cpu_t *cpu, uint64_t cycles);
+void cpu_set_trap(struct cpu_t *cpu, uint16_t address, cpu_trap_handler_t handler, void *obj);
 int cpu_trace(struct cpu_t *cpu, char *path);
+bool cpu_is_observed(struct cpu_t *cpu);
+bool cpu_stop_ahead(struct cpu_t *cpu);
 
 void cpu_reset(struct cpu_t *cpu);
 int cpu_irq(struct cpu_t *cpu);
@@ -121,6 +184,14 @@ int cpu_nmi(struct cpu_t *cpu);
 
 int cpu_step(struct cpu_t *cpu);
 
+struct cpu_snapshot_t *cpu_snapshot_create(struct cpu_t *cpu);
+void cpu_snapshot_destroy(struct cpu_snapshot_t *snapshot);
+void cpu_snapshot_save(struct cpu_t *cpu, struct cpu_snapshot_t *snapshot);
+void cpu_snapshot_restore(struct cpu_t *cpu, struct cpu_snapshot_t *snapshot);
+
+int cpu_add_idle_address(struct cpu_t *cpu, uint16_t addr);
+uint64_t cpu_idle_forward(struct cpu_t *cpu, uint64_t cycles);
+
 uint16_t cpu_memory_get_word(struct cpu_t *cpu, uint16_t addr);
 uint8_t cpu_memory_get_byte(struct cpu_t *cpu, uint16_t addr);
 
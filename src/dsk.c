@@ -21,19 +21,27 @@
 // SOFTWARE.
 
 #include <assert.h>
+#include <errno.h>
 #include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 
+#include <zlib.h>
+
 #include "mem.h"
 #include "cpu.h"
+#include "ins.h"
 #include "utl.h"
 #if defined(EWM_LUA)
 #include "lua.h"
 #endif
 #include "dsk.h"
+#include "vol.h"
 
 //
 // This implements a 16-sector Disk ][ controller with two drives
@@ -99,6 +107,9 @@ static uint8_t dsk_wr_table[] = {
    0xf7, 0xf9, 0xfa, 0xfb, 0xfc, 0xfd, 0xfe, 0xff
 };
 
+// The reverse of dsk_wr_table, 0xff for nibbles that are not valid
+static uint8_t dsk_rd_table[256];
+
 static int dsk_phase_delta[4][4] = {
    { 0, 1, 2,-1},
    {-1, 0, 1, 2},
@@ -110,12 +121,16 @@ static struct ewm_dsk_drive_t *dsk_drive(struct ewm_dsk_t *dsk) {
    return &dsk->drives[dsk->drive];
 }
 
+static struct ewm_dsk_track_t *dsk_track(struct ewm_dsk_t *dsk, struct ewm_dsk_drive_t *drive, int track_idx);
+static void dsk_flush_drive(struct ewm_dsk_t *dsk, int index);
+
 static void dsk_phase(struct ewm_dsk_t *dsk, int phase, bool on) {
    if (on) {
       //printf("[DSK] Disk #%d phase %d on\n", dsk->drive, phase);
       struct ewm_dsk_drive_t *drive = dsk_drive(dsk);
 
-      drive->track += dsk_phase_delta[drive->phase][phase];
+      int delta = dsk_phase_delta[drive->phase][phase];
+      drive->track += delta;
       drive->phase = phase;
 
       if (drive->track > EWM_DSK_TRACKS * 2 - 1) {
@@ -126,6 +141,15 @@ static void dsk_phase(struct ewm_dsk_t *dsk, int phase, bool on) {
          drive->track = 0;
       }
 
+      // Read ahead the track the head is moving towards. If there is no
+      // memory for it, it is tried again when the track is read.
+      if (drive->loaded && drive->type != EWM_DSK_TYPE_WOZ && delta != 0) {
+         int next = (drive->track >> 1) + (delta > 0 ? 1 : -1);
+         if (next >= 0 && next < EWM_DSK_TRACKS) {
+            (void) dsk_track(dsk, drive, next);
+         }
+      }
+
       //printf("[DSK]     Disk #%d track = %d\n", dsk->drive, drive->track);
    } else {
       //printf("[DSK] Disk #%d phase %d off\n", dsk->drive, phase);
@@ -142,18 +166,23 @@ static uint8_t dsk_read_next(struct ewm_dsk_t *dsk) {
    uint8_t result = 0;
    if (dsk->skip || dsk->mode == EWM_DSK_MODE_WRITE) {
       struct ewm_dsk_drive_t *drive = dsk_drive(dsk);
-      struct ewm_dsk_track_t track = drive->tracks[drive->track >> 1]; // TODO Because drv->track actually goes to 70?
+      struct ewm_dsk_track_t *track = dsk_track(dsk, drive, drive->track >> 1); // TODO Because drv->track actually goes to 70?
+      if (track == NULL) {
+         return 0;
+      }
 
-      //printf("Reading track.data[%d] (track.length = %zu): %.2X\n", drive->head, track.length, track.data[drive->head]);
+      //printf("Reading track.data[%d] (track.length = %zu): %.2X\n", drive->head, track->length, track->data[drive->head]);
 
-      if (drive->head >= track.length) {
+      if (drive->head >= track->length) {
          drive->head = 0;
       }
 
       if (dsk->mode == EWM_DSK_MODE_WRITE) {
-         track.data[drive->head] = dsk->latch; // TODO Implement write support
+         track->data[drive->head] = dsk->latch;
+         track->dirty = true;
+         drive->dirty = true;
       } else {
-         result = track.data[drive->head];
+         result = track->data[drive->head];
       }
 
       drive->head += 1;
@@ -165,11 +194,371 @@ static uint8_t dsk_read_next(struct ewm_dsk_t *dsk) {
    return result;
 }
 
+// Bit stream disks. Instead of stepping the Disk II read logic one bit
+// at a time, the bits that passed the head since the last access are
+// shifted in up to eight at a time with a precomputed table. Leading
+// zeros are ignored, which is how the ten bit sync bytes line up.
+
+#define DSK_SHIFT_HOLD (2) // Bit cells a complete nibble stays in the latch
+
+// Indexed by the shift register and (1 << count) | bits, for up to eight
+// bits. An entry holds the new shift register, the last nibble that was
+// completed or zero, and the bit cells since it was completed.
+static uint32_t dsk_shift_table[128][512];
+static pthread_once_t dsk_shift_table_once = PTHREAD_ONCE_INIT;
+
+static void dsk_build_shift_table(void) {
+   for (int s = 0; s < 128; s++) {
+      for (int index = 1; index < 512; index++) {
+         int count = 0;
+         while ((index >> (count + 1)) != 0) {
+            count++;
+         }
+
+         uint8_t shift = s, nibble = 0, since = 0;
+         for (int i = count - 1; i >= 0; i--) {
+            since++;
+            int bit = (index >> i) & 0x01;
+            if (shift != 0 || bit != 0) {
+               shift = (shift << 1) | bit;
+               if (shift & 0x80) {
+                  nibble = shift;
+                  shift = 0;
+                  since = 0;
+               }
+            }
+         }
+
+         dsk_shift_table[s][index] = shift | (nibble << 8) | (since << 16);
+      }
+   }
+}
+
+static struct ewm_dsk_track_t *dsk_stream_track(struct ewm_dsk_drive_t *drive) {
+   uint8_t idx = drive->tmap[drive->track * 2];
+   if (idx >= drive->streams_count || drive->streams[idx].bits == 0) {
+      return NULL;
+   }
+   return &drive->streams[idx];
+}
+
+static int dsk_stream_bits(struct ewm_dsk_track_t *track, uint32_t bit, int count) {
+   if (bit + count <= track->bits) {
+      int i = bit >> 3, offset = bit & 0x07;
+      uint32_t window = (track->data[i] << 8) | ((offset + count > 8) ? track->data[i + 1] : 0);
+      return (window >> (16 - offset - count)) & ((1 << count) - 1);
+   }
+
+   // Wrap around to the start of the track
+   int bits = 0;
+   for (int i = 0; i < count; i++) {
+      uint32_t b = (bit + i) % track->bits;
+      bits = (bits << 1) | ((track->data[b >> 3] >> (7 - (b & 0x07))) & 0x01);
+   }
+   return bits;
+}
+
+// Shift in the bits that passed the head until the given cpu counter
+
+static void dsk_stream_shift(struct ewm_dsk_stream_t *stream, struct ewm_dsk_track_t *track, uint64_t counter) {
+   uint64_t bits = (counter - stream->time) / EWM_DSK_BIT_CYCLES;
+   stream->time += bits * EWM_DSK_BIT_CYCLES;
+
+   if (track == NULL) {
+      stream->since = (bits < (uint64_t) (255 - stream->since)) ? stream->since + bits : 255;
+      return;
+   }
+
+   // The head keeps its relative position when it moves to a track of
+   // a different length
+   if (stream->length != track->bits) {
+      if (stream->length != 0) {
+         stream->bit = ((uint64_t) stream->bit * track->bits) / stream->length;
+      }
+      stream->bit %= track->bits;
+      stream->length = track->bits;
+   }
+
+   // Only the last bits matter after a whole revolution without reads
+   if (bits > track->bits) {
+      stream->bit = (stream->bit + (bits - 64) % track->bits) % track->bits;
+      bits = 64;
+   }
+
+   while (bits != 0) {
+      int count = (bits < 8) ? bits : 8;
+      uint32_t entry = dsk_shift_table[stream->shift][(1 << count) | dsk_stream_bits(track, stream->bit, count)];
+      stream->shift = entry & 0x7f;
+      if (entry & 0xff00) {
+         stream->nibble = (entry >> 8) & 0xff;
+         stream->since = entry >> 16;
+      } else {
+         stream->since = (stream->since < 255 - count) ? stream->since + count : 255;
+      }
+      stream->bit += count;
+      if (stream->bit >= track->bits) {
+         stream->bit -= track->bits;
+      }
+      bits -= count;
+   }
+}
+
+static uint8_t dsk_stream_latch(struct ewm_dsk_stream_t *stream) {
+   return (stream->since < DSK_SHIFT_HOLD) ? stream->nibble : stream->shift;
+}
+
+// The cpu counter at which the next nibble completes, or 0 if none does
+// within a few bytes
+
+static uint64_t dsk_stream_ready(struct ewm_dsk_stream_t *stream, struct ewm_dsk_track_t *track) {
+   struct ewm_dsk_stream_t next = *stream;
+   for (int i = 0; i < 16; i++) {
+      dsk_stream_shift(&next, track, next.time + 8 * EWM_DSK_BIT_CYCLES);
+      if (next.since < 8) {
+         return next.time - (next.since * EWM_DSK_BIT_CYCLES);
+      }
+   }
+   return 0;
+}
+
+// Sync loop fast forward. Disk code spends most of its time waiting
+// for a prologue or sync byte in a loop like
+//
+//    WAIT  DEY               optional counter, or INY / BNE / INC / BEQ
+//          BEQ FAIL
+//    POLL  LDA $C08C,X
+//          BPL POLL
+//          EOR #$D5          or CMP
+//          BNE WAIT
+//
+// When the latch is polled from the same place twice in a row we check
+// for such a loop and skip the nibbles it would throw away, crediting
+// the cycles and counter it would have spent on them. The nibble it
+// waits for, or the last one before its counter runs out, is read as
+// usual so no data the program keeps is ever skipped. A poll that is
+// not part of such a loop, like in the loops reading a data field,
+// only has its reads of an empty latch skipped.
+
+#define DSK_SYNC_COUNTER_NONE 0
+#define DSK_SYNC_COUNTER_DEY  1
+#define DSK_SYNC_COUNTER_INY  2
+
+struct dsk_sync_loop_t {
+   int counter;
+   bool wait;         // Waits for a nibble, or only for a full latch
+   uint8_t zp;        // High byte of the INY counter
+   uint8_t value;     // Nibble the loop waits for
+   int poll_cycles;   // Cycles for a read without data
+   int loop_cycles;   // Cycles for a nibble that is thrown away
+   int carry_cycles;  // Extra cycles when the INY counter wraps
+   uint8_t y;         // Counter and cycles after the skipped nibbles
+   uint8_t count;
+   uint64_t cycles;
+};
+
+static bool dsk_detect_sync_loop(struct cpu_t *cpu, uint16_t addr, struct dsk_sync_loop_t *loop) {
+   uint16_t poll = cpu->state.pc - 3;
+
+   uint8_t load = mem_get_byte(cpu, poll);
+   if (load == 0xbd || load == 0xbc) {
+      if ((uint16_t) (mem_get_word(cpu, poll + 1) + cpu->state.x) != addr) {
+         return false;
+      }
+   } else if (load == 0xad || load == 0xac) {
+      if (mem_get_word(cpu, poll + 1) != addr) {
+         return false;
+      }
+   } else {
+      return false;
+   }
+
+   if (mem_get_word(cpu, poll + 3) != 0xfb10) {
+      return false;
+   }
+
+   struct cpu_instruction_t *i = cpu->instructions;
+   loop->counter = DSK_SYNC_COUNTER_NONE;
+   loop->wait = false;
+   loop->value = 0;
+   loop->poll_cycles = i[load].cycles + i[0x10].cycles;
+   loop->loop_cycles = 0;
+   loop->carry_cycles = 0;
+   loop->zp = 0;
+
+   uint8_t compare = mem_get_byte(cpu, poll + 5);
+   if ((load != 0xbd && load != 0xad) || (compare != 0x49 && compare != 0xc9) || mem_get_byte(cpu, poll + 7) != 0xd0) {
+      return true;
+   }
+
+   loop->value = mem_get_byte(cpu, poll + 6);
+   loop->loop_cycles = loop->poll_cycles + i[compare].cycles + i[0xd0].cycles;
+
+   uint16_t wait = poll + 9 + (int8_t) mem_get_byte(cpu, poll + 8);
+   if (wait == poll) {
+      loop->wait = true;
+      return true;
+   }
+
+   if (wait == poll - 3 && mem_get_byte(cpu, wait) == 0x88 && mem_get_byte(cpu, wait + 1) == 0xf0) {
+      loop->counter = DSK_SYNC_COUNTER_DEY;
+      loop->wait = true;
+      loop->loop_cycles += i[0x88].cycles + i[0xf0].cycles;
+      return true;
+   }
+
+   // The DOS 3.3 RWTS RDADR routine counts with Y and a zero page byte
+   if (wait == poll - 7 && mem_get_byte(cpu, wait) == 0xc8 && mem_get_word(cpu, wait + 1) == 0x04d0
+         && mem_get_byte(cpu, wait + 3) == 0xe6 && mem_get_byte(cpu, wait + 5) == 0xf0) {
+      loop->counter = DSK_SYNC_COUNTER_INY;
+      loop->wait = true;
+      loop->zp = mem_get_byte(cpu, wait + 4);
+      loop->loop_cycles += i[0xc8].cycles + i[0xd0].cycles;
+      loop->carry_cycles = i[0xe6].cycles + i[0xf0].cycles;
+      return true;
+   }
+
+   return true;
+}
+
+// Account for a nibble the loop throws away. Returns false when its
+// counter runs out on this nibble, which must then be read as usual.
+
+static bool dsk_sync_discard(struct dsk_sync_loop_t *loop) {
+   if (loop->counter == DSK_SYNC_COUNTER_DEY) {
+      if (loop->y == 1) {
+         return false;
+      }
+      loop->y--;
+   } else if (loop->counter == DSK_SYNC_COUNTER_INY) {
+      if (loop->y == 0xff) {
+         if (loop->count == 0xff) {
+            return false;
+         }
+         loop->count++;
+         loop->cycles += loop->carry_cycles;
+      }
+      loop->y++;
+   }
+   loop->cycles += loop->loop_cycles;
+   return true;
+}
+
+// Both look at most one revolution ahead. If nothing stops the loop by
+// then it is left to wait as usual.
+
+static bool dsk_sync_nibbles(struct ewm_dsk_t *dsk, struct dsk_sync_loop_t *loop) {
+   struct ewm_dsk_drive_t *drive = dsk_drive(dsk);
+   struct ewm_dsk_track_t *track = dsk_track(dsk, drive, drive->track >> 1);
+   if (track == NULL) {
+      return false;
+   }
+
+   int head = drive->head, skip = dsk->skip;
+   for (int reads = 0; reads < 2 * track->length; reads++) {
+      int next_head = head;
+      uint8_t nibble = 0;
+      if (skip != 0) {
+         if (next_head >= track->length) {
+            next_head = 0;
+         }
+         nibble = track->data[next_head++];
+      }
+
+      if (nibble & 0x80) {
+         if (!loop->wait || nibble == loop->value || !dsk_sync_discard(loop)) {
+            drive->head = head;
+            dsk->skip = skip;
+            return true;
+         }
+      } else {
+         loop->cycles += loop->poll_cycles;
+      }
+
+      head = next_head;
+      skip = (skip + 1) % 4;
+   }
+
+   return false;
+}
+
+static bool dsk_sync_stream(struct ewm_dsk_t *dsk, uint64_t counter, struct dsk_sync_loop_t *loop) {
+   struct ewm_dsk_track_t *track = dsk_stream_track(dsk_drive(dsk));
+   if (track == NULL) {
+      return false;
+   }
+
+   // A poll that is quicker than a nibble stays in the latch cannot miss
+   // it, so polls of an empty latch are skipped until the next nibble
+   bool quick = loop->poll_cycles <= DSK_SHIFT_HOLD * EWM_DSK_BIT_CYCLES;
+
+   struct ewm_dsk_stream_t stream = dsk->stream;
+   while (loop->cycles < (uint64_t) track->bits * EWM_DSK_BIT_CYCLES) {
+      uint8_t latch = dsk_stream_latch(&stream);
+      if (latch & 0x80) {
+         if (!loop->wait || latch == loop->value || !dsk_sync_discard(loop)) {
+            dsk->stream = stream;
+            return true;
+         }
+      } else {
+         uint64_t now = counter + loop->cycles, ready = quick ? dsk_stream_ready(&stream, track) : 0;
+         uint64_t polls = (ready > now) ? (ready - now + loop->poll_cycles - 1) / loop->poll_cycles : 1;
+         loop->cycles += polls * loop->poll_cycles;
+      }
+      dsk_stream_shift(&stream, track, counter + loop->cycles);
+   }
+
+   return false;
+}
+
+static void dsk_sync_forward(struct ewm_dsk_t *dsk, struct cpu_t *cpu, uint16_t addr) {
+   struct dsk_sync_loop_t loop;
+   if (!dsk_detect_sync_loop(cpu, addr, &loop)) {
+      return;
+   }
+
+   loop.y = cpu->state.y;
+   loop.count = (loop.counter == DSK_SYNC_COUNTER_INY) ? mem_get_byte(cpu, loop.zp) : 0;
+   loop.cycles = 0;
+
+   bool stopped = (dsk_drive(dsk)->type == EWM_DSK_TYPE_WOZ)
+      ? dsk_sync_stream(dsk, cpu->counter, &loop) : dsk_sync_nibbles(dsk, &loop);
+
+   if (stopped && loop.cycles != 0) {
+      cpu->state.y = loop.y;
+      if (loop.counter == DSK_SYNC_COUNTER_INY) {
+         mem_set_byte(cpu, loop.zp, loop.count);
+      }
+      cpu->counter += loop.cycles;
+      dsk->sync_hits++;
+      dsk->sync_cycles += loop.cycles;
+   }
+}
+
 static uint8_t dsk_read(struct cpu_t *cpu, struct mem_t *mem, uint16_t addr) {
    //printf("[DSK] dsk_read at $%.4X\n", addr);
    struct ewm_dsk_t *dsk = (struct ewm_dsk_t*) mem->obj;
    uint8_t result = 0x00;
 
+   // The disk is not part of a snapshot, so running ahead stops here
+   if (cpu_stop_ahead(cpu)) {
+      return 0;
+   }
+
+   // Disk code counts cycles, so an accelerated cpu runs it at normal speed
+   cpu_slow_down(cpu, EWM_DSK_SLOW_DOWN_CYCLES);
+
+   struct ewm_dsk_drive_t *drive = dsk_drive(dsk);
+   drive->access_time = cpu->counter;
+
+   // Bit stream disks turn whether they are read or not
+   bool stream = drive->loaded && drive->type == EWM_DSK_TYPE_WOZ;
+   if (stream) {
+      uint64_t until = (dsk->on || cpu->counter < dsk->motor_off) ? cpu->counter : dsk->motor_off;
+      if (until > dsk->stream.time) {
+         dsk_stream_shift(&dsk->stream, dsk_stream_track(drive), until);
+      }
+   }
+
    switch (addr) {
       case EWM_DISKII_PHASE0OFF:
          dsk_phase(dsk, 0, false);
@@ -198,11 +587,18 @@ static uint8_t dsk_read(struct cpu_t *cpu, struct mem_t *mem, uint16_t addr) {
 
       case EWM_DISKII_DRIVEOFF:
          //printf("[DSK] Drive #%d off\n", dsk->drive);
+         if (dsk->on) {
+            dsk->motor_off = cpu->counter + EWM_DSK_MOTOR_OFF_CYCLES;
+         }
          dsk->on = false;
+         dsk_flush_drive(dsk, dsk->drive);
          // TODO Drive light
          break;
       case EWM_DISKII_DRIVEON:
          //printf("[DSK] Drive #%d on\n", dsk->drive);
+         if (!dsk->on && cpu->counter >= dsk->motor_off) {
+            dsk->stream.time = cpu->counter;
+         }
          dsk->on = true;
          // TODO Drive light
          break;
@@ -221,7 +617,8 @@ static uint8_t dsk_read(struct cpu_t *cpu, struct mem_t *mem, uint16_t addr) {
       case EWM_DISKII_READMODE:
          dsk->mode = EWM_DSK_MODE_READ;
          if (dsk_drive(dsk)->loaded) {
-            result = (dsk_read_next(dsk) & 0x7f) | (dsk_drive(dsk)->readonly ? 0x80 : 0x00);
+            uint8_t latch = stream ? dsk_stream_latch(&dsk->stream) : dsk_read_next(dsk);
+            result = (latch & 0x7f) | (dsk_drive(dsk)->readonly ? 0x80 : 0x00);
          }
          break;
       case EWM_DISKII_WRITEMODE:
@@ -230,7 +627,11 @@ static uint8_t dsk_read(struct cpu_t *cpu, struct mem_t *mem, uint16_t addr) {
 
       case EWM_DISKII_READ:
          if (dsk_drive(dsk)->loaded) {
-            result = dsk_read_next(dsk);
+            if (dsk->mode == EWM_DSK_MODE_READ && cpu->state.pc == dsk->sync_pc && !cpu_is_observed(cpu)) {
+               dsk_sync_forward(dsk, cpu, addr);
+            }
+            dsk->sync_pc = cpu->state.pc;
+            result = stream ? dsk_stream_latch(&dsk->stream) : dsk_read_next(dsk);
          }
          break;
       case EWM_DISKII_WRITE:
@@ -250,6 +651,10 @@ static void dsk_write(struct cpu_t *cpu, struct mem_t *mem, uint16_t addr, uint8
 
    // TODO It is entirely possible that we need to handle to the exact same soft switches as in read
    struct ewm_dsk_t *dsk = (struct ewm_dsk_t*) mem->obj;
+   if (cpu_stop_ahead(cpu)) {
+      return;
+   }
+   cpu_slow_down(cpu, EWM_DSK_SLOW_DOWN_CYCLES);
    switch (addr) {
       case EWM_DISKII_WRITE:
          dsk_write_next(dsk, b);
@@ -349,7 +754,7 @@ static uint8_t *dsk_convert_sector(struct ewm_dsk_t *dsk, struct ewm_dsk_drive_t
    *dst++ = 0xaa;
    *dst++ = 0xad;
 
-   uint8_t nibbles[0x156];
+   uint8_t nibbles[0x156 + 2]; // The first two rounds below write past the end
    uint8_t ptr2 = 0;
    uint8_t ptr6 = 0x56;
 
@@ -393,14 +798,10 @@ static uint8_t *dsk_convert_sector(struct ewm_dsk_t *dsk, struct ewm_dsk_drive_t
    return dst;
 }
 
-static struct ewm_dsk_track_t dsk_convert_track(struct ewm_dsk_t *disk, struct ewm_dsk_drive_t *drive, uint8_t *data, int track_idx, int type) {
-   struct ewm_dsk_track_t track;
-   track.length = dsk_native_track_length(track_idx);
-   track.data = malloc(track.length);
-
+static void dsk_convert_track(struct ewm_dsk_t *disk, struct ewm_dsk_drive_t *drive, uint8_t *data, int track_idx, int type, uint8_t *track_data) {
    uint8_t *sector_ordering = (type == EWM_DSK_TYPE_DO) ? dsk_sector_ordering_do : dsk_sector_ordering_po;
 
-   uint8_t *dst = track.data;
+   uint8_t *dst = track_data;
    for (int sector_idx = 0; sector_idx < EWM_DSK_SECTORS; sector_idx++) {
       int _s = 15 - sector_idx;
       uint8_t *src = data
@@ -408,10 +809,51 @@ static struct ewm_dsk_track_t dsk_convert_track(struct ewm_dsk_t *disk, struct e
          + (_s * EWM_DSK_SECTOR_SIZE);    // Start of sector_idx
       dst = dsk_convert_sector(disk, drive, track_idx, sector_ordering[_s], src, dst);
    }
+}
+
+// Tracks are nibblized the first time the head reads them, into a slot
+// of the drive's arena. Every slot has room for the longest track.
+// Returns NULL when there is no memory for the arena.
+
+static struct ewm_dsk_track_t *dsk_track(struct ewm_dsk_t *dsk, struct ewm_dsk_drive_t *drive, int track_idx) {
+   struct ewm_dsk_track_t *track = &drive->tracks[track_idx];
+   if (track->data != NULL) {
+      return track;
+   }
+
+   if (drive->arena == NULL) {
+      drive->arena = malloc(EWM_DSK_TRACKS * EWM_DSK_NIBBLES_PER_TRACK);
+      if (drive->arena == NULL) {
+         return NULL;
+      }
+   }
+
+   // A disk made from a directory gets its sectors when first read
+   if (drive->vol != NULL) {
+      ewm_vol_fill_track(drive->vol, drive->image, track_idx);
+   }
+
+   track->data = drive->arena + (track_idx * EWM_DSK_NIBBLES_PER_TRACK);
+   if (drive->type == EWM_DSK_TYPE_NIB) {
+      memcpy(track->data, drive->image + (track_idx * EWM_DSK_NIBBLES_PER_TRACK), EWM_DSK_NIBBLES_PER_TRACK);
+      track->length = EWM_DSK_NIBBLES_PER_TRACK;
+   } else {
+      track->length = dsk_native_track_length(track_idx);
+      dsk_convert_track(dsk, drive, drive->image, track_idx, drive->type, track->data);
+   }
 
    return track;
 }
 
+static void dsk_free_tracks(struct ewm_dsk_drive_t *drive) {
+   free(drive->arena);
+   drive->arena = NULL;
+   for (int t = 0; t < EWM_DSK_TRACKS; t++) {
+      drive->tracks[t].data = NULL;
+      drive->tracks[t].length = 0;
+   }
+}
+
 // Disk file parsing
 
 // Public
@@ -422,6 +864,12 @@ static int ewm_dsk_init(struct ewm_dsk_t *dsk, struct cpu_t *cpu) {
    dsk->rom->description = "rom/dsk/$C600";
    dsk->iom = cpu_add_iom(cpu, 0xc0e0, 0xc0ef, dsk, dsk_read, dsk_write);
    dsk->rom->description = "iom/dsk/$C0E0";
+
+   memset(dsk_rd_table, 0xff, sizeof(dsk_rd_table));
+   for (int i = 0; i < (int) sizeof(dsk_wr_table); i++) {
+      dsk_rd_table[dsk_wr_table[i]] = i;
+   }
+
    return 0;
 }
 
@@ -444,15 +892,258 @@ static uint8_t dsk_locate_volume_number(struct ewm_dsk_track_t *track) {
    return 0;
 }
 
-int ewm_dsk_set_disk_data(struct ewm_dsk_t *dsk, uint8_t index, bool readonly, void *data, size_t length, int type) {
-   if (type == EWM_DSK_TYPE_UNKNOWN) {
-      return -1;
+// Decode a 6-and-2 encoded track back into the sectors of the image.
+// This is the reverse of dsk_convert_sector. Only the data fields
+// are decoded, sectors that cannot be decoded keep their old contents.
+
+static uint8_t dsk_track_nibble(struct ewm_dsk_track_t *track, int i) {
+   return track->data[i % track->length];
+}
+
+static bool dsk_decode_sector(struct ewm_dsk_track_t *track, int pos, uint8_t *dst) {
+   uint8_t nibbles[0x156];
+   uint8_t last = 0;
+   for (int i = 0; i < 0x156; i++) {
+      uint8_t val = dsk_rd_table[dsk_track_nibble(track, pos + i)];
+      if (val == 0xff) {
+         return false;
+      }
+      last ^= val;
+      nibbles[i] = last;
    }
 
-   if (index > 1) {
+   if (dsk_rd_table[dsk_track_nibble(track, pos + 0x156)] != last) {
+      return false;
+   }
+
+   // Each of the first 0x56 nibbles holds the low two bits, swapped,
+   // of three bytes. The last round written ends up in the low bits.
+   for (int i = 0; i < 0x100; i++) {
+      int round = (0x101 - i) / 0x56;
+      uint8_t val2 = nibbles[0x55 - ((0x101 - i) % 0x56)] >> (2 * (2 - round));
+      dst[i] = (nibbles[0x56 + i] << 2) | ((val2 & 0x01) << 1) | ((val2 & 0x02) >> 1);
+   }
+
+   return true;
+}
+
+static void dsk_decode_track(struct ewm_dsk_drive_t *drive, int track_idx) {
+   struct ewm_dsk_track_t *track = &drive->tracks[track_idx];
+   uint8_t *sector_ordering = (drive->type == EWM_DSK_TYPE_DO) ? dsk_sector_ordering_do : dsk_sector_ordering_po;
+
+   int decoded = 0;
+   for (int i = 0; i < track->length; i++) {
+      if (dsk_track_nibble(track, i) != 0xd5 || dsk_track_nibble(track, i+1) != 0xaa || dsk_track_nibble(track, i+2) != 0x96) {
+         continue;
+      }
+
+      uint8_t volume = dsk_defourxfour(dsk_track_nibble(track, i+3), dsk_track_nibble(track, i+4));
+      uint8_t t = dsk_defourxfour(dsk_track_nibble(track, i+5), dsk_track_nibble(track, i+6));
+      uint8_t s = dsk_defourxfour(dsk_track_nibble(track, i+7), dsk_track_nibble(track, i+8));
+      uint8_t checksum = dsk_defourxfour(dsk_track_nibble(track, i+9), dsk_track_nibble(track, i+10));
+      if ((volume ^ t ^ s) != checksum || t != track_idx || s >= EWM_DSK_SECTORS) {
+         continue;
+      }
+
+      // The data field follows the address field after a short gap
+      for (int j = i + 14; j < i + 14 + 48; j++) {
+         if (dsk_track_nibble(track, j) == 0xd5 && dsk_track_nibble(track, j+1) == 0xaa && dsk_track_nibble(track, j+2) == 0xad) {
+            for (int _s = 0; _s < EWM_DSK_SECTORS; _s++) {
+               if (sector_ordering[_s] == s) {
+                  uint8_t *dst = drive->image
+                     + (track_idx * EWM_DSK_SECTORS * EWM_DSK_SECTOR_SIZE)
+                     + (_s * EWM_DSK_SECTOR_SIZE);
+                  if (dsk_decode_sector(track, j + 3, dst)) {
+                     decoded |= (1 << s);
+                  }
+               }
+            }
+            break;
+         }
+      }
+   }
+
+   if (decoded != 0xffff) {
+      fprintf(stderr, "[DSK] Could not decode all sectors of track %d, sectors 0x%.4x were kept\n", track_idx, ~decoded & 0xffff);
+   }
+}
+
+static void dsk_decode_dirty_tracks(struct ewm_dsk_drive_t *drive) {
+   for (int t = 0; t < EWM_DSK_TRACKS; t++) {
+      struct ewm_dsk_track_t *track = &drive->tracks[t];
+      if (track->dirty) {
+         if (drive->type == EWM_DSK_TYPE_NIB) {
+            memcpy(drive->image + (t * EWM_DSK_NIBBLES_PER_TRACK), track->data, EWM_DSK_NIBBLES_PER_TRACK);
+         } else {
+            dsk_decode_track(drive, t);
+         }
+         track->dirty = false;
+      }
+   }
+}
+
+// Changed images are written back on a background thread, so that the
+// cpu never waits for the host disk. Jobs are written in the order they
+// were queued. Each file has at most one image waiting to be written, a
+// newer one replaces it. Disks swapped into the same drive are different
+// files, so their jobs are kept apart. A disk made from a directory has
+// a copy of its volume in the job, and the changed files are written back
+// into the directory.
+
+struct ewm_dsk_job_t {
+   char *path;
+   uint8_t *image;
+   size_t length;
+   bool compressed;
+   struct ewm_vol_t *vol;
+   struct ewm_dsk_job_t *next;
+};
+
+struct ewm_dsk_writer_t {
+   pthread_t thread;
+   pthread_mutex_t lock;
+   pthread_cond_t cond;
+   struct ewm_dsk_job_t *jobs; // Waiting to be written, oldest first
+   bool busy;
+};
+
+// The gzip stream gets its own descriptor, so that the file can still
+// be synced after the stream is closed.
+
+static size_t dsk_write_compressed(int fd, uint8_t *image, size_t length) {
+   gzFile gz = gzdopen(dup(fd), "wb");
+   if (gz == NULL) {
+      return 0;
+   }
+   size_t written = gzwrite(gz, image, length);
+   if (gzclose(gz) != Z_OK) {
+      return 0;
+   }
+   return written;
+}
+
+// Images are replaced, so that a crash leaves either the old or the new
+// image
+
+static int dsk_write_image(char *path, uint8_t *image, size_t length, bool compressed) {
+   if (ewm_utl_replace_file(path, image, length, compressed ? dsk_write_compressed : NULL) != 0) {
+      fprintf(stderr, "[DSK] Cannot write %s: %s\n", path, strerror(errno));
       return -1;
    }
+   return 0;
+}
+
+static void *dsk_writer_main(void *data) {
+   struct ewm_dsk_writer_t *writer = (struct ewm_dsk_writer_t*) data;
+   pthread_mutex_lock(&writer->lock);
+   while (true) {
+      struct ewm_dsk_job_t *job = writer->jobs;
+      if (job == NULL) {
+         pthread_cond_wait(&writer->cond, &writer->lock);
+         continue;
+      }
+
+      writer->jobs = job->next;
+      writer->busy = true;
+      pthread_mutex_unlock(&writer->lock);
+
+      if (job->vol != NULL) {
+         (void) ewm_vol_write_back(job->vol, job->image);
+      } else {
+         (void) dsk_write_image(job->path, job->image, job->length, job->compressed);
+      }
+      ewm_vol_destroy(job->vol);
+      free(job->path);
+      free(job->image);
+      free(job);
+
+      pthread_mutex_lock(&writer->lock);
+      writer->busy = false;
+      pthread_cond_broadcast(&writer->cond);
+   }
+   return NULL;
+}
+
+static struct ewm_dsk_writer_t *dsk_writer_create() {
+   struct ewm_dsk_writer_t *writer = (struct ewm_dsk_writer_t*) malloc(sizeof(struct ewm_dsk_writer_t));
+   memset(writer, 0x00, sizeof(struct ewm_dsk_writer_t));
+   pthread_mutex_init(&writer->lock, NULL);
+   pthread_cond_init(&writer->cond, NULL);
+   if (pthread_create(&writer->thread, NULL, dsk_writer_main, writer) != 0) {
+      fprintf(stderr, "[DSK] Cannot create writer thread\n");
+      free(writer);
+      return NULL;
+   }
+   pthread_detach(writer->thread);
+   return writer;
+}
+
+static void dsk_writer_queue(struct ewm_dsk_writer_t *writer, struct ewm_dsk_drive_t *drive) {
+   uint8_t *image = malloc(drive->image_length);
+   memcpy(image, drive->image, drive->image_length);
+   struct ewm_vol_t *vol = (drive->vol != NULL) ? ewm_vol_copy(drive->vol) : NULL;
+
+   pthread_mutex_lock(&writer->lock);
+
+   struct ewm_dsk_job_t **next = &writer->jobs;
+   while (*next != NULL && strcmp((*next)->path, drive->path) != 0) {
+      next = &(*next)->next;
+   }
+
+   struct ewm_dsk_job_t *job = *next;
+   if (job == NULL) {
+      job = (struct ewm_dsk_job_t*) malloc(sizeof(struct ewm_dsk_job_t));
+      memset(job, 0x00, sizeof(struct ewm_dsk_job_t));
+      job->path = strdup(drive->path);
+      *next = job;
+   }
 
+   free(job->image);
+   ewm_vol_destroy(job->vol);
+   job->image = image;
+   job->length = drive->image_length;
+   job->compressed = drive->compressed;
+   job->vol = vol;
+
+   pthread_cond_broadcast(&writer->cond);
+   pthread_mutex_unlock(&writer->lock);
+}
+
+// Decode the dirty tracks of a drive into its image and queue the image
+// to be written back. Decoding a few tracks and copying the image is
+// quick, the writing is done by the writer thread. That includes the
+// host files of a disk made from a directory.
+
+static void dsk_flush_drive(struct ewm_dsk_t *dsk, int index) {
+   struct ewm_dsk_drive_t *drive = &dsk->drives[index];
+   if (!drive->dirty) {
+      return;
+   }
+
+   dsk_decode_dirty_tracks(drive);
+   drive->dirty = false;
+
+   if (drive->path == NULL || drive->readonly || drive->writes == EWM_DSK_WRITES_SESSION) {
+      return;
+   }
+
+   // The decoded tracks are already in the file, the kernel writes them
+   if (drive->vol == NULL && drive->writes == EWM_DSK_WRITES_PERSISTENT) {
+      (void) msync(drive->image, drive->image_length, MS_ASYNC);
+      return;
+   }
+
+   if (dsk->writer == NULL) {
+      dsk->writer = dsk_writer_create();
+      if (dsk->writer == NULL) {
+         return;
+      }
+   }
+
+   dsk_writer_queue(dsk->writer, drive);
+}
+
+static int dsk_check_length(size_t length, int type) {
    if (type == EWM_DSK_TYPE_DO || type == EWM_DSK_TYPE_PO) {
       if (length != (EWM_DSK_TRACKS * EWM_DSK_SECTORS * 256)) {
          return -1;
@@ -462,37 +1153,134 @@ int ewm_dsk_set_disk_data(struct ewm_dsk_t *dsk, uint8_t index, bool readonly, v
          return -1;
       }
    }
+   return 0;
+}
 
-   struct ewm_dsk_drive_t *drive = &dsk->drives[index];
+static void dsk_free_image(struct ewm_dsk_drive_t *drive) {
+   if (drive->mapped) {
+      munmap(drive->image, drive->image_length);
+   } else {
+      free(drive->image);
+   }
+   drive->image = NULL;
+   drive->mapped = false;
+   free(drive->streams);
+   drive->streams = NULL;
+   drive->streams_count = 0;
+}
 
-   for (int t = 0; t < EWM_DSK_TRACKS; t++) {
-      if (drive->tracks[t].data != NULL) {
-         free(drive->tracks[t].data);
-         drive->tracks[t].data = NULL;
-         drive->tracks[t].length = 0;
+// WOZ images, see the WOZ 1 and 2 references at applesaucefdc.com. Only
+// what is needed to read 5.25" disks is used, the quarter track map and
+// the bit streams. These are read straight from the image.
+
+static uint16_t dsk_le16(uint8_t *p) {
+   return p[0] | (p[1] << 8);
+}
+
+static uint32_t dsk_le32(uint8_t *p) {
+   return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t) p[3] << 24);
+}
+
+static int dsk_parse_woz(uint8_t *image, size_t length, uint8_t *tmap, struct ewm_dsk_track_t **streams, int *streams_count) {
+   if (length < 12 || (memcmp(image, "WOZ1", 4) != 0 && memcmp(image, "WOZ2", 4) != 0) || memcmp(image + 4, "\xff\x0a\x0d\x0a", 4) != 0) {
+      return -1;
+   }
+
+   uint8_t *info = NULL, *map = NULL, *trks = NULL;
+   size_t trks_length = 0;
+   for (size_t offset = 12; offset + 8 <= length; ) {
+      uint8_t *chunk = image + offset + 8;
+      size_t size = dsk_le32(image + offset + 4);
+      if (size > length - offset - 8) {
+         break;
       }
+      if (memcmp(image + offset, "INFO", 4) == 0 && size >= 60) {
+         info = chunk;
+      } else if (memcmp(image + offset, "TMAP", 4) == 0 && size >= EWM_DSK_QUARTER_TRACKS) {
+         map = chunk;
+      } else if (memcmp(image + offset, "TRKS", 4) == 0) {
+         trks = chunk;
+         trks_length = size;
+      }
+      offset += 8 + size;
    }
 
-   drive->loaded = true;
-   drive->volume = 254; // Default volume number
-   drive->track = 0;
-   drive->head = 0;
-   drive->phase = 0;
-   drive->readonly = readonly;
-   drive->dirty = false;
+   // Disk type 1 is a 5.25" disk
+   if (info == NULL || map == NULL || trks == NULL || info[1] != 1) {
+      return -1;
+   }
 
-   if (type == EWM_DSK_TYPE_DO || type == EWM_DSK_TYPE_PO) {
-      for (int t = 0; t < EWM_DSK_TRACKS; t++) {
-         drive->tracks[t] = dsk_convert_track(dsk, drive, data, t, type);
+   // WOZ 1 has fixed size tracks, WOZ 2 has a table of where they are
+   bool woz1 = (image[3] == '1');
+   int count = woz1 ? (int) (trks_length / 6656) : EWM_DSK_QUARTER_TRACKS;
+   if (!woz1 && trks_length < EWM_DSK_QUARTER_TRACKS * 8) {
+      return -1;
+   }
+
+   struct ewm_dsk_track_t *tracks = calloc(count, sizeof(struct ewm_dsk_track_t));
+   if (tracks == NULL) {
+      return -1;
+   }
+
+   for (int i = 0; i < count; i++) {
+      struct ewm_dsk_track_t *track = &tracks[i];
+      if (woz1) {
+         track->data = trks + (i * 6656);
+         track->bits = dsk_le16(track->data + 6648);
+         if (track->bits > 6646 * 8) {
+            track->bits = 0;
+         }
+      } else {
+         uint8_t *entry = trks + (i * 8);
+         size_t start = dsk_le16(entry) * 512;
+         track->bits = dsk_le32(entry + 4);
+         track->data = image + start;
+         if (start == 0 || start > length || (track->bits + 7) / 8 > length - start || track->bits > dsk_le16(entry + 2) * 512 * 8) {
+            track->bits = 0;
+         }
       }
-   } else if (type == EWM_DSK_TYPE_NIB) {
-      for (int t = 0; t < EWM_DSK_TRACKS; t++) {
-         drive->tracks[t].length = 6656;
-         drive->tracks[t].data = malloc(6656);
-         memcpy(drive->tracks[t].data, data + (t * 6656), 6656);
+      track->length = (track->bits + 7) / 8;
+   }
+
+   memcpy(tmap, map, EWM_DSK_QUARTER_TRACKS);
+   *streams = tracks;
+   *streams_count = count;
+
+   return 0;
+}
+
+// Load an image into a drive that holds no disk. The drive takes
+// ownership of the image and only nibblizes tracks when they are read,
+// so this is cheap. Only inserting the drive touches the controller.
+
+static int dsk_load(struct ewm_dsk_drive_t *drive, bool readonly, uint8_t *image, size_t length, bool mapped, int type) {
+   memset(drive, 0x00, sizeof(struct ewm_dsk_drive_t));
+
+   if (type == EWM_DSK_TYPE_WOZ) {
+      if (dsk_parse_woz(image, length, drive->tmap, &drive->streams, &drive->streams_count) != 0) {
+         fprintf(stderr, "[DSK] Not a 5.25\" WOZ image\n");
+         return -1;
       }
+      pthread_once(&dsk_shift_table_once, dsk_build_shift_table);
+   }
 
-      uint8_t volume = dsk_locate_volume_number(&drive->tracks[0]);
+   drive->loaded = true;
+   drive->volume = 254; // Default volume number
+   drive->readonly = readonly;
+   drive->type = type;
+   drive->writes = EWM_DSK_WRITES_SESSION;
+   drive->image = image;
+   drive->image_length = length;
+   drive->mapped = mapped;
+
+   // Writing bit streams is not supported yet
+   if (type == EWM_DSK_TYPE_WOZ) {
+      drive->readonly = true;
+   }
+
+   if (type == EWM_DSK_TYPE_NIB) {
+      struct ewm_dsk_track_t track = { .length = EWM_DSK_NIBBLES_PER_TRACK, .data = image };
+      uint8_t volume = dsk_locate_volume_number(&track);
       if (volume != 0) {
          drive->volume = volume;
       }
@@ -501,7 +1289,59 @@ int ewm_dsk_set_disk_data(struct ewm_dsk_t *dsk, uint8_t index, bool readonly, v
    return 0;
 }
 
-static int ewm_dsk_type_from_path(char *path) {
+static void dsk_unload(struct ewm_dsk_drive_t *drive) {
+   dsk_free_tracks(drive);
+   dsk_free_image(drive);
+   free(drive->path);
+   drive->path = NULL;
+   ewm_vol_destroy(drive->vol);
+   drive->vol = NULL;
+}
+
+static void dsk_insert(struct ewm_dsk_t *dsk, uint8_t index, struct ewm_dsk_drive_t *loaded) {
+   // Write back the disk that is ejected
+   dsk_flush_drive(dsk, index);
+   dsk_unload(&dsk->drives[index]);
+   dsk->drives[index] = *loaded;
+}
+
+int ewm_dsk_set_disk_data(struct ewm_dsk_t *dsk, uint8_t index, bool readonly, void *data, size_t length, int type) {
+   if (type == EWM_DSK_TYPE_UNKNOWN) {
+      return -1;
+   }
+
+   if (index > 1) {
+      return -1;
+   }
+
+   if (dsk_check_length(length, type) != 0) {
+      return -1;
+   }
+
+   uint8_t *image = malloc(length);
+   if (image == NULL) {
+      return -1;
+   }
+   memcpy(image, data, length);
+
+   struct ewm_dsk_drive_t loaded;
+   if (dsk_load(&loaded, readonly, image, length, false, type) != 0) {
+      free(image);
+      return -1;
+   }
+
+   dsk_insert(dsk, index, &loaded);
+   return 0;
+}
+
+int ewm_dsk_type_from_path(char *path) {
+   // Compressed images have the type of the image inside
+   if (ewm_utl_endswith(path, ".gz")) {
+      char *inner = strndup(path, strlen(path) - 3);
+      int type = ewm_dsk_type_from_path(inner);
+      free(inner);
+      return type;
+   }
    if (ewm_utl_endswith(path, ".dsk") || ewm_utl_endswith(path, ".do")) {
       return EWM_DSK_TYPE_DO;
    }
@@ -511,10 +1351,71 @@ static int ewm_dsk_type_from_path(char *path) {
    if (ewm_utl_endswith(path, ".nib")) {
       return EWM_DSK_TYPE_NIB;
    }
+   if (ewm_utl_endswith(path, ".woz")) {
+      return EWM_DSK_TYPE_WOZ;
+   }
    return EWM_DSK_TYPE_UNKNOWN;
 }
 
-int ewm_dsk_set_disk_file(struct ewm_dsk_t *dsk, uint8_t drive, bool readonly, char *path) {
+// Compressed images are inflated straight into the image buffer. The
+// gzip trailer has the inflated length, so usually that buffer is
+// allocated once and the data is not copied around.
+
+static uint8_t *dsk_inflate(int fd, size_t file_length, size_t *length) {
+   size_t capacity = 0;
+   uint8_t trailer[4];
+   if (file_length > 4 && pread(fd, trailer, sizeof(trailer), file_length - 4) == sizeof(trailer)) {
+      capacity = dsk_le32(trailer);
+   }
+   if (capacity == 0 || capacity > EWM_DSK_INFLATED_MAX) {
+      capacity = EWM_DSK_TRACKS * EWM_DSK_NIBBLES_PER_TRACK;
+   }
+
+   gzFile gz = gzdopen(dup(fd), "rb");
+   if (gz == NULL) {
+      return NULL;
+   }
+   (void) gzbuffer(gz, 64 * 1024);
+
+   // Read one byte more than expected, to see the end of the stream
+   uint8_t *image = malloc(capacity + 1);
+   size_t used = 0;
+   while (image != NULL) {
+      int n = gzread(gz, image + used, (capacity + 1) - used);
+      if (n <= 0) {
+         if (n < 0 || !gzeof(gz)) {
+            free(image);
+            image = NULL;
+         }
+         break;
+      }
+      used += n;
+      if (used == capacity + 1) {
+         if (capacity >= EWM_DSK_INFLATED_MAX) {
+            free(image);
+            image = NULL;
+            break;
+         }
+         capacity *= 2;
+         uint8_t *larger = realloc(image, capacity + 1);
+         if (larger == NULL) {
+            free(image);
+         }
+         image = larger;
+      }
+   }
+
+   (void) gzclose(gz);
+   *length = used;
+   return image;
+}
+
+static bool dsk_is_compressed(int fd) {
+   uint8_t magic[2];
+   return pread(fd, magic, sizeof(magic), 0) == sizeof(magic) && magic[0] == 0x1f && magic[1] == 0x8b;
+}
+
+static int dsk_load_file(struct ewm_dsk_drive_t *drive, bool readonly, int writes, bool compress, char *path) {
    int type = ewm_dsk_type_from_path(path);
    if (type == EWM_DSK_TYPE_UNKNOWN) {
       return -1;
@@ -525,36 +1426,411 @@ int ewm_dsk_set_disk_file(struct ewm_dsk_t *dsk, uint8_t drive, bool readonly, c
       return -1;
    }
 
+   // Compressed images cannot be mapped. Changes to them only last for
+   // the session, unless they are compressed again on write back.
+   bool compressed = dsk_is_compressed(fd);
+   if (compressed) {
+      writes = compress ? EWM_DSK_WRITES_REPLACE : EWM_DSK_WRITES_SESSION;
+   }
+
+   // Disks we cannot write back to are write protected. In a session
+   // nothing is written back, so any disk can be written to.
+   readonly = readonly || (writes != EWM_DSK_WRITES_SESSION && access(path, W_OK) != 0);
+   if (readonly && writes == EWM_DSK_WRITES_PERSISTENT) {
+      writes = EWM_DSK_WRITES_REPLACE;
+   }
+
+   if (writes == EWM_DSK_WRITES_PERSISTENT) {
+      close(fd);
+      fd = open(path, O_RDWR);
+      if (fd == -1) {
+         return -1;
+      }
+   }
+
    struct stat file_info;
    if (fstat(fd, &file_info) == -1) {
       close(fd);
       return -1;
    }
 
-   if (type == EWM_DSK_TYPE_DO || type == EWM_DSK_TYPE_PO) {
-      if (file_info.st_size != (EWM_DSK_TRACKS * EWM_DSK_SECTORS * 256)) {
-         close(fd);
+   uint8_t *image;
+   size_t length;
+
+   if (compressed) {
+      image = dsk_inflate(fd, file_info.st_size, &length);
+      close(fd);
+      if (image == NULL) {
+         fprintf(stderr, "[DSK] Cannot inflate %s\n", path);
          return -1;
       }
-   } else if (type == EWM_DSK_TYPE_NIB) {
-      if (file_info.st_size != (EWM_DSK_TRACKS * EWM_DSK_NIBBLES_PER_TRACK)) {
+   } else {
+      length = file_info.st_size;
+      if (dsk_check_length(length, type) != 0) {
          close(fd);
          return -1;
       }
-   }
 
-   char *data = calloc(file_info.st_size, 1);
-   if (read(fd, data, file_info.st_size) != file_info.st_size) {
+      // Tracks are nibblized straight from the mapping. A private mapping
+      // shares the page cache with other instances until a track is decoded
+      // into it. A shared mapping is how persistent changes reach the file.
+      int flags = (writes == EWM_DSK_WRITES_PERSISTENT) ? MAP_SHARED : MAP_PRIVATE;
+      image = mmap(NULL, length, PROT_READ | PROT_WRITE, flags, fd, 0);
       close(fd);
+
+      if (image == MAP_FAILED) {
+         fprintf(stderr, "[DSK] Cannot map %s: %s\n", path, strerror(errno));
+         return -1;
+      }
+   }
+
+   if ((compressed && dsk_check_length(length, type) != 0) || dsk_load(drive, readonly, image, length, !compressed, type) != 0) {
+      if (compressed) {
+         free(image);
+      } else {
+         munmap(image, length);
+      }
       return -1;
    }
 
-   close(fd);
+   drive->path = strdup(path);
+   drive->writes = writes;
+   drive->compressed = compressed;
+
+   return 0;
+}
 
-   int result = ewm_dsk_set_disk_data(dsk, drive, readonly, data, file_info.st_size, type);
-   free(data);
+// A directory is inserted as a DOS 3.3 disk with the files in it. The
+// image starts out empty and its tracks are made when they are first
+// read, after which they take the same path as any other .dsk image.
 
-   return result;
+int ewm_dsk_set_disk_directory(struct ewm_dsk_t *dsk, uint8_t index, bool readonly, char *path) {
+   if (index > 1) {
+      return -1;
+   }
+
+   struct ewm_vol_t *vol = ewm_vol_create(path);
+   if (vol == NULL) {
+      return -1;
+   }
+
+   size_t length = EWM_DSK_TRACKS * EWM_DSK_SECTORS * EWM_DSK_SECTOR_SIZE;
+   uint8_t *image = calloc(1, length);
+   if (image == NULL) {
+      ewm_vol_destroy(vol);
+      return -1;
+   }
+
+   struct ewm_dsk_drive_t loaded;
+   if (dsk_load(&loaded, readonly || access(path, W_OK) != 0, image, length, false, EWM_DSK_TYPE_DO) != 0) {
+      ewm_vol_destroy(vol);
+      free(image);
+      return -1;
+   }
+
+   loaded.volume = EWM_VOL_NUMBER;
+   loaded.path = strdup(path);
+   loaded.writes = dsk->writes;
+   loaded.vol = vol;
+
+   dsk_insert(dsk, index, &loaded);
+   return 0;
+}
+
+int ewm_dsk_set_disk_file(struct ewm_dsk_t *dsk, uint8_t index, bool readonly, char *path) {
+   struct stat file_info;
+   if (stat(path, &file_info) == 0 && S_ISDIR(file_info.st_mode)) {
+      return ewm_dsk_set_disk_directory(dsk, index, readonly, path);
+   }
+
+   struct ewm_dsk_drive_t loaded;
+   if (index > 1 || dsk_load_file(&loaded, readonly, dsk->writes, dsk->compress, path) != 0) {
+      return -1;
+   }
+
+   dsk_insert(dsk, index, &loaded);
+   return 0;
+}
+
+// Prepare a disk ahead of time, so that it can be swapped in without
+// any work on the machine thread. All tracks are nibblized, which also
+// brings the whole image into memory. This can run on any thread.
+
+struct ewm_dsk_drive_t *ewm_dsk_prepare(char *path, bool readonly, int writes, bool compress) {
+   struct ewm_dsk_drive_t *drive = (struct ewm_dsk_drive_t*) malloc(sizeof(struct ewm_dsk_drive_t));
+   if (drive == NULL) {
+      return NULL;
+   }
+
+   if (dsk_load_file(drive, readonly, writes, compress, path) != 0) {
+      free(drive);
+      return NULL;
+   }
+
+   if (drive->type != EWM_DSK_TYPE_WOZ) {
+      for (int t = 0; t < EWM_DSK_TRACKS; t++) {
+         if (dsk_track(NULL, drive, t) == NULL) {
+            ewm_dsk_release(drive);
+            return NULL;
+         }
+      }
+   } else {
+      for (size_t i = 0; i < drive->image_length; i += 4096) {
+         (void) *((volatile uint8_t*) &drive->image[i]);
+      }
+   }
+
+   return drive;
+}
+
+void ewm_dsk_release(struct ewm_dsk_drive_t *drive) {
+   if (drive != NULL) {
+      dsk_unload(drive);
+      free(drive);
+   }
+}
+
+// Swap the disk in a drive with a prepared one. The head stays where
+// it is, like it would when the disk is changed on a real drive. The
+// ejected disk is written back and handed back in drive, so that it
+// can be swapped in again later.
+
+int ewm_dsk_swap(struct ewm_dsk_t *dsk, uint8_t index, struct ewm_dsk_drive_t *drive, uint64_t counter) {
+   if (index > 1) {
+      return -1;
+   }
+
+   dsk_flush_drive(dsk, index);
+
+   struct ewm_dsk_drive_t *slot = &dsk->drives[index];
+   struct ewm_dsk_drive_t ejected = *slot;
+   *slot = *drive;
+   slot->track = ejected.track;
+   slot->head = ejected.head;
+   slot->phase = ejected.phase;
+   slot->access_time = counter;
+   *drive = ejected;
+
+   return 0;
+}
+
+void ewm_dsk_set_writes(struct ewm_dsk_t *dsk, int writes) {
+   dsk->writes = writes;
+}
+
+void ewm_dsk_set_compress(struct ewm_dsk_t *dsk, bool compress) {
+   dsk->compress = compress;
+}
+
+// The DOS 3.3 RWTS trap. When DOS calls RWTS to read or write a sector
+// it is copied straight between the image and memory, instead of going
+// through the nibbles and the denibblizing code in DOS. Anything that
+// is not plain DOS 3.3 on a sector image, like a modified RWTS, a .nib
+// image or a format, runs through the Disk II as usual.
+//
+// See Beneath Apple DOS 6-8 for the IOB.
+
+static uint8_t dsk_rwts_signature[] = {
+   0x84,0x48,0x85,0x49,0xa0,0x02,0x8c,0xf8,0x06,0xa0,0x04,0x8c,0xf8,0x04,0xa0,0x01,0xb1,0x48,0xaa
+};
+
+#define EWM_DSK_IOB_TYPE          0x00
+#define EWM_DSK_IOB_SLOT          0x01
+#define EWM_DSK_IOB_DRIVE         0x02
+#define EWM_DSK_IOB_VOLUME        0x03
+#define EWM_DSK_IOB_TRACK         0x04
+#define EWM_DSK_IOB_SECTOR        0x05
+#define EWM_DSK_IOB_BUFFER        0x08
+#define EWM_DSK_IOB_COMMAND       0x0c
+#define EWM_DSK_IOB_STATUS        0x0d
+#define EWM_DSK_IOB_VOLUME_FOUND  0x0e
+#define EWM_DSK_IOB_SLOT_LAST     0x0f
+#define EWM_DSK_IOB_DRIVE_LAST    0x10
+
+#define EWM_DSK_RWTS_SEEK  0x00
+#define EWM_DSK_RWTS_READ  0x01
+#define EWM_DSK_RWTS_WRITE 0x02
+
+#define EWM_DSK_RWTS_WRITE_PROTECTED 0x10
+#define EWM_DSK_RWTS_VOLUME_MISMATCH 0x20
+
+static int dsk_rwts_trap(struct cpu_t *cpu, void *obj) {
+   struct ewm_dsk_t *dsk = (struct ewm_dsk_t*) obj;
+
+   for (int i = 0; i < (int) sizeof(dsk_rwts_signature); i++) {
+      if (mem_get_byte(cpu, EWM_DSK_RWTS_ADDRESS + i) != dsk_rwts_signature[i]) {
+         return -1;
+      }
+   }
+
+   uint16_t iob = (cpu->state.a << 8) | cpu->state.y;
+   uint8_t slot = mem_get_byte(cpu, iob + EWM_DSK_IOB_SLOT);
+   uint8_t drive_number = mem_get_byte(cpu, iob + EWM_DSK_IOB_DRIVE);
+   uint8_t volume = mem_get_byte(cpu, iob + EWM_DSK_IOB_VOLUME);
+   uint8_t track_idx = mem_get_byte(cpu, iob + EWM_DSK_IOB_TRACK);
+   uint8_t sector_idx = mem_get_byte(cpu, iob + EWM_DSK_IOB_SECTOR);
+   uint16_t buffer = mem_get_word(cpu, iob + EWM_DSK_IOB_BUFFER);
+   uint8_t command = mem_get_byte(cpu, iob + EWM_DSK_IOB_COMMAND);
+
+   if (mem_get_byte(cpu, iob + EWM_DSK_IOB_TYPE) != 0x01 || slot != 0x60 || (drive_number != 1 && drive_number != 2)) {
+      return -1;
+   }
+
+   if (command != EWM_DSK_RWTS_SEEK && command != EWM_DSK_RWTS_READ && command != EWM_DSK_RWTS_WRITE) {
+      return -1;
+   }
+
+   // Only images that are sectors can be read and written directly
+   struct ewm_dsk_drive_t *drive = &dsk->drives[drive_number - 1];
+   if (!drive->loaded || (drive->type != EWM_DSK_TYPE_DO && drive->type != EWM_DSK_TYPE_PO)) {
+      return -1;
+   }
+
+   if (track_idx >= EWM_DSK_TRACKS || sector_idx >= EWM_DSK_SECTORS) {
+      return -1;
+   }
+
+   // The disk is not part of a snapshot, so running ahead stops here
+   if (cpu_stop_ahead(cpu)) {
+      return -1;
+   }
+
+   // Changes made through the nibbles have to be in the image first
+   dsk_decode_dirty_tracks(drive);
+   if (drive->vol != NULL) {
+      ewm_vol_fill_track(drive->vol, drive->image, track_idx);
+   }
+
+   // The IOB has the DOS sector number, find where the image has it
+   uint8_t *sector_ordering = (drive->type == EWM_DSK_TYPE_DO) ? dsk_sector_ordering_do : dsk_sector_ordering_po;
+   int _s = 0;
+   while (sector_ordering[_s] != dsk_sector_ordering_do[sector_idx]) {
+      _s++;
+   }
+   uint8_t *data = drive->image
+      + (track_idx * EWM_DSK_SECTORS * EWM_DSK_SECTOR_SIZE)
+      + (_s * EWM_DSK_SECTOR_SIZE);
+
+   uint8_t status = 0x00;
+   if (volume != 0 && volume != drive->volume) {
+      status = EWM_DSK_RWTS_VOLUME_MISMATCH;
+   } else if (command == EWM_DSK_RWTS_READ) {
+      for (int i = 0; i < EWM_DSK_SECTOR_SIZE; i++) {
+         mem_set_byte(cpu, buffer + i, data[i]);
+      }
+      dsk->rwts_sectors++;
+   } else if (command == EWM_DSK_RWTS_WRITE) {
+      if (drive->readonly) {
+         status = EWM_DSK_RWTS_WRITE_PROTECTED;
+      } else {
+         for (int i = 0; i < EWM_DSK_SECTOR_SIZE; i++) {
+            data[i] = mem_get_byte(cpu, buffer + i);
+         }
+         // The track is nibblized again from the image when it is read
+         drive->tracks[track_idx].data = NULL;
+         drive->dirty = true;
+         dsk->rwts_sectors++;
+      }
+   }
+
+   mem_set_byte(cpu, iob + EWM_DSK_IOB_STATUS, status);
+   mem_set_byte(cpu, iob + EWM_DSK_IOB_VOLUME_FOUND, drive->volume);
+   mem_set_byte(cpu, iob + EWM_DSK_IOB_SLOT_LAST, slot);
+   mem_set_byte(cpu, iob + EWM_DSK_IOB_DRIVE_LAST, drive_number);
+
+   // RWTS leaves the IOB address here and returns with the carry set on errors
+   mem_set_byte(cpu, 0x48, cpu->state.y);
+   mem_set_byte(cpu, 0x49, cpu->state.a);
+   cpu->state.a = status;
+   cpu->state.c = (status != 0x00);
+   cpu->state.pc = _cpu_pull_word(cpu) + 1;
+
+   return EWM_DSK_RWTS_CYCLES;
+}
+
+void ewm_dsk_set_rwts_trap(struct ewm_dsk_t *dsk, struct cpu_t *cpu, bool enabled) {
+   if (enabled) {
+      cpu_set_trap(cpu, EWM_DSK_RWTS_ADDRESS, dsk_rwts_trap, dsk);
+   } else {
+      cpu_set_trap(cpu, 0x0000, NULL, NULL);
+   }
+}
+
+// Free the nibblized tracks of drives that have not been used for a
+// while. They are nibblized again from the image when needed. Drives
+// that were written to keep their tracks, since the image does not
+// have those changes.
+
+void ewm_dsk_reclaim(struct ewm_dsk_t *dsk, uint64_t counter) {
+   for (int i = 0; i < 2; i++) {
+      struct ewm_dsk_drive_t *drive = &dsk->drives[i];
+      if (drive->arena != NULL && !drive->dirty && !(dsk->on && dsk->drive == i)
+            && counter - drive->access_time > EWM_DSK_RECLAIM_CYCLES) {
+         dsk_free_tracks(drive);
+      }
+   }
+}
+
+// Write back all drives that were written to
+
+void ewm_dsk_flush(struct ewm_dsk_t *dsk) {
+   for (int i = 0; i < 2; i++) {
+      dsk_flush_drive(dsk, i);
+   }
+}
+
+// Write back all drives and wait until they are written
+
+void ewm_dsk_sync(struct ewm_dsk_t *dsk) {
+   ewm_dsk_flush(dsk);
+
+   for (int i = 0; i < 2; i++) {
+      struct ewm_dsk_drive_t *drive = &dsk->drives[i];
+      if (drive->image != NULL && drive->writes == EWM_DSK_WRITES_PERSISTENT) {
+         (void) msync(drive->image, drive->image_length, MS_SYNC);
+      }
+   }
+
+   struct ewm_dsk_writer_t *writer = dsk->writer;
+   if (writer != NULL) {
+      pthread_mutex_lock(&writer->lock);
+      while (writer->busy || writer->jobs != NULL) {
+         pthread_cond_wait(&writer->cond, &writer->lock);
+      }
+      pthread_mutex_unlock(&writer->lock);
+   }
+}
+
+void ewm_dsk_save_state(struct ewm_dsk_t *dsk, struct ewm_dsk_state_t *state) {
+   state->on = dsk->on;
+   state->active_drive = dsk->active_drive;
+   state->mode = dsk->mode;
+   state->latch = dsk->latch;
+   state->drive = dsk->drive;
+   state->skip = dsk->skip;
+   state->stream = dsk->stream;
+   state->motor_off = dsk->motor_off;
+   for (int i = 0; i < 2; i++) {
+      state->drives[i].track = dsk->drives[i].track;
+      state->drives[i].head = dsk->drives[i].head;
+      state->drives[i].phase = dsk->drives[i].phase;
+   }
+}
+
+void ewm_dsk_restore_state(struct ewm_dsk_t *dsk, struct ewm_dsk_state_t *state) {
+   dsk->on = state->on;
+   dsk->active_drive = state->active_drive;
+   dsk->mode = state->mode;
+   dsk->latch = state->latch;
+   dsk->drive = state->drive;
+   dsk->skip = state->skip;
+   dsk->stream = state->stream;
+   dsk->motor_off = state->motor_off;
+   for (int i = 0; i < 2; i++) {
+      dsk->drives[i].track = state->drives[i].track;
+      dsk->drives[i].head = state->drives[i].head;
+      dsk->drives[i].phase = state->drives[i].phase;
+   }
 }
 
 #if defined(EWM_LUA)
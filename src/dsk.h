@@ -32,6 +32,8 @@
 
 struct cpu_t;
 struct mem_t;
+struct ewm_dsk_writer_t;
+struct ewm_vol_t;
 
 #define EWM_DSK_DRIVE1 (0)
 #define EWM_DSK_DRIVE2 (1)
@@ -40,10 +42,40 @@ struct mem_t;
 #define EWM_DSK_SECTORS (16)
 #define EWM_DSK_SECTOR_SIZE (256)
 #define EWM_DSK_NIBBLES_PER_TRACK (6656)
+#define EWM_DSK_QUARTER_TRACKS (160)
+#define EWM_DSK_BIT_CYCLES (4) // A bit cell passes the head every 4us
+#define EWM_DSK_MOTOR_OFF_CYCLES (1023000) // The motor keeps turning for a second after it is turned off
+
+#define EWM_DSK_SLOW_DOWN_CYCLES (51150) // 50ms, like the Zip Chip
+
+#define EWM_DSK_WRITES_REPLACE    (0) // Write changes to a new file that replaces the image
+#define EWM_DSK_WRITES_SESSION    (1) // Keep changes in memory, they are gone on exit
+#define EWM_DSK_WRITES_PERSISTENT (2) // Write changes into the mapped image
+
+#define EWM_DSK_INFLATED_MAX (16 * 1024 * 1024) // Largest compressed image we inflate
+
+#define EWM_DSK_RWTS_ADDRESS (0xbd00) // DOS 3.3 RWTS entry point in 48K
+#define EWM_DSK_RWTS_CYCLES (4096)    // What a sector read or write through the trap costs
+
+#define EWM_DSK_RECLAIM_CYCLES (10230000) // Free the tracks of drives idle for 10s
 
 struct ewm_dsk_track_t {
    int length;
-   uint8_t *data;
+   uint8_t *data; // NULL until the track is nibblized
+   uint32_t bits; // Length of a bit stream track, 0 for nibble tracks
+   bool dirty;    // Written to since it was last decoded into the image
+};
+
+// The read logic for bit stream disks. Bits shift in as the disk turns
+// under the head. A complete nibble stays in the latch for two bit cells.
+
+struct ewm_dsk_stream_t {
+   uint64_t time;   // Cpu counter up to which bits were shifted in
+   uint32_t bit;    // Head position in the bit stream
+   uint32_t length; // Length of the stream the position is in
+   uint8_t shift;   // Shift register, the nibble being read
+   uint8_t nibble;  // Last complete nibble
+   uint8_t since;   // Bit cells since it completed
 };
 
 struct ewm_dsk_drive_t {
@@ -51,8 +83,21 @@ struct ewm_dsk_drive_t {
    uint8_t volume;
    int track, head, phase;
    bool readonly;
-   bool dirty;
+   bool dirty;             // Some tracks are dirty
+   int type;
+   char *path;             // Where changes are written back, NULL to not write back
+   int writes;
+   uint8_t *image;         // The disk image, tracks are nibblized from this on first access
+   size_t image_length;
+   bool mapped;            // The image is mapped from the file
+   bool compressed;        // The file is gzip compressed, and is written back compressed
+   struct ewm_vol_t *vol;  // The directory the disk is made from, NULL for images
+   uint8_t *arena;         // Room for all tracks, allocated on first access
+   uint64_t access_time;   // Cpu counter at the last access
    struct ewm_dsk_track_t tracks[EWM_DSK_TRACKS];
+   uint8_t tmap[EWM_DSK_QUARTER_TRACKS]; // Bit stream under each quarter track, 0xff for none
+   struct ewm_dsk_track_t *streams;      // Bit streams of a WOZ image, pointing into the image
+   int streams_count;
 };
 
 struct ewm_dsk_t {
@@ -65,19 +110,62 @@ struct ewm_dsk_t {
    struct ewm_dsk_drive_t drives[2];
    uint8_t drive; // 0 based
    int skip;
+   struct ewm_dsk_stream_t stream;
+   uint64_t motor_off; // Cpu counter at which the motor stops turning
+   int writes;    // How changes are written back for disks inserted from now on
+   bool compress; // Write changes to compressed images back, instead of keeping them for the session
+   struct ewm_dsk_writer_t *writer;
+   uint64_t rwts_sectors; // Sectors read or written through the RWTS trap
+   uint16_t sync_pc; // Where the latch was last read from
+   uint64_t sync_hits; // Number of times a sync loop was skipped
+   uint64_t sync_cycles; // Cycles skipped in sync loops
 #if defined(EWM_LUA)
    struct ewm_lua_t *lua;
 #endif
 };
 
+// The state of the controller and the drive heads, but not the disk
+// contents, which is enough to snapshot a machine that is not writing.
+
+struct ewm_dsk_state_t {
+   bool on;
+   int active_drive;
+   int mode;
+   uint8_t latch;
+   uint8_t drive;
+   int skip;
+   struct ewm_dsk_stream_t stream;
+   uint64_t motor_off;
+   struct {
+      int track, head, phase;
+   } drives[2];
+};
+
 #define EWM_DSK_TYPE_UNKNOWN (-1)
 #define EWM_DSK_TYPE_DO (0)
 #define EWM_DSK_TYPE_PO (1)
 #define EWM_DSK_TYPE_NIB (2)
+#define EWM_DSK_TYPE_WOZ (3)
 
 struct ewm_dsk_t *ewm_dsk_create(struct cpu_t *cpu);
 int ewm_dsk_set_disk_data(struct ewm_dsk_t *dsk, uint8_t index, bool readonly, void *data, size_t length, int type);
 int ewm_dsk_set_disk_file(struct ewm_dsk_t *dsk, uint8_t index, bool readonly, char *path);
+int ewm_dsk_set_disk_directory(struct ewm_dsk_t *dsk, uint8_t index, bool readonly, char *path);
+int ewm_dsk_type_from_path(char *path);
+void ewm_dsk_set_writes(struct ewm_dsk_t *dsk, int writes);
+void ewm_dsk_set_compress(struct ewm_dsk_t *dsk, bool compress);
+void ewm_dsk_set_rwts_trap(struct ewm_dsk_t *dsk, struct cpu_t *cpu, bool enabled);
+
+struct ewm_dsk_drive_t *ewm_dsk_prepare(char *path, bool readonly, int writes, bool compress);
+void ewm_dsk_release(struct ewm_dsk_drive_t *drive);
+int ewm_dsk_swap(struct ewm_dsk_t *dsk, uint8_t index, struct ewm_dsk_drive_t *drive, uint64_t counter);
+
+void ewm_dsk_reclaim(struct ewm_dsk_t *dsk, uint64_t counter);
+void ewm_dsk_flush(struct ewm_dsk_t *dsk);
+void ewm_dsk_sync(struct ewm_dsk_t *dsk);
+
+void ewm_dsk_save_state(struct ewm_dsk_t *dsk, struct ewm_dsk_state_t *state);
+void ewm_dsk_restore_state(struct ewm_dsk_t *dsk, struct ewm_dsk_state_t *state);
 
 #if defined(EWM_LUA)
 int ewm_dsk_init_lua(struct ewm_dsk_t *dsk, struct ewm_lua_t *lua);
@@ -0,0 +1,315 @@
+// The MIT License (MIT)
+//
+// Copyright (c) 2015 Stefan Arentz - http://github.com/st3fan/ewm
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cpu.h"
+#include "mem.h"
+#include "dsk.h"
+
+// Tests for the DOS 3.3 RWTS trap. Each test calls RWTS through a JSR
+// at $0300 with an IOB at $B7E8, like DOS does.
+
+#define IOB (0xb7e8)
+#define BUFFER (0x2000)
+
+#define PHASE0ON  (0xc0e1)
+#define DRIVE1    (0xc0ea)
+#define DRIVE2    (0xc0eb)
+#define READ      (0xc0ec)
+#define WRITE     (0xc0ed)
+#define READMODE  (0xc0ee)
+#define WRITEMODE (0xc0ef)
+
+#define IMAGE_LENGTH (EWM_DSK_TRACKS * EWM_DSK_SECTORS * EWM_DSK_SECTOR_SIZE)
+
+static uint8_t rwts_signature[] = {
+   0x84,0x48,0x85,0x49,0xa0,0x02,0x8c,0xf8,0x06,0xa0,0x04,0x8c,0xf8,0x04,0xa0,0x01,0xb1,0x48,0xaa
+};
+
+static struct cpu_t *setup(struct ewm_dsk_t **dsk, void *image, size_t length, int type) {
+   struct cpu_t *cpu = cpu_create(EWM_CPU_MODEL_6502);
+   cpu_add_ram(cpu, 0x0000, 0xbfff);
+   *dsk = ewm_dsk_create(cpu);
+   cpu_optimize_memory(cpu);
+
+   if (ewm_dsk_set_disk_data(*dsk, 0, false, image, length, type) != 0) {
+      fprintf(stderr, "TEST   Cannot insert disk of type %d\n", type);
+      exit(1);
+   }
+   ewm_dsk_set_rwts_trap(*dsk, cpu, true);
+
+   for (int i = 0; i < (int) sizeof(rwts_signature); i++) {
+      mem_set_byte(cpu, EWM_DSK_RWTS_ADDRESS + i, rwts_signature[i]);
+   }
+
+   return cpu;
+}
+
+// Run JSR $BD00 and the instruction at $BD00. Returns true if the trap
+// handled the call, which returns straight to the caller.
+
+static bool rwts(struct cpu_t *cpu, uint8_t command, uint8_t track, uint8_t sector) {
+   uint8_t iob[] = { 0x01, 0x60, 0x01, 0x00, track, sector, 0x00, 0x00, BUFFER & 0xff, BUFFER >> 8, 0x00, 0x00, command, 0x00 };
+   for (int i = 0; i < (int) sizeof(iob); i++) {
+      mem_set_byte(cpu, IOB + i, iob[i]);
+   }
+
+   uint8_t code[] = { 0x20, 0x00, 0xbd, 0xea }; // JSR $BD00, NOP
+   for (int i = 0; i < (int) sizeof(code); i++) {
+      mem_set_byte(cpu, 0x0300 + i, code[i]);
+   }
+
+   cpu->state.pc = 0x0300;
+   cpu->state.a = IOB >> 8;
+   cpu->state.y = IOB & 0xff;
+   cpu->state.sp = 0xff;
+
+   cpu_step(cpu);
+   cpu_step(cpu);
+
+   return cpu->state.pc == 0x0303;
+}
+
+static int test_read_dsk() {
+   size_t length = EWM_DSK_TRACKS * EWM_DSK_SECTORS * EWM_DSK_SECTOR_SIZE;
+   uint8_t *image = malloc(length);
+   for (size_t i = 0; i < length; i++) {
+      image[i] = i / EWM_DSK_SECTOR_SIZE;
+   }
+
+   struct ewm_dsk_t *dsk;
+   struct cpu_t *cpu = setup(&dsk, image, length, EWM_DSK_TYPE_DO);
+   free(image);
+
+   if (!rwts(cpu, 0x01, 17, 0)) {
+      fprintf(stderr, "TEST   Read from a .dsk image was not trapped\n");
+      return -1;
+   }
+
+   uint8_t expected = (17 * EWM_DSK_SECTORS) & 0xff;
+   for (int i = 0; i < EWM_DSK_SECTOR_SIZE; i++) {
+      if (mem_get_byte(cpu, BUFFER + i) != expected) {
+         fprintf(stderr, "TEST   Read wrong data from a .dsk image at offset %d\n", i);
+         return -1;
+      }
+   }
+
+   return 0;
+}
+
+// A WOZ image is a bit stream with chunks, not sectors. The trap must
+// leave it to the real RWTS.
+
+static int test_read_woz() {
+   size_t length = 2048;
+   uint8_t *image = calloc(1, length);
+   memcpy(image, "WOZ2\xff\x0a\x0d\x0a", 8);
+
+   uint8_t *chunk = image + 12;
+   memcpy(chunk, "INFO", 4);
+   chunk[4] = 60;
+   chunk[8] = 2;  // Version
+   chunk[9] = 1;  // 5.25" disk
+   chunk += 8 + 60;
+
+   memcpy(chunk, "TMAP", 4);
+   chunk[4] = 160;
+   memset(chunk + 8, 0xff, 160);
+   chunk[8] = 0;  // Only track 0 has data
+   chunk += 8 + 160;
+
+   memcpy(chunk, "TRKS", 4);
+   uint32_t size = length - (chunk - image) - 8;
+   memcpy(chunk + 4, &size, 4);
+   chunk[8] = (length - 512) / 512;  // Starting block
+   chunk[10] = 1;                    // Block count
+   uint32_t bits = 4000;
+   memcpy(chunk + 12, &bits, 4);
+
+   struct ewm_dsk_t *dsk;
+   struct cpu_t *cpu = setup(&dsk, image, length, EWM_DSK_TYPE_WOZ);
+   free(image);
+
+   if (rwts(cpu, 0x01, 17, 0) || dsk->rwts_sectors != 0) {
+      fprintf(stderr, "TEST   Read from a .woz image was trapped\n");
+      return -1;
+   }
+
+   return 0;
+}
+
+// While running ahead the trap must not write, since the disk is not
+// part of the snapshot
+
+static int test_write_ahead() {
+   size_t length = EWM_DSK_TRACKS * EWM_DSK_SECTORS * EWM_DSK_SECTOR_SIZE;
+   uint8_t *image = calloc(1, length);
+
+   struct ewm_dsk_t *dsk;
+   struct cpu_t *cpu = setup(&dsk, image, length, EWM_DSK_TYPE_DO);
+   free(image);
+
+   for (int i = 0; i < EWM_DSK_SECTOR_SIZE; i++) {
+      mem_set_byte(cpu, BUFFER + i, 0xaa);
+   }
+
+   cpu->ahead = true;
+   if (rwts(cpu, 0x02, 17, 0) || !cpu->ahead_stopped || dsk->drives[0].dirty) {
+      fprintf(stderr, "TEST   Write was trapped while running ahead\n");
+      return -1;
+   }
+
+   return 0;
+}
+
+// Tests for decoding written tracks back into the image. The head is
+// moved with the phase switches, and a track is nibblized when the
+// head reads it.
+
+static uint8_t *random_image(unsigned int seed) {
+   uint8_t *image = malloc(IMAGE_LENGTH);
+   srand(seed);
+   for (size_t i = 0; i < IMAGE_LENGTH; i++) {
+      image[i] = rand();
+   }
+   return image;
+}
+
+static void seek(struct cpu_t *cpu, struct ewm_dsk_t *dsk, int track) {
+   struct ewm_dsk_drive_t *drive = &dsk->drives[dsk->drive];
+   while (drive->track < track * 2) {
+      mem_get_byte(cpu, PHASE0ON + ((drive->phase + 1) % 4) * 2);
+   }
+
+   // Only every fourth read in read mode reaches the disk
+   for (int i = 0; i < 4; i++) {
+      mem_get_byte(cpu, READMODE);
+   }
+}
+
+static int test_decode_tracks(int type) {
+   uint8_t *image = random_image(type + 1);
+
+   struct ewm_dsk_t *dsk;
+   struct cpu_t *cpu = setup(&dsk, image, IMAGE_LENGTH, type);
+
+   struct ewm_dsk_drive_t *drive = &dsk->drives[0];
+   for (int t = 0; t < EWM_DSK_TRACKS; t++) {
+      seek(cpu, dsk, t);
+      if (drive->tracks[t].data == NULL) {
+         fprintf(stderr, "TEST   Track %d of a type %d image was not nibblized\n", t, type);
+         return -1;
+      }
+      drive->tracks[t].dirty = true;
+   }
+   drive->dirty = true;
+
+   memset(drive->image, 0x00, IMAGE_LENGTH);
+   ewm_dsk_flush(dsk);
+
+   int result = 0;
+   if (memcmp(drive->image, image, IMAGE_LENGTH) != 0) {
+      fprintf(stderr, "TEST   Decoded tracks of a type %d image do not match the image\n", type);
+      result = -1;
+   }
+
+   free(image);
+   return result;
+}
+
+// Write the nibbles of a track of the second drive over the same track
+// of the first, like a program writing through the data latch does
+
+static int test_decode_written_track() {
+   int t = 5;
+   uint8_t *image = random_image(10);
+   uint8_t *other = random_image(11);
+
+   struct ewm_dsk_t *dsk;
+   struct cpu_t *cpu = setup(&dsk, image, IMAGE_LENGTH, EWM_DSK_TYPE_DO);
+   if (ewm_dsk_set_disk_data(dsk, 1, false, other, IMAGE_LENGTH, EWM_DSK_TYPE_DO) != 0) {
+      fprintf(stderr, "TEST   Cannot insert the second disk\n");
+      return -1;
+   }
+
+   mem_get_byte(cpu, DRIVE2);
+   seek(cpu, dsk, t);
+   struct ewm_dsk_track_t *source = &dsk->drives[1].tracks[t];
+
+   mem_get_byte(cpu, DRIVE1);
+   seek(cpu, dsk, t);
+
+   mem_get_byte(cpu, WRITEMODE);
+   for (int i = 0; i < source->length; i++) {
+      mem_set_byte(cpu, WRITE, source->data[i]);
+      mem_get_byte(cpu, READ);
+   }
+   mem_get_byte(cpu, READMODE);
+
+   struct ewm_dsk_drive_t *drive = &dsk->drives[0];
+   if (!drive->dirty || !drive->tracks[t].dirty) {
+      fprintf(stderr, "TEST   Writing nibbles did not mark the track dirty\n");
+      return -1;
+   }
+
+   ewm_dsk_flush(dsk);
+
+   size_t track_length = EWM_DSK_SECTORS * EWM_DSK_SECTOR_SIZE;
+   size_t offset = t * track_length;
+   int result = 0;
+   if (memcmp(drive->image + offset, other + offset, track_length) != 0) {
+      fprintf(stderr, "TEST   Written track was not decoded into the image\n");
+      result = -1;
+   }
+   if (memcmp(drive->image, image, offset) != 0 || memcmp(drive->image + offset + track_length, image + offset + track_length, IMAGE_LENGTH - offset - track_length) != 0) {
+      fprintf(stderr, "TEST   Writing a track changed other tracks\n");
+      result = -1;
+   }
+
+   free(image);
+   free(other);
+   return result;
+}
+
+int main() {
+   int failures = 0;
+
+   fprintf(stderr, "TEST Running RWTS trap tests\n");
+   failures += (test_read_dsk() != 0);
+   failures += (test_read_woz() != 0);
+   failures += (test_write_ahead() != 0);
+
+   fprintf(stderr, "TEST Running track decoding tests\n");
+   failures += (test_decode_tracks(EWM_DSK_TYPE_DO) != 0);
+   failures += (test_decode_tracks(EWM_DSK_TYPE_PO) != 0);
+   failures += (test_decode_written_track() != 0);
+
+   if (failures == 0) {
+      fprintf(stderr, "TEST   Success\n");
+   }
+
+   return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,250 @@
+// The MIT License (MIT)
+//
+// Copyright (c) 2017 Stefan Arentz - http://github.com/st3fan/ewm
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "cpu.h"
+#include "mem.h"
+#include "hdv.h"
+
+#define HDV_DRIVER_OFFSET (0x30)
+
+// The ROM is put together for the slot the card is in. The first bytes
+// are the signature the Autostart ROM and ProDOS look for. Booting reads
+// block 0 to $0800 through the driver and runs it, like the Disk II
+// does with sector 0. The driver stores to the card to run the call with
+// the parameters in the zero page, then loads the result.
+
+static void hdv_build_rom(struct ewm_hdv_t *hdv) {
+   uint8_t cn = 0xc0 + hdv->slot;
+   uint8_t io = 0x80 + hdv->slot * 16;
+
+   uint8_t boot[] = {
+      0xa2, 0x20,                    // LDX #$20
+      0xa0, 0x00,                    // LDY #$00
+      0xa2, 0x03,                    // LDX #$03
+      0x86, 0x3c,                    // STX $3C
+      0xa9, EWM_HDV_CMD_READ,        // LDA #READ
+      0x85, EWM_HDV_CMD,             // STA CMD
+      0xa9, hdv->slot * 16,          // LDA #SLOT*16
+      0x85, EWM_HDV_UNIT,            // STA UNIT
+      0xa9, 0x00,                    // LDA #$00
+      0x85, EWM_HDV_BUFFER,          // STA BUFFER
+      0x85, EWM_HDV_BLOCK,           // STA BLOCK
+      0x85, EWM_HDV_BLOCK + 1,       // STA BLOCK+1
+      0xa9, 0x08,                    // LDA #$08
+      0x85, EWM_HDV_BUFFER + 1,      // STA BUFFER+1
+      0x20, HDV_DRIVER_OFFSET, cn,   // JSR DRIVER
+      0xb0, 0x05,                    // BCS FAIL
+      0xa6, EWM_HDV_UNIT,            // LDX UNIT
+      0x4c, 0x01, 0x08,              // JMP $0801
+      0x4c, 0x00, 0xe0,              // FAIL: JMP $E000
+   };
+
+   uint8_t driver[] = {
+      0x8d, io + 0, 0xc0,            // STA $C0n0
+      0xad, io + 1, 0xc0,            // LDA $C0n1 ; Error
+      0xae, io + 2, 0xc0,            // LDX $C0n2 ; Blocks
+      0xac, io + 3, 0xc0,            // LDY $C0n3
+      0xc9, 0x01,                    // CMP #$01  ; Carry is set on errors
+      0x60,                          // RTS
+   };
+
+   memset(hdv->rom_data, 0x00, sizeof(hdv->rom_data));
+   memcpy(hdv->rom_data, boot, sizeof(boot));
+   memcpy(hdv->rom_data + HDV_DRIVER_OFFSET, driver, sizeof(driver));
+   hdv->rom_data[0xfc] = hdv->blocks & 0xff;
+   hdv->rom_data[0xfd] = hdv->blocks >> 8;
+   hdv->rom_data[0xfe] = 0x07; // One volume that supports status, read and write
+   hdv->rom_data[0xff] = HDV_DRIVER_OFFSET;
+}
+
+static uint8_t hdv_call(struct ewm_hdv_t *hdv, struct cpu_t *cpu) {
+   uint8_t command = mem_get_byte(cpu, EWM_HDV_CMD);
+   uint8_t unit = mem_get_byte(cpu, EWM_HDV_UNIT);
+   uint16_t buffer = mem_get_word(cpu, EWM_HDV_BUFFER);
+   uint16_t block = mem_get_word(cpu, EWM_HDV_BLOCK);
+
+   // There is only drive 1
+   if (hdv->image == NULL || (unit & 0x80) != 0) {
+      return EWM_HDV_ERR_NO_DEVICE;
+   }
+
+   switch (command) {
+      case EWM_HDV_CMD_STATUS:
+         return hdv->readonly ? EWM_HDV_ERR_WRITE_PROTECTED : EWM_HDV_ERR_NONE;
+      case EWM_HDV_CMD_READ: {
+         if (block >= hdv->blocks) {
+            return EWM_HDV_ERR_IO;
+         }
+         uint8_t *data = hdv->image + (block * EWM_HDV_BLOCK_SIZE);
+         for (int i = 0; i < EWM_HDV_BLOCK_SIZE; i++) {
+            mem_set_byte(cpu, buffer + i, data[i]);
+         }
+         hdv->blocks_read++;
+         return EWM_HDV_ERR_NONE;
+      }
+      case EWM_HDV_CMD_WRITE: {
+         if (hdv->readonly) {
+            return EWM_HDV_ERR_WRITE_PROTECTED;
+         }
+         if (block >= hdv->blocks) {
+            return EWM_HDV_ERR_IO;
+         }
+         uint8_t *data = hdv->image + (block * EWM_HDV_BLOCK_SIZE);
+         for (int i = 0; i < EWM_HDV_BLOCK_SIZE; i++) {
+            data[i] = mem_get_byte(cpu, buffer + i);
+         }
+         hdv->dirty = true;
+         hdv->blocks_written++;
+         return EWM_HDV_ERR_NONE;
+      }
+      case EWM_HDV_CMD_FORMAT:
+         return hdv->readonly ? EWM_HDV_ERR_WRITE_PROTECTED : EWM_HDV_ERR_NONE;
+   }
+
+   return EWM_HDV_ERR_IO;
+}
+
+static uint8_t hdv_read(struct cpu_t *cpu, struct mem_t *mem, uint16_t addr) {
+   struct ewm_hdv_t *hdv = (struct ewm_hdv_t*) mem->obj;
+   switch (addr & 0x0f) {
+      case 0x01:
+         return hdv->error;
+      case 0x02:
+         return hdv->blocks & 0xff;
+      case 0x03:
+         return hdv->blocks >> 8;
+   }
+   return 0x00;
+}
+
+// The image is not part of a snapshot, so a call stops running ahead
+// before anything happens. The real timeline makes the call again.
+
+static void hdv_write(struct cpu_t *cpu, struct mem_t *mem, uint16_t addr, uint8_t b) {
+   struct ewm_hdv_t *hdv = (struct ewm_hdv_t*) mem->obj;
+   if ((addr & 0x0f) == 0x00 && !cpu_stop_ahead(cpu)) {
+      hdv->error = hdv_call(hdv, cpu);
+   }
+}
+
+static int ewm_hdv_init(struct ewm_hdv_t *hdv, struct cpu_t *cpu, int slot) {
+   memset(hdv, 0x00, sizeof(struct ewm_hdv_t));
+   hdv->slot = slot;
+   hdv_build_rom(hdv);
+   uint16_t rom_start = 0xc000 + slot * 0x100;
+   hdv->rom = cpu_add_rom_data(cpu, rom_start, rom_start + 0xff, hdv->rom_data);
+   hdv->rom->description = "rom/hdv/$Cn00";
+   uint16_t iom_start = 0xc080 + slot * 16;
+   hdv->iom = cpu_add_iom(cpu, iom_start, iom_start + 0x0f, hdv, hdv_read, hdv_write);
+   hdv->iom->description = "iom/hdv/$C0n0";
+   return 0;
+}
+
+struct ewm_hdv_t *ewm_hdv_create(struct cpu_t *cpu, int slot) {
+   if (slot < 1 || slot > 7) {
+      return NULL;
+   }
+   struct ewm_hdv_t *hdv = (struct ewm_hdv_t*) malloc(sizeof(struct ewm_hdv_t));
+   if (ewm_hdv_init(hdv, cpu, slot) != 0) {
+      free(hdv);
+      return NULL;
+   }
+   return hdv;
+}
+
+// Images are ProDOS ordered blocks, which is what both .po and .hdv
+// files have. The image is mapped shared, so that writes go to the file
+// without any copying. The kernel writes them back in the background.
+
+int ewm_hdv_set_image_file(struct ewm_hdv_t *hdv, char *path) {
+   bool readonly = (access(path, W_OK) != 0);
+
+   int fd = open(path, readonly ? O_RDONLY : O_RDWR);
+   if (fd == -1) {
+      return -1;
+   }
+
+   struct stat file_info;
+   if (fstat(fd, &file_info) == -1) {
+      close(fd);
+      return -1;
+   }
+
+   size_t length = file_info.st_size;
+   if (length == 0 || (length % EWM_HDV_BLOCK_SIZE) != 0 || length > (EWM_HDV_BLOCKS_MAX + 1) * EWM_HDV_BLOCK_SIZE) {
+      fprintf(stderr, "[HDV] %s is not an image of up to 32 MB of 512 byte blocks\n", path);
+      close(fd);
+      return -1;
+   }
+
+   uint8_t *image = mmap(NULL, length, readonly ? PROT_READ : (PROT_READ | PROT_WRITE), readonly ? MAP_PRIVATE : MAP_SHARED, fd, 0);
+   close(fd);
+
+   if (image == MAP_FAILED) {
+      fprintf(stderr, "[HDV] Cannot map %s: %s\n", path, strerror(errno));
+      return -1;
+   }
+
+   if (hdv->image != NULL) {
+      ewm_hdv_sync(hdv);
+      munmap(hdv->image, hdv->image_length);
+   }
+   free(hdv->path);
+
+   hdv->path = strdup(path);
+   hdv->image = image;
+   hdv->image_length = length;
+   hdv->readonly = readonly;
+   hdv->dirty = false;
+
+   // A 32 MB image has one block more than ProDOS can use
+   size_t blocks = length / EWM_HDV_BLOCK_SIZE;
+   hdv->blocks = (blocks > EWM_HDV_BLOCKS_MAX) ? EWM_HDV_BLOCKS_MAX : blocks;
+   hdv_build_rom(hdv);
+
+   return 0;
+}
+
+// Start writing back blocks that were written to, without waiting
+
+void ewm_hdv_flush(struct ewm_hdv_t *hdv) {
+   if (hdv->dirty) {
+      (void) msync(hdv->image, hdv->image_length, MS_ASYNC);
+      hdv->dirty = false;
+   }
+}
+
+void ewm_hdv_sync(struct ewm_hdv_t *hdv) {
+   if (hdv->image != NULL && !hdv->readonly) {
+      (void) msync(hdv->image, hdv->image_length, MS_SYNC);
+      hdv->dirty = false;
+   }
+}
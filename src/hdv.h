@@ -0,0 +1,81 @@
+// The MIT License (MIT)
+//
+// Copyright (c) 2017 Stefan Arentz - http://github.com/st3fan/ewm
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#ifndef EWM_HDV_H
+#define EWM_HDV_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+struct cpu_t;
+struct mem_t;
+
+// A ProDOS block device card, for .po and .hdv images of up to 32 MB.
+// The ROM has the standard block device entry point. Its driver hands
+// the call to the card, which copies whole blocks from and to the
+// mapped image, instead of going through nibbles like the Disk II.
+
+#define EWM_HDV_SLOT_DEFAULT (7) // Booted before the Disk II in slot 6
+#define EWM_HDV_BLOCK_SIZE (512)
+#define EWM_HDV_BLOCKS_MAX (65535)
+
+// Parameters of a driver call, in the zero page
+
+#define EWM_HDV_CMD (0x42)
+#define EWM_HDV_UNIT (0x43)
+#define EWM_HDV_BUFFER (0x44)
+#define EWM_HDV_BLOCK (0x46)
+
+#define EWM_HDV_CMD_STATUS (0)
+#define EWM_HDV_CMD_READ (1)
+#define EWM_HDV_CMD_WRITE (2)
+#define EWM_HDV_CMD_FORMAT (3)
+
+#define EWM_HDV_ERR_NONE (0x00)
+#define EWM_HDV_ERR_IO (0x27)
+#define EWM_HDV_ERR_NO_DEVICE (0x28)
+#define EWM_HDV_ERR_WRITE_PROTECTED (0x2b)
+
+struct ewm_hdv_t {
+   struct mem_t *rom;
+   struct mem_t *iom;
+   uint8_t rom_data[256];
+   int slot;
+   char *path;
+   uint8_t *image;       // Mapped from the file, changes go straight into it
+   size_t image_length;
+   uint16_t blocks;
+   bool readonly;
+   bool dirty;           // Written to since the last flush
+   uint8_t error;        // Result of the last call
+   uint64_t blocks_read;
+   uint64_t blocks_written;
+};
+
+struct ewm_hdv_t *ewm_hdv_create(struct cpu_t *cpu, int slot);
+int ewm_hdv_set_image_file(struct ewm_hdv_t *hdv, char *path);
+
+void ewm_hdv_flush(struct ewm_hdv_t *hdv);
+void ewm_hdv_sync(struct ewm_hdv_t *hdv);
+
+#endif // EWM_HDV_H
@@ -0,0 +1,229 @@
+// The MIT License (MIT)
+//
+// Copyright (c) 2017 Stefan Arentz - http://github.com/st3fan/ewm
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#include <dirent.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include "clk.h"
+#include "dsk.h"
+#include "lib.h"
+
+struct ewm_lib_t *ewm_lib_create(int writes, bool compress) {
+   struct ewm_lib_t *lib = (struct ewm_lib_t*) malloc(sizeof(struct ewm_lib_t));
+   memset(lib, 0x00, sizeof(struct ewm_lib_t));
+   lib->writes = writes;
+   lib->compress = compress;
+   lib->inserted[0] = -1;
+   lib->inserted[1] = -1;
+   pthread_mutex_init(&lib->lock, NULL);
+   return lib;
+}
+
+static void ewm_lib_add_disk(struct ewm_lib_t *lib, char *path) {
+   lib->disks = realloc(lib->disks, (lib->count + 1) * sizeof(struct ewm_lib_disk_t));
+   lib->disks[lib->count].path = strdup(path);
+   lib->disks[lib->count].drive = NULL;
+   lib->disks[lib->count].failed = false;
+   lib->count++;
+}
+
+static int ewm_lib_compare_paths(const void *a, const void *b) {
+   return strcmp(*((char**) a), *((char**) b));
+}
+
+// Add the disks in a directory, in name order, so that the disks of a
+// set end up next to each other.
+
+static int ewm_lib_add_directory(struct ewm_lib_t *lib, char *path) {
+   DIR *dir = opendir(path);
+   if (dir == NULL) {
+      return -1;
+   }
+
+   char **paths = NULL;
+   int count = 0;
+
+   struct dirent *entry;
+   while ((entry = readdir(dir)) != NULL) {
+      if (entry->d_name[0] != '.' && ewm_dsk_type_from_path(entry->d_name) != EWM_DSK_TYPE_UNKNOWN) {
+         paths = realloc(paths, (count + 1) * sizeof(char*));
+         paths[count] = malloc(strlen(path) + strlen(entry->d_name) + 2);
+         sprintf(paths[count], "%s/%s", path, entry->d_name);
+         count++;
+      }
+   }
+   closedir(dir);
+
+   qsort(paths, count, sizeof(char*), ewm_lib_compare_paths);
+   for (int i = 0; i < count; i++) {
+      ewm_lib_add_disk(lib, paths[i]);
+      free(paths[i]);
+   }
+   free(paths);
+
+   return 0;
+}
+
+// Add a disk image or a directory of them. Disks can only be added
+// before the library is started.
+
+int ewm_lib_add(struct ewm_lib_t *lib, char *path) {
+   struct stat info;
+   if (stat(path, &info) != 0) {
+      return -1;
+   }
+
+   if (S_ISDIR(info.st_mode)) {
+      return ewm_lib_add_directory(lib, path);
+   }
+
+   if (ewm_dsk_type_from_path(path) == EWM_DSK_TYPE_UNKNOWN) {
+      return -1;
+   }
+
+   ewm_lib_add_disk(lib, path);
+   return 0;
+}
+
+static void *ewm_lib_main(void *data) {
+   struct ewm_lib_t *lib = (struct ewm_lib_t*) data;
+   for (int i = 0; i < lib->count; i++) {
+      uint64_t start = ewm_clk_now();
+      struct ewm_dsk_drive_t *drive = ewm_dsk_prepare(lib->disks[i].path, false, lib->writes, lib->compress);
+      uint64_t time = ewm_clk_now() - start;
+
+      if (drive == NULL) {
+         fprintf(stderr, "[LIB] Cannot prepare %s\n", lib->disks[i].path);
+      }
+
+      pthread_mutex_lock(&lib->lock);
+      lib->disks[i].drive = drive;
+      lib->disks[i].failed = (drive == NULL);
+      lib->prepared++;
+      lib->prepare_time += time;
+      pthread_mutex_unlock(&lib->lock);
+   }
+   return NULL;
+}
+
+int ewm_lib_start(struct ewm_lib_t *lib) {
+   if (pthread_create(&lib->thread, NULL, ewm_lib_main, lib) != 0) {
+      fprintf(stderr, "[LIB] Cannot create library thread\n");
+      return -1;
+   }
+   pthread_detach(lib->thread);
+   return 0;
+}
+
+// Swap a prepared disk into a drive. The disk that was in the drive goes
+// back into the library, or is released if it did not come from there.
+
+int ewm_lib_insert(struct ewm_lib_t *lib, struct ewm_dsk_t *dsk, int drive, int disk, uint64_t counter) {
+   if (drive < 0 || drive > 1 || disk < 0 || disk >= lib->count) {
+      return -1;
+   }
+
+   if (lib->inserted[drive] == disk) {
+      return 0;
+   }
+
+   if (lib->inserted[1 - drive] == disk) {
+      fprintf(stderr, "[LIB] %s is already in drive %d\n", lib->disks[disk].path, (1 - drive) + 1);
+      return -1;
+   }
+
+   pthread_mutex_lock(&lib->lock);
+
+   struct ewm_dsk_drive_t *prepared = lib->disks[disk].drive;
+   if (prepared == NULL) {
+      pthread_mutex_unlock(&lib->lock);
+      fprintf(stderr, "[LIB] %s is %s\n", lib->disks[disk].path, lib->disks[disk].failed ? "not a disk" : "not prepared yet");
+      return -1;
+   }
+
+   lib->disks[disk].drive = NULL;
+   ewm_dsk_swap(dsk, drive, prepared, counter);
+
+   // The prepared struct now holds the ejected disk
+   if (lib->inserted[drive] != -1) {
+      lib->disks[lib->inserted[drive]].drive = prepared;
+   } else {
+      ewm_dsk_release(prepared);
+   }
+   lib->inserted[drive] = disk;
+
+   pthread_mutex_unlock(&lib->lock);
+
+   return 0;
+}
+
+// Put the disk in a drive back into the library, leaving the drive empty
+
+int ewm_lib_eject(struct ewm_lib_t *lib, struct ewm_dsk_t *dsk, int drive, uint64_t counter) {
+   if (drive < 0 || drive > 1 || lib->inserted[drive] == -1) {
+      return -1;
+   }
+
+   struct ewm_dsk_drive_t *empty = (struct ewm_dsk_drive_t*) malloc(sizeof(struct ewm_dsk_drive_t));
+   if (empty == NULL) {
+      return -1;
+   }
+   memset(empty, 0x00, sizeof(struct ewm_dsk_drive_t));
+   ewm_dsk_swap(dsk, drive, empty, counter);
+
+   pthread_mutex_lock(&lib->lock);
+   lib->disks[lib->inserted[drive]].drive = empty;
+   lib->inserted[drive] = -1;
+   pthread_mutex_unlock(&lib->lock);
+
+   return 0;
+}
+
+// The disk after the one in a drive that can be inserted, -1 if none
+
+int ewm_lib_next(struct ewm_lib_t *lib, int drive) {
+   if (drive < 0 || drive > 1) {
+      return -1;
+   }
+
+   pthread_mutex_lock(&lib->lock);
+   int next = -1;
+   for (int i = 1; i <= lib->count && next == -1; i++) {
+      int disk = (lib->inserted[drive] + i) % lib->count;
+      if (lib->disks[disk].drive != NULL && disk != lib->inserted[1 - drive]) {
+         next = disk;
+      }
+   }
+   pthread_mutex_unlock(&lib->lock);
+
+   return next;
+}
+
+void ewm_lib_stats(struct ewm_lib_t *lib, int *prepared, uint64_t *prepare_time) {
+   pthread_mutex_lock(&lib->lock);
+   *prepared = lib->prepared;
+   *prepare_time = lib->prepare_time;
+   pthread_mutex_unlock(&lib->lock);
+}
@@ -0,0 +1,65 @@
+// The MIT License (MIT)
+//
+// Copyright (c) 2017 Stefan Arentz - http://github.com/st3fan/ewm
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#ifndef EWM_LIB_H
+#define EWM_LIB_H
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+struct ewm_dsk_t;
+struct ewm_dsk_drive_t;
+
+// A library of disks for software that comes on more than one disk. The
+// disks are prepared on a worker thread, so that swapping one into a
+// drive is just a matter of swapping two drive structs.
+
+struct ewm_lib_disk_t {
+   char *path;
+   struct ewm_dsk_drive_t *drive; // Prepared disk, NULL until prepared or while in a drive
+   bool failed;
+};
+
+struct ewm_lib_t {
+   struct ewm_lib_disk_t *disks;
+   int count;
+   int writes;              // How changes to library disks are written back
+   bool compress;           // And if changes to compressed disks are
+   int inserted[2];         // Library disk in each drive, -1 for none
+   pthread_t thread;
+   pthread_mutex_t lock;    // Guards the prepared disks and the stats
+   int prepared;            // Disks prepared so far
+   uint64_t prepare_time;   // Time spent preparing them, in ns
+};
+
+struct ewm_lib_t *ewm_lib_create(int writes, bool compress);
+int ewm_lib_add(struct ewm_lib_t *lib, char *path);
+int ewm_lib_start(struct ewm_lib_t *lib);
+
+int ewm_lib_insert(struct ewm_lib_t *lib, struct ewm_dsk_t *dsk, int drive, int disk, uint64_t counter);
+int ewm_lib_eject(struct ewm_lib_t *lib, struct ewm_dsk_t *dsk, int drive, uint64_t counter);
+int ewm_lib_next(struct ewm_lib_t *lib, int drive);
+
+void ewm_lib_stats(struct ewm_lib_t *lib, int *prepared, uint64_t *prepare_time);
+
+#endif // EWM_LIB_H
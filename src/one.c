@@ -22,11 +22,13 @@
 
 #include <ctype.h>
 #include <getopt.h>
+#include <inttypes.h>
 #include <stdlib.h>
 
 #include <SDL2/SDL.h>
 
 #include "sdl.h"
+#include "clk.h"
 #include "cpu.h"
 #include "mem.h"
 #include "pia.h"
@@ -54,6 +56,7 @@ static int ewm_one_init(struct ewm_one_t *one, int model, SDL_Renderer *renderer
          one->pia = ewm_pia_create(one->cpu);
          one->pia->callback = ewm_one_pia_callback;
          one->pia->callback_obj = one;
+         cpu_add_idle_address(one->cpu, EWM_A1_PIA6820_KBD_CTL);
          break;
       }
       case EWM_ONE_MODEL_REPLICA1: {
@@ -65,6 +68,7 @@ static int ewm_one_init(struct ewm_one_t *one, int model, SDL_Renderer *renderer
          one->pia = ewm_pia_create(one->cpu);
          one->pia->callback = ewm_one_pia_callback;
          one->pia->callback_obj = one;
+         cpu_add_idle_address(one->cpu, EWM_A1_PIA6820_KBD_CTL);
          break;
       }
    }
@@ -80,9 +84,12 @@ static void ewm_one_keydown(struct ewm_one_t *one, uint8_t key) {
    ewm_pia_set_irqa1(one->pia);
 }
 
-static bool ewm_one_poll_event(struct ewm_one_t *one, SDL_Window *window) {
+// Handle events until the deadline, when the next frame is due. This
+// sleeps while there is no input instead of spinning.
+
+static bool ewm_one_poll_event(struct ewm_one_t *one, SDL_Window *window, uint64_t deadline) {
    SDL_Event event;
-   while (SDL_PollEvent(&event) != 0) {
+   for (int ready = ewm_sdl_wait_event(&event, deadline); ready != 0; ready = SDL_PollEvent(&event)) {
       switch (event.type) {
          case SDL_QUIT:
             return false;
@@ -108,6 +115,9 @@ static bool ewm_one_poll_event(struct ewm_one_t *one, SDL_Window *window) {
                         SDL_SetWindowFullscreen(window, SDL_WINDOW_FULLSCREEN);
                      }
                      break;
+                  case SDLK_t:
+                     ewm_clk_set_turbo(one->clk, !one->clk->turbo, one->cpu->counter);
+                     break;
                }
             } else if (event.key.keysym.mod == KMOD_NONE) {
                switch (event.key.keysym.sym) {
@@ -169,6 +179,9 @@ static bool ewm_one_step_cpu(struct ewm_one_t *one, int cycles) {
       }
 
       cycles -= ret;
+      if (one->cpu->idle) {
+         cycles -= cpu_idle_forward(one->cpu, cycles > 0 ? cycles : 0);
+      }
       if (cycles <= 0) {
          break;
       }
@@ -176,19 +189,66 @@ static bool ewm_one_step_cpu(struct ewm_one_t *one, int cycles) {
    return true;
 }
 
-#define EWM_ONE_OPT_HELP   (0)
-#define EWM_ONE_OPT_MODEL  (1)
-#define EWM_ONE_OPT_MEMORY (2)
-#define EWM_ONE_OPT_TRACE  (3)
-#define EWM_ONE_OPT_STRICT (4)
+// Run without SDL video. Frames are virtual, each one is the number
+// of cycles the main loop would run per frame at normal speed.
+
+static int ewm_one_run_headless(struct ewm_one_t *one, uint64_t cycles, uint64_t frames, char *dump_path) {
+   Uint64 start = SDL_GetPerformanceCounter();
+
+   uint64_t frame = 0;
+   while ((cycles == 0 || one->cpu->counter < cycles) && (frames == 0 || frame < frames)) {
+      int n = EWM_ONE_CPS / EWM_ONE_FPS;
+      if (cycles != 0 && (cycles - one->cpu->counter) < (uint64_t) n) {
+         n = cycles - one->cpu->counter;
+      }
+      if (!ewm_one_step_cpu(one, n)) {
+         return 1;
+      }
+      frame++;
+   }
+
+   double seconds = (double) (SDL_GetPerformanceCounter() - start) / SDL_GetPerformanceFrequency();
+   fprintf(stderr, "[ONE] Ran %" PRIu64 " cycles in %" PRIu64 " frames in %.3fs (%.3f MHz)\n",
+      one->cpu->counter, frame, seconds, seconds > 0 ? (one->cpu->counter / seconds) / 1000000.0 : 0.0);
+   fprintf(stderr, "[ONE] Skipped %" PRIu64 " idle loops, %" PRIu64 " cycles (%.1f%%)\n",
+      one->cpu->idle_hits, one->cpu->idle_cycles, one->cpu->counter ? (100.0 * one->cpu->idle_cycles) / one->cpu->counter : 0.0);
+   fprintf(stderr, "[ONE] Skipped %" PRIu64 " delay loops, %" PRIu64 " cycles (%.1f%%)\n",
+      one->cpu->delay_hits, one->cpu->delay_cycles, one->cpu->counter ? (100.0 * one->cpu->delay_cycles) / one->cpu->counter : 0.0);
+
+   if (dump_path != NULL) {
+      ewm_tty_refresh(one->tty, 1, EWM_ONE_FPS);
+      if (SDL_SaveBMP(one->tty->surface, dump_path) != 0) {
+         fprintf(stderr, "[ONE] Cannot save screen to %s: %s\n", dump_path, SDL_GetError());
+         return 1;
+      }
+   }
+
+   return 0;
+}
+
+#define EWM_ONE_OPT_HELP     (0)
+#define EWM_ONE_OPT_MODEL    (1)
+#define EWM_ONE_OPT_MEMORY   (2)
+#define EWM_ONE_OPT_TRACE    (3)
+#define EWM_ONE_OPT_STRICT   (4)
+#define EWM_ONE_OPT_HEADLESS (5)
+#define EWM_ONE_OPT_CYCLES   (6)
+#define EWM_ONE_OPT_FRAMES   (7)
+#define EWM_ONE_OPT_DUMP     (8)
+#define EWM_ONE_OPT_SPEED    (9)
 
 static struct option one_options[] = {
-   { "help",   no_argument,       NULL, EWM_ONE_OPT_HELP   },
-   { "model",  required_argument, NULL, EWM_ONE_OPT_MODEL  },
-   { "memory", required_argument, NULL, EWM_ONE_OPT_MEMORY },
-   { "trace",  optional_argument, NULL, EWM_ONE_OPT_TRACE  },
-   { "strict", no_argument,       NULL, EWM_ONE_OPT_STRICT },
-   { NULL,     0,                 NULL, 0 }
+   { "help",     no_argument,       NULL, EWM_ONE_OPT_HELP     },
+   { "model",    required_argument, NULL, EWM_ONE_OPT_MODEL    },
+   { "memory",   required_argument, NULL, EWM_ONE_OPT_MEMORY   },
+   { "trace",    optional_argument, NULL, EWM_ONE_OPT_TRACE    },
+   { "strict",   no_argument,       NULL, EWM_ONE_OPT_STRICT   },
+   { "headless", no_argument,       NULL, EWM_ONE_OPT_HEADLESS },
+   { "cycles",   required_argument, NULL, EWM_ONE_OPT_CYCLES   },
+   { "frames",   required_argument, NULL, EWM_ONE_OPT_FRAMES   },
+   { "dump",     required_argument, NULL, EWM_ONE_OPT_DUMP     },
+   { "speed",    required_argument, NULL, EWM_ONE_OPT_SPEED    },
+   { NULL,       0,                 NULL, 0                    }
 };
 
 static void usage() {
@@ -197,6 +257,11 @@ static void usage() {
    fprintf(stderr, "  --memory <region> add memory region (ram|rom:address:path)\n");
    fprintf(stderr, "  --trace <file>    trace cpu to file\n");
    fprintf(stderr, "  --strict          run emulator in strict mode\n");
+   fprintf(stderr, "  --speed <speed>   speed multiplier or unlimited (default: 1)\n");
+   fprintf(stderr, "  --headless        run without a window, as fast as possible\n");
+   fprintf(stderr, "  --cycles <n>      headless: stop after n cycles\n");
+   fprintf(stderr, "  --frames <n>      headless: stop after n frames\n");
+   fprintf(stderr, "  --dump <file>     headless: save the screen as a BMP when done\n");
    fprintf(stderr, "\n");
    fprintf(stderr, "Supported models:\n");
    fprintf(stderr, "  apple1    Classic Apple 1, 6502, 8KB RAM, Woz Monitor\n");
@@ -209,6 +274,11 @@ int ewm_one_main(int argc, char **argv) {
    struct ewm_memory_option_t *extra_memory = NULL;
    char *trace_path = NULL;
    bool strict = false;
+   bool headless = false;
+   uint64_t cycles = 0;
+   uint64_t frames = 0;
+   char *dump_path = NULL;
+   double speed = 1.0;
 
    int ch;
    while ((ch = getopt_long_only(argc, argv, "", one_options, NULL)) != -1) {
@@ -245,6 +315,29 @@ int ewm_one_main(int argc, char **argv) {
             strict = true;
             break;
          }
+         case EWM_ONE_OPT_HEADLESS: {
+            headless = true;
+            break;
+         }
+         case EWM_ONE_OPT_CYCLES: {
+            cycles = strtoull(optarg, NULL, 10);
+            break;
+         }
+         case EWM_ONE_OPT_FRAMES: {
+            frames = strtoull(optarg, NULL, 10);
+            break;
+         }
+         case EWM_ONE_OPT_DUMP: {
+            dump_path = optarg;
+            break;
+         }
+         case EWM_ONE_OPT_SPEED: {
+            if (ewm_clk_parse_speed(optarg, &speed) != 0) {
+               fprintf(stderr, "Invalid --speed specified\n");
+               exit(1);
+            }
+            break;
+         }
          default: {
             usage();
             exit(1);
@@ -252,36 +345,35 @@ int ewm_one_main(int argc, char **argv) {
       }
    }
 
-   // Setup SDL
+   // Setup SDL, unless we run headless, in which case the tty only
+   // renders into its pixels when the screen is dumped.
 
-   if (SDL_Init(SDL_INIT_VIDEO | SDL_INIT_TIMER | SDL_INIT_EVENTS) < 0) {
-      fprintf(stderr, "Failed to initialize SDL: %s\n", SDL_GetError());
-      return 1;
-   }
+   SDL_Window *window = NULL;
+   struct ewm_sdl_display_t *display = NULL;
 
-   SDL_Window *window = SDL_CreateWindow("EWM v0.1 - Apple 1", SDL_WINDOWPOS_CENTERED, SDL_WINDOWPOS_CENTERED,
-         280*3, 192*3, SDL_WINDOW_SHOWN);
-   if (window == NULL) {
-      fprintf(stderr, "Failed create window: %s\n", SDL_GetError());
-      return 1;
-   }
+   if (!headless) {
+      if (SDL_Init(SDL_INIT_VIDEO | SDL_INIT_TIMER | SDL_INIT_EVENTS) < 0) {
+         fprintf(stderr, "Failed to initialize SDL: %s\n", SDL_GetError());
+         return 1;
+      }
 
-   SDL_Renderer *renderer = SDL_CreateRenderer(window, -1, SDL_RENDERER_ACCELERATED);
-   if (renderer == NULL) {
-      fprintf(stderr, "Failed to create renderer: %s\n", SDL_GetError());
-      return 1;
-   }
+      window = SDL_CreateWindow("EWM v0.1 - Apple 1", SDL_WINDOWPOS_CENTERED, SDL_WINDOWPOS_CENTERED,
+            280*3, 192*3, SDL_WINDOW_SHOWN);
+      if (window == NULL) {
+         fprintf(stderr, "Failed create window: %s\n", SDL_GetError());
+         return 1;
+      }
 
-   if (ewm_sdl_check_renderer(renderer) != 0) {
-      fprintf(stderr, "ewm: boo: unsupported renderer\n");
-      return 1;
+      display = ewm_sdl_display_create(window, 280, 192);
+      if (display == NULL) {
+         fprintf(stderr, "Failed to create display: %s\n", SDL_GetError());
+         return 1;
+      }
    }
 
-   SDL_RenderSetLogicalSize(renderer, 280, 192);
-
    // Create the machine
 
-   struct ewm_one_t *one = ewm_one_create(model, renderer);
+   struct ewm_one_t *one = ewm_one_create(model, display != NULL ? display->renderer : NULL);
    if (one == NULL) {
       fprintf(stderr, "Failed to create ewm_one_t\n");
       return 1;
@@ -300,43 +392,50 @@ int ewm_one_main(int argc, char **argv) {
 
    cpu_reset(one->cpu);
 
+   if (headless) {
+      return ewm_one_run_headless(one, cycles, frames, dump_path);
+   }
+
    // Main loop
 
    SDL_StartTextInput();
 
-   uint32_t ticks = SDL_GetTicks();
+   one->clk = ewm_clk_create(EWM_ONE_CPS, EWM_ONE_FPS, speed);
+   ewm_clk_reset(one->clk, one->cpu->counter);
    uint32_t phase = 1;
 
    while (true) {
-      if (!ewm_one_poll_event(one, window)) { // TODO Move window into one
+      // When throttled, sleep until the next frame is due. Otherwise
+      // run flat out and only poll for events.
+
+      uint64_t deadline = ewm_clk_throttled(one->clk) ? one->clk->frame_deadline : 0;
+      if (!ewm_one_poll_event(one, window, deadline)) { // TODO Move window into one
          break;
       }
 
-      // This is very basic throttling that does bursts of CPU cycles.
+      bool frame_due = ewm_clk_frame_due(one->clk);
 
-      if ((SDL_GetTicks() - ticks) >= (1000 / EWM_ONE_FPS)) {
-         if (!ewm_one_step_cpu(one, EWM_ONE_CPS / EWM_ONE_FPS)) {
+      if (frame_due || !ewm_clk_throttled(one->clk)) {
+         uint64_t cycles = ewm_clk_cycles_due(one->clk, one->cpu->counter);
+         if (cycles != 0 && !ewm_one_step_cpu(one, (int) cycles)) {
             break;
          }
+      }
+
+      if (frame_due) {
+         ewm_clk_next_frame(one->clk);
 
-         if (one->tty->screen_dirty || (phase == 0) || ((phase % (EWM_ONE_FPS / 4)) == 0)) {
-            SDL_SetRenderDrawColor(one->tty->renderer, 0, 0, 0, 255);
-            SDL_RenderClear(one->tty->renderer);
+         // Nothing is drawn while the window is hidden or minimized
 
+         bool visible = ewm_sdl_window_visible(window);
+         if (visible && (one->tty->screen_dirty || (phase == 0) || ((phase % (EWM_ONE_FPS / 4)) == 0))) {
             ewm_tty_refresh(one->tty, phase, EWM_ONE_FPS);
             one->tty->screen_dirty = false;
 
-            SDL_Texture *texture = SDL_CreateTextureFromSurface(one->tty->renderer, one->tty->surface);
-            if (texture != NULL) {
-               SDL_RenderCopy(one->tty->renderer, texture, NULL, NULL);
-               SDL_DestroyTexture(texture);
-            }
-
-            SDL_RenderPresent(one->tty->renderer);
+            ewm_sdl_display_draw(display, one->tty->surface, NULL);
+            ewm_sdl_display_present(display);
          }
 
-         ticks = SDL_GetTicks();
-
          phase += 1;
          if (phase == EWM_ONE_FPS) {
             phase = 0;
@@ -346,8 +445,8 @@ int ewm_one_main(int argc, char **argv) {
 
    // Destroy SDL
 
+   ewm_sdl_display_destroy(display);
    SDL_DestroyWindow(window);
-   SDL_DestroyRenderer(renderer);
    SDL_Quit();
 
    return 0;
@@ -35,12 +35,14 @@
 struct cpu_t;
 struct ewm_tty_t;
 struct ewm_pia_t;
+struct ewm_clk_t;
 
 struct ewm_one_t {
    int model;
    struct cpu_t *cpu;
    struct ewm_tty_t *tty;
    struct ewm_pia_t *pia;
+   struct ewm_clk_t *clk;
 };
 
 struct ewm_one_t *ewm_one_create(int type, SDL_Renderer *renderer);
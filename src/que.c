@@ -0,0 +1,87 @@
+// The MIT License (MIT)
+//
+// Copyright (c) 2017 Stefan Arentz - http://github.com/st3fan/ewm
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "que.h"
+
+static int ewm_que_init(struct ewm_que_t *que, size_t capacity, size_t item_size) {
+   memset(que, 0x00, sizeof(struct ewm_que_t));
+
+   // Round up to a power of two so that indexes can be masked
+   que->capacity = 1;
+   while (que->capacity < capacity) {
+      que->capacity <<= 1;
+   }
+
+   que->item_size = item_size;
+   que->items = calloc(que->capacity, item_size);
+   if (que->items == NULL) {
+      return -1;
+   }
+
+   atomic_init(&que->head, 0);
+   atomic_init(&que->tail, 0);
+
+   return 0;
+}
+
+struct ewm_que_t *ewm_que_create(size_t capacity, size_t item_size) {
+   struct ewm_que_t *que = (struct ewm_que_t*) malloc(sizeof(struct ewm_que_t));
+   if (ewm_que_init(que, capacity, item_size) != 0) {
+      free(que);
+      que = NULL;
+   }
+   return que;
+}
+
+void ewm_que_destroy(struct ewm_que_t *que) {
+   free(que->items);
+   free(que);
+}
+
+// The head and tail only ever increase. The producer publishes an item
+// by releasing the tail after copying it in, the consumer frees a slot
+// by releasing the head after copying it out.
+
+bool ewm_que_push(struct ewm_que_t *que, const void *item) {
+   size_t tail = atomic_load_explicit(&que->tail, memory_order_relaxed);
+   size_t head = atomic_load_explicit(&que->head, memory_order_acquire);
+   if (tail - head == que->capacity) {
+      return false;
+   }
+   memcpy(&que->items[(tail & (que->capacity - 1)) * que->item_size], item, que->item_size);
+   atomic_store_explicit(&que->tail, tail + 1, memory_order_release);
+   return true;
+}
+
+bool ewm_que_pop(struct ewm_que_t *que, void *item) {
+   size_t head = atomic_load_explicit(&que->head, memory_order_relaxed);
+   size_t tail = atomic_load_explicit(&que->tail, memory_order_acquire);
+   if (head == tail) {
+      return false;
+   }
+   memcpy(item, &que->items[(head & (que->capacity - 1)) * que->item_size], que->item_size);
+   atomic_store_explicit(&que->head, head + 1, memory_order_release);
+   return true;
+}
@@ -0,0 +1,48 @@
+// The MIT License (MIT)
+//
+// Copyright (c) 2017 Stefan Arentz - http://github.com/st3fan/ewm
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#ifndef EWM_QUE_H
+#define EWM_QUE_H
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// A lock-free queue with a single producer and a single consumer, each
+// on their own thread. Items are fixed size and copied in and out.
+
+struct ewm_que_t {
+   size_t capacity;  // Number of items, a power of two
+   size_t item_size;
+   uint8_t *items;
+   _Atomic size_t head; // Next item to pop, only written by the consumer
+   _Atomic size_t tail; // Next item to push, only written by the producer
+};
+
+struct ewm_que_t *ewm_que_create(size_t capacity, size_t item_size);
+void ewm_que_destroy(struct ewm_que_t *que);
+
+bool ewm_que_push(struct ewm_que_t *que, const void *item);
+bool ewm_que_pop(struct ewm_que_t *que, void *item);
+
+#endif // EWM_QUE_H
@@ -331,9 +331,6 @@ void ewm_scr_destroy(struct scr_t *scr) {
 }
 
 void ewm_scr_update(struct scr_t *scr, int phase, int fps) {
-   SDL_SetRenderDrawColor(scr->renderer, 0, 0, 0, 255);
-   SDL_RenderClear(scr->renderer);
-
    int flash = ((phase / (fps/4)) % 2);
 
    switch (scr->two->screen_mode) {
@@ -20,7 +20,9 @@
 // OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
 // SOFTWARE.
 
+#include <stdbool.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 
 #include "cpu.h"
@@ -43,7 +45,7 @@ void txt_full_refresh_setup(struct scr_t *scr) {
 }
 
 void txt_full_refresh_test(struct scr_t *scr) {
-   ewm_scr_update(scr, 0, 0);
+   ewm_scr_update(scr, 0, EWM_TWO_FPS_DEFAULT);
 }
 
 void lgr_full_refresh_setup(struct scr_t *scr) {
@@ -59,7 +61,7 @@ void lgr_full_refresh_setup(struct scr_t *scr) {
 }
 
 void lgr_full_refresh_test(struct scr_t *scr) {
-   ewm_scr_update(scr, 0, 0);
+   ewm_scr_update(scr, 0, EWM_TWO_FPS_DEFAULT);
 }
 
 void hgr_full_refresh_setup(struct scr_t *scr) {
@@ -74,7 +76,7 @@ void hgr_full_refresh_setup(struct scr_t *scr) {
 }
 
 void hgr_full_refresh_test(struct scr_t *scr) {
-   ewm_scr_update(scr, 0, 0);
+   ewm_scr_update(scr, 0, EWM_TWO_FPS_DEFAULT);
 }
 
 void test(struct scr_t *scr, char *name, test_setup_t test_setup, test_run_t test_run) {
@@ -82,18 +84,22 @@ void test(struct scr_t *scr, char *name, test_setup_t test_setup, test_run_t tes
 
    Uint64 start = SDL_GetPerformanceCounter();
    for (int i = 0; i < 1000; i++) {
-      SDL_SetRenderDrawColor(scr->renderer, 0, 0, 0, 255);
-      SDL_RenderClear(scr->renderer);
+      if (scr->renderer != NULL) {
+         SDL_SetRenderDrawColor(scr->renderer, 0, 0, 0, 255);
+         SDL_RenderClear(scr->renderer);
+      }
 
       test_run(scr);
 
-      SDL_Texture *texture = SDL_CreateTextureFromSurface(scr->renderer, scr->surface);
-      if (texture != NULL) {
-         SDL_RenderCopy(scr->renderer, texture, NULL, NULL);
-         SDL_DestroyTexture(texture);
-      }
+      if (scr->renderer != NULL) {
+         SDL_Texture *texture = SDL_CreateTextureFromSurface(scr->renderer, scr->surface);
+         if (texture != NULL) {
+            SDL_RenderCopy(scr->renderer, texture, NULL, NULL);
+            SDL_DestroyTexture(texture);
+         }
 
-      SDL_RenderPresent(scr->renderer);
+         SDL_RenderPresent(scr->renderer);
+      }
    }
    Uint64 now = SDL_GetPerformanceCounter();
    double total = (double)((now - start)*1000) / SDL_GetPerformanceFrequency();
@@ -102,28 +108,38 @@ void test(struct scr_t *scr, char *name, test_setup_t test_setup, test_run_t tes
    printf("%-20s %.3f/refresh\n", name, per_screen);
 }
 
-int main() {
-   if (SDL_Init(SDL_INIT_VIDEO | SDL_INIT_TIMER | SDL_INIT_EVENTS) < 0) {
-      fprintf(stderr, "Failed to initialize SDL: %s\n", SDL_GetError());
-      return 1;
-   }
+int main(int argc, char **argv) {
+   // With --headless no window is created and only the rendering into
+   // pixels is measured.
 
-   SDL_Window *window = SDL_CreateWindow("EWM v0.1 - scr_test", SDL_WINDOWPOS_CENTERED, SDL_WINDOWPOS_CENTERED,
-      EWM_SCR_WIDTH*3, EWM_SCR_HEIGHT*3, SDL_WINDOW_SHOWN);
-   if (window == NULL) {
-      fprintf(stderr, "Failed create window: %s\n", SDL_GetError());
-      return 1;
-   }
+   bool headless = (argc == 2 && strcmp(argv[1], "--headless") == 0);
 
-   SDL_Renderer *renderer = SDL_CreateRenderer(window, -1, SDL_RENDERER_ACCELERATED);
-   if (renderer == NULL) {
-      fprintf(stderr, "Failed to create renderer: %s\n", SDL_GetError());
-      return 1;
-   }
+   SDL_Window *window = NULL;
+   SDL_Renderer *renderer = NULL;
+
+   if (!headless) {
+      if (SDL_Init(SDL_INIT_VIDEO | SDL_INIT_TIMER | SDL_INIT_EVENTS) < 0) {
+         fprintf(stderr, "Failed to initialize SDL: %s\n", SDL_GetError());
+         return 1;
+      }
+
+      window = SDL_CreateWindow("EWM v0.1 - scr_test", SDL_WINDOWPOS_CENTERED, SDL_WINDOWPOS_CENTERED,
+         EWM_SCR_WIDTH*3, EWM_SCR_HEIGHT*3, SDL_WINDOW_SHOWN);
+      if (window == NULL) {
+         fprintf(stderr, "Failed create window: %s\n", SDL_GetError());
+         return 1;
+      }
 
-   SDL_RenderSetLogicalSize(renderer, EWM_SCR_WIDTH, EWM_SCR_HEIGHT);
+      renderer = SDL_CreateRenderer(window, -1, SDL_RENDERER_ACCELERATED);
+      if (renderer == NULL) {
+         fprintf(stderr, "Failed to create renderer: %s\n", SDL_GetError());
+         return 1;
+      }
 
-   sleep(3); // Is this ok? Seems to be needed to get the window on the screen
+      SDL_RenderSetLogicalSize(renderer, EWM_SCR_WIDTH, EWM_SCR_HEIGHT);
+
+      sleep(3); // Is this ok? Seems to be needed to get the window on the screen
+   }
 
    // Setup the CPU, Apple ][+ and it's screen.
 
@@ -136,9 +152,11 @@ int main() {
 
    // Destroy DSL things
 
-   SDL_DestroyWindow(window);
-   SDL_DestroyRenderer(renderer);
-   SDL_Quit();
+   if (!headless) {
+      SDL_DestroyWindow(window);
+      SDL_DestroyRenderer(renderer);
+      SDL_Quit();
+   }
 
    return 0;
 }
@@ -23,7 +23,22 @@
 #include <stdio.h>
 #include <SDL2/SDL.h>
 
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+#include "clk.h"
+#include "sdl.h"
+
 int ewm_sdl_pixel_format(SDL_Renderer *renderer) {
+   // Without a renderer pixels are written straight into the window
+   // surface, which on all platforms we care about is XRGB.
+   if (renderer == NULL) {
+      return SDL_PIXELFORMAT_ARGB8888;
+   }
+
    SDL_RendererInfo info;
    if (SDL_GetRendererInfo(renderer, &info) != 0) {
       return -1;
@@ -70,3 +85,333 @@ uint32_t ewm_sdl_green(SDL_Renderer *renderer) {
    }
    return 0xffffff;
 }
+
+// Wait for the next event, but not past the deadline, which is in
+// ewm_clk_now() nanoseconds. A deadline of 0 only polls. Returns 1 if
+// an event was received. This lets main loops sleep between frames and
+// still wake up for input.
+
+int ewm_sdl_wait_event(SDL_Event *event, uint64_t deadline) {
+   uint64_t now = ewm_clk_now();
+   if (deadline <= now) {
+      return SDL_PollEvent(event);
+   }
+   return SDL_WaitEventTimeout(event, (int) ((deadline - now + 999999) / 1000000));
+}
+
+bool ewm_sdl_window_visible(SDL_Window *window) {
+   return (SDL_GetWindowFlags(window) & (SDL_WINDOW_HIDDEN | SDL_WINDOW_MINIMIZED)) == 0;
+}
+
+// Integer upscaling of a single line of 32 bit pixels.
+
+static void _scale_line_2x(uint32_t *dst, uint32_t *src, int width) {
+   int x = 0;
+#if defined(__SSE2__)
+   for (; x + 4 <= width; x += 4) {
+      __m128i p = _mm_loadu_si128((__m128i*) (src + x));
+      _mm_storeu_si128((__m128i*) (dst + (2 * x)), _mm_unpacklo_epi32(p, p));
+      _mm_storeu_si128((__m128i*) (dst + (2 * x) + 4), _mm_unpackhi_epi32(p, p));
+   }
+#elif defined(__ARM_NEON)
+   for (; x + 4 <= width; x += 4) {
+      uint32x4_t p = vld1q_u32(src + x);
+      vst2q_u32(dst + (2 * x), ((uint32x4x2_t) { { p, p } }));
+   }
+#endif
+   for (; x < width; x++) {
+      dst[(2 * x) + 0] = src[x];
+      dst[(2 * x) + 1] = src[x];
+   }
+}
+
+static void _scale_line_3x(uint32_t *dst, uint32_t *src, int width) {
+   int x = 0;
+#if defined(__SSE2__)
+   for (; x + 4 <= width; x += 4) {
+      __m128i p = _mm_loadu_si128((__m128i*) (src + x));
+      _mm_storeu_si128((__m128i*) (dst + (3 * x)), _mm_shuffle_epi32(p, _MM_SHUFFLE(1, 0, 0, 0)));
+      _mm_storeu_si128((__m128i*) (dst + (3 * x) + 4), _mm_shuffle_epi32(p, _MM_SHUFFLE(2, 2, 1, 1)));
+      _mm_storeu_si128((__m128i*) (dst + (3 * x) + 8), _mm_shuffle_epi32(p, _MM_SHUFFLE(3, 3, 3, 2)));
+   }
+#elif defined(__ARM_NEON)
+   for (; x + 4 <= width; x += 4) {
+      uint32x4_t p = vld1q_u32(src + x);
+      vst3q_u32(dst + (3 * x), ((uint32x4x3_t) { { p, p, p } }));
+   }
+#endif
+   for (; x < width; x++) {
+      dst[(3 * x) + 0] = src[x];
+      dst[(3 * x) + 1] = src[x];
+      dst[(3 * x) + 2] = src[x];
+   }
+}
+
+static void _scale_rows(SDL_Surface *dst, SDL_Surface *src, int y, int rows, int scale) {
+   for (int row = y; row < (y + rows); row++) {
+      uint32_t *s = (uint32_t*) ((uint8_t*) src->pixels + (row * src->pitch));
+      uint32_t *d = (uint32_t*) ((uint8_t*) dst->pixels + (row * scale * dst->pitch));
+      switch (scale) {
+         case 1:
+            memcpy(d, s, src->w * sizeof(uint32_t));
+            break;
+         case 2:
+            _scale_line_2x(d, s, src->w);
+            break;
+         case 3:
+            _scale_line_3x(d, s, src->w);
+            break;
+      }
+      for (int i = 1; i < scale; i++) {
+         memcpy((uint8_t*) d + (i * dst->pitch), d, src->w * scale * sizeof(uint32_t));
+      }
+   }
+}
+
+static bool _is_xrgb(SDL_PixelFormat *format) {
+   return format->BytesPerPixel == 4 && format->Rmask == 0x00ff0000
+      && format->Gmask == 0x0000ff00 && format->Bmask == 0x000000ff;
+}
+
+// The window surface has to be drawn again after it was exposed or
+// resized. Watching events here keeps that out of the main loops.
+
+static int _display_event_watch(void *userdata, SDL_Event *event) {
+   struct ewm_sdl_display_t *display = (struct ewm_sdl_display_t*) userdata;
+   if (event->type == SDL_WINDOWEVENT && event->window.windowID == SDL_GetWindowID(display->window)) {
+      display->invalid = true;
+   }
+   return 1;
+}
+
+// One rect per band of lines, plus one for overlays
+
+static int _rects_capacity(struct ewm_sdl_display_t *display) {
+   return ((display->height + EWM_SDL_DISPLAY_BAND_HEIGHT - 1) / EWM_SDL_DISPLAY_BAND_HEIGHT) + 1;
+}
+
+static int ewm_sdl_display_init(struct ewm_sdl_display_t *display, SDL_Window *window, int width, int height) {
+   memset(display, 0x00, sizeof(struct ewm_sdl_display_t));
+
+   display->window = window;
+   display->width = width;
+   display->height = height;
+
+   display->renderer = SDL_CreateRenderer(window, -1, SDL_RENDERER_ACCELERATED);
+   if (display->renderer != NULL && ewm_sdl_check_renderer(display->renderer) == 0) {
+      display->type = EWM_SDL_DISPLAY_TYPE_RENDERER;
+      SDL_RenderSetLogicalSize(display->renderer, width, height);
+      return 0;
+   }
+
+   if (display->renderer != NULL) {
+      SDL_DestroyRenderer(display->renderer);
+      display->renderer = NULL;
+   }
+
+   fprintf(stderr, "[SDL] No accelerated renderer, drawing to the window surface\n");
+
+   display->type = EWM_SDL_DISPLAY_TYPE_SURFACE;
+   display->previous = calloc(width * height, sizeof(uint32_t));
+   display->rects = calloc(_rects_capacity(display), sizeof(SDL_Rect));
+   if (display->previous == NULL || display->rects == NULL) {
+      return -1;
+   }
+   display->invalid = true;
+
+   SDL_AddEventWatch(_display_event_watch, display);
+
+   return 0;
+}
+
+struct ewm_sdl_display_t *ewm_sdl_display_create(SDL_Window *window, int width, int height) {
+   struct ewm_sdl_display_t *display = (struct ewm_sdl_display_t*) malloc(sizeof(struct ewm_sdl_display_t));
+   if (ewm_sdl_display_init(display, window, width, height) != 0) {
+      ewm_sdl_display_destroy(display);
+      display = NULL;
+   }
+   return display;
+}
+
+void ewm_sdl_display_destroy(struct ewm_sdl_display_t *display) {
+   if (display->renderer != NULL) {
+      SDL_DestroyRenderer(display->renderer);
+   }
+   if (display->type == EWM_SDL_DISPLAY_TYPE_SURFACE) {
+      SDL_DelEventWatch(_display_event_watch, display);
+   }
+   free(display->previous);
+   free(display->rects);
+   free(display);
+}
+
+void ewm_sdl_display_invalidate(struct ewm_sdl_display_t *display) {
+   display->invalid = true;
+}
+
+static void _draw_renderer(struct ewm_sdl_display_t *display, SDL_Surface *surface, SDL_Rect *dst) {
+   SDL_SetRenderDrawColor(display->renderer, 0, 0, 0, 255);
+   SDL_RenderClear(display->renderer);
+
+   SDL_Texture *texture = SDL_CreateTextureFromSurface(display->renderer, surface);
+   if (texture != NULL) {
+      SDL_RenderCopy(display->renderer, texture, NULL, dst);
+      SDL_DestroyTexture(texture);
+   }
+}
+
+static void _draw_surface(struct ewm_sdl_display_t *display, SDL_Surface *surface) {
+   // The window surface is replaced when the window changes size, in
+   // which case everything needs to be drawn again.
+
+   SDL_Surface *window_surface = SDL_GetWindowSurface(display->window);
+   if (window_surface == NULL) {
+      return;
+   }
+
+   if (window_surface != display->surface) {
+      display->surface = window_surface;
+      display->invalid = true;
+   }
+
+   int scale = SDL_min(window_surface->w / display->width, window_surface->h / display->height);
+   scale = SDL_max(1, SDL_min(scale, EWM_SDL_DISPLAY_MAX_SCALE));
+   if (scale != display->scale) {
+      display->scale = scale;
+      display->invalid = true;
+   }
+
+   if (display->invalid) {
+      SDL_FillRect(window_surface, NULL, SDL_MapRGB(window_surface->format, 0, 0, 0));
+      display->update_all = true;
+   }
+
+   // Formats we cannot copy directly are left to SDL, which is slow
+   // but correct.
+
+   if (!_is_xrgb(window_surface->format) || !_is_xrgb(surface->format)) {
+      SDL_Rect dst = { .x = 0, .y = 0, .w = display->width * scale, .h = display->height * scale };
+      SDL_BlitScaled(surface, NULL, window_surface, &dst);
+      display->update_all = true;
+      display->invalid = false;
+      display->stale_top = display->stale_bottom = 0;
+      return;
+   }
+
+   if (SDL_MUSTLOCK(window_surface)) {
+      SDL_LockSurface(window_surface);
+   }
+
+   // Only bands of lines that changed since the previous frame are
+   // copied. Adjacent dirty bands are merged into a single rect. Lines
+   // that an overlay covered on the previous frame are always copied
+   // again to remove it.
+
+   SDL_Rect *last = NULL;
+
+   for (int y = 0; y < display->height; y += EWM_SDL_DISPLAY_BAND_HEIGHT) {
+      int rows = SDL_min(EWM_SDL_DISPLAY_BAND_HEIGHT, display->height - y);
+      uint32_t *src = (uint32_t*) ((uint8_t*) surface->pixels + (y * surface->pitch));
+      uint32_t *previous = display->previous + (y * display->width);
+      size_t size = rows * display->width * sizeof(uint32_t);
+      bool stale = y < display->stale_bottom && (y + rows) > display->stale_top;
+
+      if (!display->invalid && !stale && memcmp(previous, src, size) == 0) {
+         last = NULL;
+         continue;
+      }
+
+      memcpy(previous, src, size);
+      _scale_rows(window_surface, surface, y, rows, scale);
+
+      if (last != NULL) {
+         last->h += rows * scale;
+      } else {
+         last = &display->rects[display->rects_count++];
+         *last = (SDL_Rect) { .x = 0, .y = y * scale, .w = display->width * scale, .h = rows * scale };
+      }
+   }
+
+   if (SDL_MUSTLOCK(window_surface)) {
+      SDL_UnlockSurface(window_surface);
+   }
+
+   display->invalid = false;
+   display->stale_top = display->stale_bottom = 0;
+}
+
+// Draw the screen. The dst rect is only used with a renderer, where it
+// is in logical coordinates. On the window surface the screen is always
+// drawn in the top left corner at the largest scale that fits.
+
+void ewm_sdl_display_draw(struct ewm_sdl_display_t *display, SDL_Surface *surface, SDL_Rect *dst) {
+   switch (display->type) {
+      case EWM_SDL_DISPLAY_TYPE_RENDERER:
+         _draw_renderer(display, surface, dst);
+         break;
+      case EWM_SDL_DISPLAY_TYPE_SURFACE:
+         _draw_surface(display, surface);
+         break;
+   }
+}
+
+// Mark a part of the window surface that was drawn over after the
+// screen was drawn. It is updated when presenting, and the screen
+// underneath it is drawn again on the next frame. Only needed when
+// drawing to the window surface.
+
+void ewm_sdl_display_overlay(struct ewm_sdl_display_t *display, SDL_Rect *rect) {
+   if (display->type != EWM_SDL_DISPLAY_TYPE_SURFACE || display->surface == NULL || display->scale == 0) {
+      return;
+   }
+
+   SDL_Rect bounds = { .x = 0, .y = 0, .w = display->surface->w, .h = display->surface->h };
+   SDL_Rect clipped;
+   if (!SDL_IntersectRect(rect, &bounds, &clipped)) {
+      return;
+   }
+
+   // Dirty bands below the overlay are merged into it, so that no part
+   // of the window is updated twice.
+
+   for (int i = 0; i < display->rects_count; ) {
+      if (SDL_HasIntersection(&display->rects[i], &clipped)) {
+         SDL_UnionRect(&display->rects[i], &clipped, &clipped);
+         display->rects[i] = display->rects[--display->rects_count];
+      } else {
+         i++;
+      }
+   }
+
+   if (display->rects_count < _rects_capacity(display)) {
+      display->rects[display->rects_count++] = clipped;
+   } else {
+      SDL_UnionRect(&display->rects[display->rects_count - 1], &clipped, &display->rects[display->rects_count - 1]);
+   }
+
+   int top = clipped.y / display->scale;
+   int bottom = (clipped.y + clipped.h + display->scale - 1) / display->scale;
+   if (display->stale_bottom > display->stale_top) {
+      top = SDL_min(top, display->stale_top);
+      bottom = SDL_max(bottom, display->stale_bottom);
+   }
+   display->stale_top = top;
+   display->stale_bottom = bottom;
+}
+
+void ewm_sdl_display_present(struct ewm_sdl_display_t *display) {
+   switch (display->type) {
+      case EWM_SDL_DISPLAY_TYPE_RENDERER:
+         SDL_RenderPresent(display->renderer);
+         break;
+      case EWM_SDL_DISPLAY_TYPE_SURFACE:
+         if (display->update_all || display->invalid) {
+            SDL_UpdateWindowSurface(display->window);
+         } else if (display->rects_count != 0) {
+            SDL_UpdateWindowSurfaceRects(display->window, display->rects, display->rects_count);
+         }
+         display->update_all = false;
+         display->rects_count = 0;
+         break;
+   }
+}
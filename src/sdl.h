@@ -23,8 +23,48 @@
 #ifndef EWM_SDL
 #define EWM_SDL
 
+#include <stdbool.h>
 #include <SDL2/SDL.h>
 
+// A display is where a machine presents its screen. It uses an
+// accelerated renderer when one is available and otherwise writes
+// directly into the window surface, upscaling with integer factors
+// and only updating the parts of the window that changed.
+
+#define EWM_SDL_DISPLAY_TYPE_RENDERER (0)
+#define EWM_SDL_DISPLAY_TYPE_SURFACE  (1)
+
+#define EWM_SDL_DISPLAY_MAX_SCALE (3)
+#define EWM_SDL_DISPLAY_BAND_HEIGHT (8)
+
+struct ewm_sdl_display_t {
+   int type;
+   SDL_Window *window;
+   SDL_Renderer *renderer; // NULL when presenting to the window surface
+   int width, height;      // Logical size of the screen
+   int scale;              // Current integer scale of the window surface
+
+   // Software presentation state
+   SDL_Surface *surface;
+   uint32_t *previous;     // Last frame that was written to the surface
+   bool invalid;           // Redraw and update everything on the next frame
+   bool update_all;        // Update the whole window surface when presenting
+   int rects_count;
+   SDL_Rect *rects;        // Dirty parts of the window surface
+   int stale_top;          // Lines drawn over by an overlay, which are
+   int stale_bottom;       // drawn again on the next frame
+};
+
+struct ewm_sdl_display_t *ewm_sdl_display_create(SDL_Window *window, int width, int height);
+void ewm_sdl_display_destroy(struct ewm_sdl_display_t *display);
+void ewm_sdl_display_invalidate(struct ewm_sdl_display_t *display);
+void ewm_sdl_display_draw(struct ewm_sdl_display_t *display, SDL_Surface *surface, SDL_Rect *dst);
+void ewm_sdl_display_overlay(struct ewm_sdl_display_t *display, SDL_Rect *rect);
+void ewm_sdl_display_present(struct ewm_sdl_display_t *display);
+
+int ewm_sdl_wait_event(SDL_Event *event, uint64_t deadline);
+bool ewm_sdl_window_visible(SDL_Window *window);
+
 int ewm_sdl_pixel_format(SDL_Renderer *renderer);
 int ewm_sdl_check_renderer(SDL_Renderer *renderer);
 uint32_t ewm_sdl_green(SDL_Renderer *renderer);
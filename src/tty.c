@@ -36,8 +36,15 @@ struct ewm_tty_t *ewm_tty_create(SDL_Renderer *renderer, SDL_Color color) {
          ewm_sdl_pixel_format(renderer));
 
    tty->screen_cursor_enabled = 1;
+   tty->screen_cursor_drawn_row = -1;
    tty->color = SDL_MapRGBA(tty->surface->format, color.r, color.g, color.b, color.a);
+
+   // Every tty has its own character generator, so we can color the
+   // glyphs once here and simply copy them when rendering.
+   ewm_chr_set_color(tty->chr, tty->color);
+
    ewm_tty_reset(tty);
+   ewm_tty_invalidate(tty);
    return tty;
 }
 
@@ -45,48 +52,52 @@ void ewm_tty_destroy(struct ewm_tty_t *tty) {
    // TODO
 }
 
-#if 0
-static inline void ewm_tty_render_character(struct ewm_tty_t *tty, int row, int column, uint8_t c) {
-   // TODO Should we learn chr.c about the Apple1 character set instead of mapping it to the Apple ][+ one?
-   c += 0x80;
-   if (tty->chr->characters[c] != NULL) {
-      SDL_Rect dst;
-      dst.x = column * 7;
-      dst.y = row * 8;
-      dst.w = 7;
-      dst.h = 8;
-      SDL_SetTextureColorMod(tty->chr->characters[c], 0, 255, 0);
-      SDL_RenderCopy(tty->renderer, tty->chr->characters[c], NULL, &dst);
-   }
-}
-#endif
-
-// Take one - get something on the screen. Very inefficient to do it char-by-char, but good baseline.
+// Glyphs are pre-colored, so rendering a character is just copying
+// rows of pixels from the character generator into the pixel buffer.
 static inline void ewm_tty_render_character(struct ewm_tty_t *tty, int row, int column, uint8_t c) {
    c += 0x80; // TODO This should not be there really
    uint32_t *src = tty->chr->bitmaps[c];
+   uint32_t *dst = tty->pixels + ((40 * 7 * 8) * row) + (7 * column);
    if (src != NULL) {
-      uint32_t *dst = tty->pixels + ((40 * 7 * 8) * row) + (7 * column);
       for (int y = 0; y < 8; y++) {
-         for (int x = 0; x < 7; x++) {
-            *dst++ = *src++ ? tty->color : 0; // TODO Can be optimized by moving color into chr
-         }
-         dst += (40 * 7) - 7;
+         memcpy(dst, src, 7 * sizeof(uint32_t));
+         src += 7;
+         dst += (40 * 7);
       }
    } else {
-      uint32_t *dst = tty->pixels + ((40 * 7 * 8) * row) + (7 * column);
       for (int y = 0; y < 8; y++) {
-         for (int x = 0; x < 7; x++) {
-            *dst++ = 0;
-         }
-         dst += (40 * 7) - 7;
+         memset(dst, 0, 7 * sizeof(uint32_t));
+         dst += (40 * 7);
       }
    }
 }
 
+static inline void tty_set_cell(struct ewm_tty_t *tty, int idx, uint8_t v) {
+   if (tty->screen_buffer[idx] != v) {
+      tty->screen_buffer[idx] = v;
+      tty->screen_dirty_cells[idx] = true;
+      tty->screen_dirty = true;
+   }
+}
+
+// Scrolling only moves the screen buffer and dirty flags. The pixels
+// are moved up in one go at the next refresh, so that a burst of
+// output does not copy the whole pixel buffer for every line.
+
 static void tty_scroll_up(struct ewm_tty_t *tty) {
    memmove(tty->screen_buffer, &tty->screen_buffer[EWM_ONE_TTY_COLUMNS], (EWM_ONE_TTY_ROWS-1) * EWM_ONE_TTY_COLUMNS);
    memset(&tty->screen_buffer[(EWM_ONE_TTY_ROWS-1) * EWM_ONE_TTY_COLUMNS], 0, EWM_ONE_TTY_COLUMNS);
+
+   memmove(tty->screen_dirty_cells, &tty->screen_dirty_cells[EWM_ONE_TTY_COLUMNS], (EWM_ONE_TTY_ROWS-1) * EWM_ONE_TTY_COLUMNS * sizeof(bool));
+   for (int i = 0; i < EWM_ONE_TTY_COLUMNS; i++) {
+      tty->screen_dirty_cells[(EWM_ONE_TTY_ROWS-1) * EWM_ONE_TTY_COLUMNS + i] = true;
+   }
+
+   if (tty->screen_cursor_drawn_row >= 0) {
+      tty->screen_cursor_drawn_row--;
+   }
+
+   tty->screen_scroll++;
 }
 
 void ewm_tty_write(struct ewm_tty_t *tty, uint8_t v) {
@@ -94,17 +105,17 @@ void ewm_tty_write(struct ewm_tty_t *tty, uint8_t v) {
       tty->screen_cursor_column = 0;
       tty->screen_cursor_row++;
       if (tty->screen_cursor_row == EWM_ONE_TTY_ROWS) {
-         tty->screen_cursor_row = EWM_ONE_TTY_ROWS - 1; // TODO Scroll the screen up
+         tty->screen_cursor_row = EWM_ONE_TTY_ROWS - 1;
          tty_scroll_up(tty);
       }
    } else {
-      tty->screen_buffer[(tty->screen_cursor_row * EWM_ONE_TTY_COLUMNS) + tty->screen_cursor_column] = v;
+      tty_set_cell(tty, (tty->screen_cursor_row * EWM_ONE_TTY_COLUMNS) + tty->screen_cursor_column, v);
       tty->screen_cursor_column++;
       if (tty->screen_cursor_column == EWM_ONE_TTY_COLUMNS) {
          tty->screen_cursor_column = 0;
          tty->screen_cursor_row++;
          if (tty->screen_cursor_row == EWM_ONE_TTY_ROWS) {
-            tty->screen_cursor_row = EWM_ONE_TTY_ROWS - 1; // TODO Scroll the screen up
+            tty->screen_cursor_row = EWM_ONE_TTY_ROWS - 1;
             tty_scroll_up(tty);
          }
       }
@@ -113,10 +124,8 @@ void ewm_tty_write(struct ewm_tty_t *tty, uint8_t v) {
 }
 
 void ewm_tty_reset(struct ewm_tty_t *tty) {
-   for (int row = 0; row < EWM_ONE_TTY_ROWS; row++) {
-      for (int column = 0; column < EWM_ONE_TTY_COLUMNS; column++) {
-         tty->screen_buffer[(row * EWM_ONE_TTY_COLUMNS) + column] = 0x00;
-      }
+   for (int i = 0; i < EWM_ONE_TTY_ROWS * EWM_ONE_TTY_COLUMNS; i++) {
+      tty_set_cell(tty, i, 0x00);
    }
 
    tty->screen_cursor_row = 0;
@@ -125,18 +134,38 @@ void ewm_tty_reset(struct ewm_tty_t *tty) {
 }
 
 void ewm_tty_set_line(struct ewm_tty_t *tty, int v, char *line) {
-   if (v < 24) {
-      char buf[41];
-      snprintf(buf, 40, "%-40s", line);
-      memcpy(tty->screen_buffer + (v * 40), buf, 40);
+   if (v < EWM_ONE_TTY_ROWS) {
+      char buf[EWM_ONE_TTY_COLUMNS + 1];
+      snprintf(buf, sizeof(buf), "%-40s", line);
+      for (int i = 0; i < EWM_ONE_TTY_COLUMNS; i++) {
+         tty_set_cell(tty, (v * EWM_ONE_TTY_COLUMNS) + i, buf[i]);
+      }
    }
 }
 
+// Mark the whole screen for redrawing. Needed when the screen_buffer
+// was changed directly instead of through the functions above.
+
+void ewm_tty_invalidate(struct ewm_tty_t *tty) {
+   for (int i = 0; i < EWM_ONE_TTY_ROWS * EWM_ONE_TTY_COLUMNS; i++) {
+      tty->screen_dirty_cells[i] = true;
+   }
+   tty->screen_scroll = 0;
+   tty->screen_cursor_drawn_row = -1;
+   tty->screen_dirty = true;
+}
+
 void ewm_tty_refresh(struct ewm_tty_t *tty, uint32_t phase, uint32_t fps) {
-   for (int row = 0; row < 24; row++) {
-      for (int column = 0; column < 40; column++) {
-         ewm_tty_render_character(tty, row, column, tty->screen_buffer[(row * EWM_ONE_TTY_COLUMNS) + column]);
-      }
+   // Apply pending scrolls by moving the pixels up. The rows that
+   // scrolled in are already marked dirty.
+
+   if (tty->screen_scroll >= EWM_ONE_TTY_ROWS) {
+      ewm_tty_invalidate(tty);
+   } else if (tty->screen_scroll > 0) {
+      size_t row_pixels = EWM_ONE_TTY_COLUMNS * 7 * 8;
+      memmove(tty->pixels, tty->pixels + (tty->screen_scroll * row_pixels),
+         (EWM_ONE_TTY_ROWS - tty->screen_scroll) * row_pixels * sizeof(uint32_t));
+      tty->screen_scroll = 0;
    }
 
    if (fps != 0) {
@@ -145,11 +174,30 @@ void ewm_tty_refresh(struct ewm_tty_t *tty, uint32_t phase, uint32_t fps) {
       }
    }
 
+   // Restore whatever was under the cursor last time
+
+   if (tty->screen_cursor_drawn_row >= 0) {
+      tty->screen_dirty_cells[(tty->screen_cursor_drawn_row * EWM_ONE_TTY_COLUMNS) + tty->screen_cursor_drawn_column] = true;
+      tty->screen_cursor_drawn_row = -1;
+   }
+
+   for (int row = 0; row < EWM_ONE_TTY_ROWS; row++) {
+      for (int column = 0; column < EWM_ONE_TTY_COLUMNS; column++) {
+         int idx = (row * EWM_ONE_TTY_COLUMNS) + column;
+         if (tty->screen_dirty_cells[idx]) {
+            ewm_tty_render_character(tty, row, column, tty->screen_buffer[idx]);
+            tty->screen_dirty_cells[idx] = false;
+         }
+      }
+   }
+
    if (tty->screen_cursor_enabled) {
       if (tty->screen_cursor_blink) {
          ewm_tty_render_character(tty, tty->screen_cursor_row, tty->screen_cursor_column, EWM_ONE_TTY_CURSOR_ON);
       } else {
          ewm_tty_render_character(tty, tty->screen_cursor_row, tty->screen_cursor_column, EWM_ONE_TTY_CURSOR_OFF);
       }
+      tty->screen_cursor_drawn_row = tty->screen_cursor_row;
+      tty->screen_cursor_drawn_column = tty->screen_cursor_column;
    }
 }
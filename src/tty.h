@@ -40,11 +40,15 @@ struct ewm_tty_t {
    struct ewm_chr_t *chr;
    bool screen_dirty;
    uint8_t screen_buffer[EWM_ONE_TTY_ROWS * EWM_ONE_TTY_COLUMNS];
+   bool screen_dirty_cells[EWM_ONE_TTY_ROWS * EWM_ONE_TTY_COLUMNS];
+   int screen_scroll; // Number of scrolls not yet applied to pixels
 
    int screen_cursor_enabled;
    int screen_cursor_row;
    int screen_cursor_column;
    int screen_cursor_blink;
+   int screen_cursor_drawn_row; // Where the cursor was last rendered, -1 if nowhere
+   int screen_cursor_drawn_column;
 
    uint32_t *pixels;
    SDL_Surface *surface;
@@ -56,6 +60,7 @@ void ewm_tty_destroy(struct ewm_tty_t *tty);
 void ewm_tty_write(struct ewm_tty_t *tty, uint8_t v);
 void ewm_tty_reset(struct ewm_tty_t *tty);
 void ewm_tty_set_line(struct ewm_tty_t *tty, int v, char *line);
+void ewm_tty_invalidate(struct ewm_tty_t *tty);
 void ewm_tty_refresh(struct ewm_tty_t *tty, uint32_t phase, uint32_t fps);
 
 #endif // EWM_TTY_H
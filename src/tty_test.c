@@ -1,67 +1,131 @@
-
 #include <stdio.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 
 #include "one.h"
 #include "tty.h"
 
-void test(struct ewm_tty_t *tty) {
-   // TODO Setup
+typedef void (*test_setup_t)(struct ewm_tty_t *tty);
+typedef void (*test_run_t)(struct ewm_tty_t *tty, int i);
 
+static void tty_write_line(struct ewm_tty_t *tty) {
+   for (int i = 0; i < EWM_ONE_TTY_COLUMNS - 1; i++) {
+      ewm_tty_write(tty, 32 + (rand() % 64));
+   }
+   ewm_tty_write(tty, '\r');
+}
+
+void random_screen_setup(struct ewm_tty_t *tty) {
    for (int i = 0; i < (EWM_ONE_TTY_ROWS * EWM_ONE_TTY_COLUMNS); i++) {
       tty->screen_buffer[i] = 32 + (rand() % 64);
    }
+   ewm_tty_invalidate(tty);
+   ewm_tty_refresh(tty, 1, EWM_ONE_FPS);
+}
+
+// Worst case: every cell is redrawn
+
+void full_refresh_test(struct ewm_tty_t *tty, int i) {
+   ewm_tty_invalidate(tty);
+   ewm_tty_refresh(tty, i, EWM_ONE_FPS);
+}
+
+// Nothing changes but the blinking cursor
+
+void idle_refresh_test(struct ewm_tty_t *tty, int i) {
+   ewm_tty_refresh(tty, i, EWM_ONE_FPS);
+}
+
+// One line of output per refresh, scrolling the screen each time
+
+void scroll_refresh_test(struct ewm_tty_t *tty, int i) {
+   tty_write_line(tty);
+   ewm_tty_refresh(tty, i, EWM_ONE_FPS);
+}
+
+// Many lines of output per refresh, like listing a BASIC program
+
+void list_refresh_test(struct ewm_tty_t *tty, int i) {
+   for (int l = 0; l < 10; l++) {
+      tty_write_line(tty);
+   }
+   ewm_tty_refresh(tty, i, EWM_ONE_FPS);
+}
+
+void test(struct ewm_tty_t *tty, char *name, test_setup_t test_setup, test_run_t test_run) {
+   test_setup(tty);
 
    Uint64 start = SDL_GetPerformanceCounter();
    for (int i = 0; i < 1000; i++) {
-      SDL_SetRenderDrawColor(tty->renderer, 0, 0, 0, 255);
-      SDL_RenderClear(tty->renderer);
+      if (tty->renderer != NULL) {
+         SDL_SetRenderDrawColor(tty->renderer, 0, 0, 0, 255);
+         SDL_RenderClear(tty->renderer);
+      }
 
-      ewm_tty_refresh(tty, 1, EWM_ONE_FPS);
+      test_run(tty, i);
 
-      SDL_Texture *texture = SDL_CreateTextureFromSurface(tty->renderer, tty->surface);
-      if (texture != NULL) {
-         SDL_RenderCopy(tty->renderer, texture, NULL, NULL);
-         SDL_DestroyTexture(texture);
-      }
+      if (tty->renderer != NULL) {
+         SDL_Texture *texture = SDL_CreateTextureFromSurface(tty->renderer, tty->surface);
+         if (texture != NULL) {
+            SDL_RenderCopy(tty->renderer, texture, NULL, NULL);
+            SDL_DestroyTexture(texture);
+         }
 
-      SDL_RenderPresent(tty->renderer);
+         SDL_RenderPresent(tty->renderer);
+      }
    }
    Uint64 now = SDL_GetPerformanceCounter();
    double total = (double)((now - start)*1000) / SDL_GetPerformanceFrequency();
    double per_screen = total / 1000.0;
 
-   printf("%-20s %.3f/refresh\n", "tty", per_screen);
+   printf("%-20s %.3f/refresh\n", name, per_screen);
 }
 
-int main() {
-   if (SDL_Init(SDL_INIT_VIDEO | SDL_INIT_TIMER | SDL_INIT_EVENTS) < 0) {
-      fprintf(stderr, "Failed to initialize SDL: %s\n", SDL_GetError());
-      return 1;
-   }
+int main(int argc, char **argv) {
+   // With --headless no window is created and only the rendering into
+   // pixels is measured.
 
-   SDL_Window *window = SDL_CreateWindow("ewm - tty_test", SDL_WINDOWPOS_CENTERED, SDL_WINDOWPOS_CENTERED, 280*3, 192*3, SDL_WINDOW_SHOWN);
-   if (window == NULL) {
-      fprintf(stderr, "Failed create window: %s\n", SDL_GetError());
-      return 1;
-   }
+   bool headless = (argc == 2 && strcmp(argv[1], "--headless") == 0);
 
-   SDL_Renderer *renderer = SDL_CreateRenderer(window, -1, SDL_RENDERER_ACCELERATED);
-   if (renderer == NULL) {
-      fprintf(stderr, "Failed to create renderer: %s\n", SDL_GetError());
-      return 1;
-   }
+   SDL_Window *window = NULL;
+   SDL_Renderer *renderer = NULL;
 
-   SDL_RenderSetLogicalSize(renderer, 280, 192);
+   if (!headless) {
+      if (SDL_Init(SDL_INIT_VIDEO | SDL_INIT_TIMER | SDL_INIT_EVENTS) < 0) {
+         fprintf(stderr, "Failed to initialize SDL: %s\n", SDL_GetError());
+         return 1;
+      }
 
-   sleep(3);
+      window = SDL_CreateWindow("ewm - tty_test", SDL_WINDOWPOS_CENTERED, SDL_WINDOWPOS_CENTERED, 280*3, 192*3, SDL_WINDOW_SHOWN);
+      if (window == NULL) {
+         fprintf(stderr, "Failed create window: %s\n", SDL_GetError());
+         return 1;
+      }
 
-   struct ewm_one_t *one = ewm_one_create(EWM_ONE_MODEL_APPLE1, renderer);
-   test(one->tty);
+      renderer = SDL_CreateRenderer(window, -1, SDL_RENDERER_ACCELERATED);
+      if (renderer == NULL) {
+         fprintf(stderr, "Failed to create renderer: %s\n", SDL_GetError());
+         return 1;
+      }
+
+      SDL_RenderSetLogicalSize(renderer, 280, 192);
 
-   SDL_DestroyWindow(window);
-   SDL_DestroyRenderer(renderer);
-   SDL_Quit();
+      sleep(3);
+   }
+
+   struct ewm_one_t *one = ewm_one_create(EWM_ONE_MODEL_APPLE1, renderer);
+   test(one->tty, "full_refresh", random_screen_setup, full_refresh_test);
+   test(one->tty, "idle_refresh", random_screen_setup, idle_refresh_test);
+   test(one->tty, "scroll_refresh", random_screen_setup, scroll_refresh_test);
+   test(one->tty, "list_refresh", random_screen_setup, list_refresh_test);
+
+   if (!headless) {
+      SDL_DestroyWindow(window);
+      SDL_DestroyRenderer(renderer);
+      SDL_Quit();
+   }
 
    return 0;
 }
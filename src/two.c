@@ -24,6 +24,8 @@
 #include <stdlib.h>
 #include <string.h>
 #include <getopt.h>
+#include <inttypes.h>
+#include <math.h>
 #include <time.h>
 
 #include <SDL2/SDL.h>
@@ -34,10 +36,14 @@
 #include "alc.h"
 #include "chr.h"
 #include "scr.h"
+#include "sdl.h"
+#include "clk.h"
+#include "que.h"
+#include "lib.h"
+#include "hdv.h"
 #if defined(EWM_LUA)
 #include "lua.h"
 #endif
-#include "tty.h"
 #include "two.h"
 
 
@@ -81,6 +87,17 @@ static uint8_t ewm_two_iom_read(struct cpu_t *cpu, struct mem_t *mem, uint16_t a
    //printf("ewm_two_iom_read(%x)\n", addr);
    switch (addr) {
       case EWM_A2P_SS_KBD:
+         // Latency is only measured when not running ahead, the real
+         // timeline sees the key press later
+         if (two->key_time != 0 && !cpu->ahead) {
+            uint64_t latency = ewm_clk_now() - two->key_time;
+            two->key_latency_count++;
+            two->key_latency_total += latency;
+            if (latency > two->key_latency_max) {
+               two->key_latency_max = latency;
+            }
+            two->key_time = 0;
+         }
          return two->key;
       case EWM_A2P_SS_KBDSTRB:
          two->key &= 0x7f;
@@ -128,6 +145,7 @@ static uint8_t ewm_two_iom_read(struct cpu_t *cpu, struct mem_t *mem, uint16_t a
 
       case EWM_A2P_SS_SPKR:
          // TODO Implement speaker support
+         cpu_slow_down(cpu, EWM_TWO_SPKR_SLOW_DOWN_CYCLES);
          break;
 
       case EWM_A2P_SS_PB0:
@@ -159,11 +177,9 @@ static uint8_t ewm_two_iom_read(struct cpu_t *cpu, struct mem_t *mem, uint16_t a
 
       case EWM_TWO_SS_PTRIG: {
          if (two->joystick != NULL) {
-            int x = 128 + (SDL_JoystickGetAxis(two->joystick, 0) / 256);
-            two->padl0_time = two->cpu->counter + (x * (2820 / 255)); // TODO Remove magic values
+            two->padl0_time = two->cpu->counter + (two->paddles[0] * (2820 / 255)); // TODO Remove magic values
             two->padl0_value = 0xff;
-            int y = 128 + (SDL_JoystickGetAxis(two->joystick, 1) / 256);
-            two->padl1_time = two->cpu->counter + (y * (2820 / 255)); // TODO Remove magic values
+            two->padl1_time = two->cpu->counter + (two->paddles[1] * (2820 / 255)); // TODO Remove magic values
             two->padl1_value = 0xff;
          }
          break;
@@ -243,6 +259,7 @@ static void ewm_two_iom_write(struct cpu_t *cpu, struct mem_t *mem, uint16_t add
 
       case EWM_A2P_SS_SPKR:
          // TODO Implement speaker support
+         cpu_slow_down(cpu, EWM_TWO_SPKR_SLOW_DOWN_CYCLES);
          break;
 
       case EWM_A2P_SS_SETAN0:
@@ -297,6 +314,7 @@ static int ewm_two_init(struct ewm_two_t *two, int type, SDL_Renderer *renderer,
          two->roms[4] = cpu_add_rom_file(two->cpu, 0xf000, "rom/341-0015.bin"); // AppleSoft BASIC F000
          two->roms[5] = cpu_add_rom_file(two->cpu, 0xf800, "rom/341-0020.bin"); // Autostart Monitor F800
          two->iom = cpu_add_iom(two->cpu, 0xc000, 0xc07f, two, ewm_two_iom_read, ewm_two_iom_write);
+         cpu_add_idle_address(two->cpu, EWM_A2P_SS_KBD);
 
          two->dsk = ewm_dsk_create(two->cpu);
          if (two->dsk == NULL) {
@@ -316,13 +334,11 @@ static int ewm_two_init(struct ewm_two_t *two, int type, SDL_Renderer *renderer,
             return -1;
          }
 
-         SDL_Color red = {255,0,0,255};
-         two->tty = ewm_tty_create(renderer, red);
-         if (two->tty == NULL) {
-            fprintf(stderr, "[TWO] Could not create status tty\n");
+         two->batch = ewm_chr_batch_create();
+         if (two->batch == NULL) {
+            fprintf(stderr, "[TWO] Could not create text batch\n");
             return -1;
          }
-         two->tty->screen_cursor_enabled = 0;
 
          break;
       }
@@ -430,6 +446,31 @@ static int two_lua_onKeyUp(lua_State *state) {
    return 0;
 }
 
+// two:loadDisk(drive, disk) puts a disk in drive 1 or 2. The disk is
+// either a path or the number of a library disk, starting at 1.
+
+static int two_lua_loadDisk(lua_State *state) {
+   if (lua_gettop(state) != 3) {
+      printf("Not enough arguments\n");
+      return 0;
+   }
+
+   void *two_data = luaL_checkudata(state, 1, "two_meta_table");
+   struct ewm_two_t *two = *((struct ewm_two_t**) two_data);
+
+   int drive = luaL_checkinteger(state, 2) - 1;
+
+   int result;
+   if (lua_type(state, 3) == LUA_TNUMBER) {
+      result = ewm_two_swap_disk(two, drive, lua_tointeger(state, 3) - 1);
+   } else {
+      result = ewm_two_load_disk(two, drive, (char*) luaL_checkstring(state, 3));
+   }
+
+   lua_pushboolean(state, result == 0);
+   return 1;
+}
+
 int ewm_two_init_lua(struct ewm_two_t *two, struct ewm_lua_t *lua) {
    two->lua = lua;
 
@@ -443,6 +484,7 @@ int ewm_two_init_lua(struct ewm_two_t *two, struct ewm_lua_t *lua) {
    luaL_Reg two_methods[] = {
       {"onKeyDown", two_lua_onKeyDown},
       {"onKeyUp", two_lua_onKeyUp},
+      {"loadDisk", two_lua_loadDisk},
       {NULL, NULL}
    };
    ewm_lua_register_component(lua, "two_methods", two_methods);
@@ -464,18 +506,176 @@ int ewm_two_init_lua(struct ewm_two_t *two, struct ewm_lua_t *lua) {
 // External API
 
 int ewm_two_load_disk(struct ewm_two_t *two, int drive, char *path) {
+   // A library disk goes back into the library instead of being unloaded
+   if (two->lib != NULL) {
+      (void) ewm_lib_eject(two->lib, two->dsk, drive, two->cpu->counter);
+   }
    return ewm_dsk_set_disk_file(two->dsk, drive, false, path);
 }
 
-static bool ewm_two_poll_event(struct ewm_two_t *two, SDL_Window *window) { // TODO Should window be part of ewm_two_t?
+// Swap a disk from the library into a drive, or the next one if disk
+// is -1. The disk is prepared already, so this does not pause the
+// machine.
+
+int ewm_two_swap_disk(struct ewm_two_t *two, int drive, int disk) {
+   if (two->lib == NULL) {
+      return -1;
+   }
+
+   if (disk == -1) {
+      disk = ewm_lib_next(two->lib, drive);
+      if (disk == -1) {
+         return -1;
+      }
+   }
+
+   if (ewm_lib_insert(two->lib, two->dsk, drive, disk, two->cpu->counter) != 0) {
+      return -1;
+   }
+
+   fprintf(stderr, "[TWO] Drive %d: %s\n", drive + 1, two->lib->disks[disk].path);
+   return 0;
+}
+
+// Snapshots
+
+struct ewm_two_snapshot_t *ewm_two_snapshot_create(struct ewm_two_t *two) {
+   struct ewm_two_snapshot_t *snapshot = (struct ewm_two_snapshot_t*) malloc(sizeof(struct ewm_two_snapshot_t));
+   memset(snapshot, 0, sizeof(struct ewm_two_snapshot_t));
+   snapshot->cpu = cpu_snapshot_create(two->cpu);
+   if (snapshot->cpu == NULL) {
+      free(snapshot);
+      return NULL;
+   }
+   return snapshot;
+}
+
+void ewm_two_snapshot_destroy(struct ewm_two_snapshot_t *snapshot) {
+   cpu_snapshot_destroy(snapshot->cpu);
+   free(snapshot);
+}
+
+void ewm_two_snapshot_save(struct ewm_two_t *two, struct ewm_two_snapshot_t *snapshot) {
+   cpu_snapshot_save(two->cpu, snapshot->cpu);
+   ewm_dsk_save_state(two->dsk, &snapshot->dsk);
+   snapshot->alc_wrtcount = two->alc->wrtcount;
+   snapshot->screen_mode = two->screen_mode;
+   snapshot->screen_graphics_mode = two->screen_graphics_mode;
+   snapshot->screen_graphics_style = two->screen_graphics_style;
+   snapshot->screen_page = two->screen_page;
+   snapshot->key = two->key;
+   memcpy(snapshot->buttons, two->buttons, sizeof(snapshot->buttons));
+   snapshot->padl_time[0] = two->padl0_time;
+   snapshot->padl_time[1] = two->padl1_time;
+   snapshot->padl_time[2] = two->padl2_time;
+   snapshot->padl_time[3] = two->padl3_time;
+   snapshot->padl_value[0] = two->padl0_value;
+   snapshot->padl_value[1] = two->padl1_value;
+   snapshot->padl_value[2] = two->padl2_value;
+   snapshot->padl_value[3] = two->padl3_value;
+}
+
+void ewm_two_snapshot_restore(struct ewm_two_t *two, struct ewm_two_snapshot_t *snapshot) {
+   cpu_snapshot_restore(two->cpu, snapshot->cpu);
+   ewm_dsk_restore_state(two->dsk, &snapshot->dsk);
+   two->alc->wrtcount = snapshot->alc_wrtcount;
+   two->screen_mode = snapshot->screen_mode;
+   two->screen_graphics_mode = snapshot->screen_graphics_mode;
+   two->screen_graphics_style = snapshot->screen_graphics_style;
+   two->screen_page = snapshot->screen_page;
+   two->key = snapshot->key;
+   memcpy(two->buttons, snapshot->buttons, sizeof(two->buttons));
+   two->padl0_time = snapshot->padl_time[0];
+   two->padl1_time = snapshot->padl_time[1];
+   two->padl2_time = snapshot->padl_time[2];
+   two->padl3_time = snapshot->padl_time[3];
+   two->padl0_value = snapshot->padl_value[0];
+   two->padl1_value = snapshot->padl_value[1];
+   two->padl2_value = snapshot->padl_value[2];
+   two->padl3_value = snapshot->padl_value[3];
+}
+
+// Input for the machine. Events are turned into inputs on the UI side
+// and applied to the machine between cpu slices, so that devices never
+// have to call SDL themselves. A key press is timestamped so that we
+// can measure how long it takes until the emulated program reads it
+// from $C000.
+
+static void ewm_two_apply_input(struct ewm_two_t *two, struct ewm_two_input_t *input) {
+   switch (input->type) {
+      case EWM_TWO_INPUT_KEY:
+         two->key = input->value;
+         two->key_time = input->time;
+         break;
+      case EWM_TWO_INPUT_BUTTON:
+         two->buttons[input->index] = input->value;
+         break;
+      case EWM_TWO_INPUT_PADDLE:
+         two->paddles[input->index] = input->value;
+         break;
+      case EWM_TWO_INPUT_RESET:
+         fprintf(stderr, "[SDL] Reset\n");
+         cpu_reset(two->cpu);
+         break;
+      case EWM_TWO_INPUT_PAUSE:
+         if (two->state == EWM_TWO_STATE_PAUSED) {
+            two->state = EWM_TWO_STATE_RUNNING;
+         } else {
+            two->state = EWM_TWO_STATE_PAUSED;
+         }
+         two->screen_dirty = true;
+         break;
+      case EWM_TWO_INPUT_TURBO:
+         ewm_clk_set_turbo(two->clk, !two->clk->turbo, two->cpu->counter);
+         break;
+      case EWM_TWO_INPUT_QUIT:
+         two->quit = true;
+         break;
+      case EWM_TWO_INPUT_DISK:
+         (void) ewm_two_swap_disk(two, input->index, input->value);
+         break;
+   }
+}
+
+// When the machine runs on its own thread, inputs are queued and
+// applied by that thread. Otherwise they are applied right away.
+
+static void ewm_two_input(struct ewm_two_t *two, int type, int index, int value) {
+   struct ewm_two_input_t input = { .type = type, .index = index, .value = value, .time = ewm_clk_now() };
+   if (two->inputs == NULL) {
+      ewm_two_apply_input(two, &input);
+   } else if (!ewm_que_push(two->inputs, &input)) {
+      fprintf(stderr, "[TWO] Input queue is full, dropped input\n");
+   }
+}
+
+// Sample the joystick. This is done once per slice, so that $C070 only
+// has to look at the paddle values.
+
+static void ewm_two_sample_joystick(struct ewm_two_t *two) {
+   if (two->joystick != NULL) {
+      for (int i = 0; i < 2; i++) {
+         int value = 128 + (SDL_JoystickGetAxis(two->joystick, i) / 256);
+         if (value != two->joystick_values[i]) {
+            two->joystick_values[i] = value;
+            ewm_two_input(two, EWM_TWO_INPUT_PADDLE, i, value);
+         }
+      }
+   }
+}
+
+// Handle events until the deadline, when the next slice or frame is
+// due. This sleeps while there is no input instead of spinning.
+
+static bool ewm_two_poll_event(struct ewm_two_t *two, SDL_Window *window, uint64_t deadline) { // TODO Should window be part of ewm_two_t?
    SDL_Event event;
-   while (SDL_PollEvent(&event) != 0) {
+   for (int ready = ewm_sdl_wait_event(&event, deadline); ready != 0; ready = SDL_PollEvent(&event)) {
       switch (event.type) {
          case SDL_QUIT:
             return false;
 
          case SDL_WINDOWEVENT:
-            two->screen_dirty = true;
+            two->window_dirty = true;
             break;
 
          case SDL_CONTROLLERBUTTONDOWN:
@@ -483,17 +683,17 @@ static bool ewm_two_poll_event(struct ewm_two_t *two, SDL_Window *window) { // T
             switch (event.cbutton.button) {
                case SDL_CONTROLLER_BUTTON_A:
                case SDL_CONTROLLER_BUTTON_LEFTSHOULDER:
-                  two->buttons[0] = event.cbutton.state == SDL_PRESSED ? 0x80 : 0x00;
+                  ewm_two_input(two, EWM_TWO_INPUT_BUTTON, 0, event.cbutton.state == SDL_PRESSED ? 0x80 : 0x00);
                   break;
                case SDL_CONTROLLER_BUTTON_B:
                case SDL_CONTROLLER_BUTTON_RIGHTSHOULDER:
-                  two->buttons[1] = event.cbutton.state == SDL_PRESSED ? 0x80 : 0x00;
+                  ewm_two_input(two, EWM_TWO_INPUT_BUTTON, 1, event.cbutton.state == SDL_PRESSED ? 0x80 : 0x00);
                   break;
                case SDL_CONTROLLER_BUTTON_X:
-                  two->buttons[2] = event.cbutton.state == SDL_PRESSED ? 0x80 : 0x00;
+                  ewm_two_input(two, EWM_TWO_INPUT_BUTTON, 2, event.cbutton.state == SDL_PRESSED ? 0x80 : 0x00);
                   break;
                case SDL_CONTROLLER_BUTTON_Y:
-                  two->buttons[3] = event.cbutton.state == SDL_PRESSED ? 0x80 : 0x00;
+                  ewm_two_input(two, EWM_TWO_INPUT_BUTTON, 3, event.cbutton.state == SDL_PRESSED ? 0x80 : 0x00);
                   break;
             }
             break;
@@ -523,13 +723,12 @@ static bool ewm_two_poll_event(struct ewm_two_t *two, SDL_Window *window) { // T
 
             if (event.key.keysym.mod & KMOD_CTRL) {
                if (event.key.keysym.sym >= SDLK_a && event.key.keysym.sym <= SDLK_z) {
-                  two->key = (event.key.keysym.sym - SDLK_a + 1) | 0x80;
+                  ewm_two_input(two, EWM_TWO_INPUT_KEY, 0, (event.key.keysym.sym - SDLK_a + 1) | 0x80);
                }
             } else if (event.key.keysym.mod & KMOD_GUI) {
                switch (event.key.keysym.sym) {
                   case SDLK_ESCAPE:
-                     fprintf(stderr, "[SDL] Reset\n");
-                     cpu_reset(two->cpu);
+                     ewm_two_input(two, EWM_TWO_INPUT_RESET, 0, 0);
                      break;
                   case SDLK_RETURN:
                      if (SDL_GetWindowFlags(window) & SDL_WINDOW_FULLSCREEN) {
@@ -541,42 +740,46 @@ static bool ewm_two_poll_event(struct ewm_two_t *two, SDL_Window *window) { // T
                   case SDLK_i:
                      two->status_bar_visible = !two->status_bar_visible;
                      SDL_SetWindowSize(window, 40*7*3, 24*8*3 + (two->status_bar_visible ? (9*3) : 0));
-                     SDL_RenderSetLogicalSize(two->scr->renderer, 40*7*3, 24*8*3 + (two->status_bar_visible ? (9*3) : 0));
+                     if (two->scr->renderer != NULL) {
+                        SDL_RenderSetLogicalSize(two->scr->renderer, 40*7*3, 24*8*3 + (two->status_bar_visible ? (9*3) : 0));
+                     }
                      break;
                   case SDLK_p:
-                     if (two->state == EWM_TWO_STATE_PAUSED) {
-                        two->state = EWM_TWO_STATE_RUNNING;
-                     } else {
-                        two->state = EWM_TWO_STATE_PAUSED;
-                     }
+                     ewm_two_input(two, EWM_TWO_INPUT_PAUSE, 0, 0);
+                     break;
+                  case SDLK_t:
+                     ewm_two_input(two, EWM_TWO_INPUT_TURBO, 0, 0);
+                     break;
+                  case SDLK_d:
+                     ewm_two_input(two, EWM_TWO_INPUT_DISK, (event.key.keysym.mod & KMOD_SHIFT) ? EWM_DSK_DRIVE2 : EWM_DSK_DRIVE1, -1);
                      break;
                }
             } else if (event.key.keysym.mod == KMOD_NONE) {
                switch (event.key.keysym.sym) {
                   case SDLK_RETURN:
-                     two->key = 0x0d | 0x80; // CR
+                     ewm_two_input(two, EWM_TWO_INPUT_KEY, 0, 0x0d | 0x80); // CR
                      break;
                   case SDLK_TAB:
-                     two->key = 0x09 | 0x80; // HT
+                     ewm_two_input(two, EWM_TWO_INPUT_KEY, 0, 0x09 | 0x80); // HT
 		     break;
                   case SDLK_DELETE:
-                     two->key = 0x7f | 0x80; // DEL
+                     ewm_two_input(two, EWM_TWO_INPUT_KEY, 0, 0x7f | 0x80); // DEL
                      break;
                   case SDLK_BACKSPACE:
                   case SDLK_LEFT:
-                     two->key = 0x08 | 0x80; // BS
+                     ewm_two_input(two, EWM_TWO_INPUT_KEY, 0, 0x08 | 0x80); // BS
                      break;
                   case SDLK_RIGHT:
-                     two->key = 0x15 | 0x80; // NAK
+                     ewm_two_input(two, EWM_TWO_INPUT_KEY, 0, 0x15 | 0x80); // NAK
                      break;
                   case SDLK_UP:
-                     two->key = 0x0b | 0x80; // VT
+                     ewm_two_input(two, EWM_TWO_INPUT_KEY, 0, 0x0b | 0x80); // VT
                      break;
                   case SDLK_DOWN:
-                     two->key = 0x0a | 0x80; // LF
+                     ewm_two_input(two, EWM_TWO_INPUT_KEY, 0, 0x0a | 0x80); // LF
                      break;
                   case SDLK_ESCAPE:
-                     two->key = 0x1b | 0x80; // ESC
+                     ewm_two_input(two, EWM_TWO_INPUT_KEY, 0, 0x1b | 0x80); // ESC
                      break;
                }
             }
@@ -608,16 +811,16 @@ static bool ewm_two_poll_event(struct ewm_two_t *two, SDL_Window *window) { // T
             if (event.key.keysym.mod & KMOD_ALT) {
                switch (event.key.keysym.sym) {
                   case SDLK_1:
-                     two->buttons[0] = 0;
+                     ewm_two_input(two, EWM_TWO_INPUT_BUTTON, 0, 0);
                      break;
                   case SDLK_2:
-                     two->buttons[1] = 0;
+                     ewm_two_input(two, EWM_TWO_INPUT_BUTTON, 1, 0);
                      break;
                   case SDLK_3:
-                     two->buttons[2] = 0;
+                     ewm_two_input(two, EWM_TWO_INPUT_BUTTON, 2, 0);
                      break;
                   case SDLK_4:
-                     two->buttons[3] = 0;
+                     ewm_two_input(two, EWM_TWO_INPUT_BUTTON, 3, 0);
                      break;
                }
             }
@@ -625,7 +828,7 @@ static bool ewm_two_poll_event(struct ewm_two_t *two, SDL_Window *window) { // T
 
          case SDL_TEXTINPUT:
             if (strlen(event.text.text) == 1) {
-               two->key = toupper(event.text.text[0]) | 0x80;
+               ewm_two_input(two, EWM_TWO_INPUT_KEY, 0, toupper(event.text.text[0]) | 0x80);
             }
             break;
       }
@@ -634,7 +837,11 @@ static bool ewm_two_poll_event(struct ewm_two_t *two, SDL_Window *window) { // T
    return true;
 }
 
+// Run until the counter moved by cycles. With an accelerator the cpu
+// runs more cycles than that.
+
 static bool ewm_two_step_cpu(struct ewm_two_t *two, int cycles) {
+   uint64_t end = two->cpu->counter + cycles;
    while (true) {
       int ret = cpu_step(two->cpu);
       if (ret < 0) {
@@ -653,108 +860,750 @@ static bool ewm_two_step_cpu(struct ewm_two_t *two, int cycles) {
          }
          return false;
       }
-      cycles -= ret;
-      if (cycles <= 0) {
+      if (two->cpu->idle) {
+         cpu_idle_forward(two->cpu, two->cpu->counter < end ? end - two->cpu->counter : 0);
+      }
+      if (two->cpu->counter >= end || two->cpu->ahead_stopped) {
          break;
       }
    }
    return true;
 }
 
-static void ewm_two_update_status_bar(struct ewm_two_t *two, double mhz) {
+// Run unthrottled while the disk motor is on, and for a short while
+// after it was turned off, since DOS often turns it back on right away.
+
+static void ewm_two_update_warp(struct ewm_two_t *two) {
+   if (two->dsk->on) {
+      two->warp_until = two->cpu->counter + two->warp_hysteresis;
+   }
+
+   bool warping = two->cpu->counter < two->warp_until;
+   if (warping == two->clk->warp) {
+      return;
+   }
+
+   ewm_clk_set_warp(two->clk, warping, two->cpu->counter);
+
+   uint64_t now = ewm_clk_now();
+   if (warping) {
+      two->warp_start_time = now;
+      two->warp_start_cycles = two->cpu->counter;
+   } else {
+      double emulated = (two->cpu->counter - two->warp_start_cycles) / (two->clk->hz * two->clk->speed);
+      double elapsed = (now - two->warp_start_time) / 1000000000.0;
+      two->warp_saved += emulated - elapsed;
+   }
+}
+
+// The status bar and the paused overlay are collected as quads in
+// two->batch and then drawn with a single call from the main loop.
 
+static void ewm_two_update_status_bar(struct ewm_two_t *two, struct ewm_two_status_t *status) {
    SDL_Rect rect = { .x = 0, .y = (24*8*3), .w = (40*7*3), .h = (9*3) };
-   SDL_SetRenderDrawColor(two->scr->renderer, 39, 39, 39, 0);
-   SDL_RenderFillRect(two->scr->renderer, &rect);
+   SDL_Color background = {39,39,39,255};
+   ewm_chr_batch_add_rect(two->scr->chr, two->batch, &rect, background);
+
+   char skip[25] = "";
+   if (status->skipped != 0) {
+      snprintf(skip, sizeof(skip), "SKIP %" PRIu64, status->skipped);
+   }
 
    char s[41];
-   snprintf(s, 41, "%1.3f MHZ                         [1][2]", mhz);
+   snprintf(s, 41, "%1.3f MHZ %-24s[1][2]", status->mhz, skip);
    //               1234567890123456789012345678901234567890
 
+   SDL_Color red = {255,0,0,255};
+   SDL_Color green = {145,193,75,255};
+
    for (int i = 0; i < 40; i++) {
-      int c = s[i] + 0x80;
-      if (two->scr->chr->textures[c] != NULL) {
-         SDL_Rect dst;
-         dst.x = i * 21;
-         dst.y = 24 * 24 + 3;
-         dst.w = 21;
-         dst.h = 24;
-
-         if (two->dsk->on && ((i == 35 && two->dsk->drive == EWM_DSK_DRIVE1) || (i == 38 && two->dsk->drive == EWM_DSK_DRIVE2))) {
-            SDL_SetTextureColorMod(two->scr->chr->textures[c], 145, 193, 75);
-         } else {
-            SDL_SetTextureColorMod(two->scr->chr->textures[c], 255, 0, 0);
-         }
+      SDL_Rect dst;
+      dst.x = i * 21;
+      dst.y = 24 * 24 + 3;
+      dst.w = 21;
+      dst.h = 24;
+
+      if (status->disk_on && ((i == 35 && status->disk_drive == EWM_DSK_DRIVE1) || (i == 38 && status->disk_drive == EWM_DSK_DRIVE2))) {
+         ewm_chr_batch_add_character(two->scr->chr, two->batch, s[i] + 0x80, &dst, green);
+      } else {
+         ewm_chr_batch_add_character(two->scr->chr, two->batch, s[i] + 0x80, &dst, red);
+      }
+   }
+}
+
+// Check if we can lock to the display refresh rate. Sets fps to the
+// refresh rate if we can.
+
+static bool ewm_two_vsync_available(SDL_Window *window, SDL_Renderer *renderer, double speed, uint32_t *fps) {
+   SDL_RendererInfo info;
+   if (renderer == NULL || SDL_GetRendererInfo(renderer, &info) != 0 || (info.flags & SDL_RENDERER_PRESENTVSYNC) == 0) {
+      fprintf(stderr, "[TWO] No vsync available, pacing with the clock\n");
+      return false;
+   }
+
+   SDL_DisplayMode mode;
+   if (SDL_GetWindowDisplayMode(window, &mode) != 0 || mode.refresh_rate == 0) {
+      fprintf(stderr, "[TWO] Unknown display refresh rate, pacing with the clock\n");
+      return false;
+   }
+
+   double correction = mode.refresh_rate / ((double) EWM_TWO_SPEED / EWM_TWO_CYCLES_PER_FRAME);
+   if (speed != 1.0 || fabs(correction - 1.0) > EWM_TWO_VSYNC_MAX_CORRECTION) {
+      fprintf(stderr, "[TWO] Cannot lock to the %d Hz display, pacing with the clock\n", mode.refresh_rate);
+      return false;
+   }
+
+   fprintf(stderr, "[TWO] Locked to the %d Hz display at %.2f%% speed\n", mode.refresh_rate, correction * 100.0);
+   *fps = mode.refresh_rate;
+   return true;
+}
+
+// Run ahead with the current input, so that what is shown reacts to it
+// sooner than the real machine would. None of these frames are shown
+// except the last one, after which the machine goes back in time with
+// ewm_two_run_ahead_end. Disk access is never run ahead, since the disk
+// contents are not part of the snapshot. The pass stops at the first
+// access to the disk controller or the block device card, which is
+// ignored.
+
+static bool ewm_two_run_ahead_begin(struct ewm_two_t *two, int cycles) {
+   if (two->run_ahead == 0 || two->state != EWM_TWO_STATE_RUNNING || two->dsk->on || !ewm_clk_throttled(two->clk)) {
+      return false;
+   }
+
+   uint64_t start = ewm_clk_now();
+   ewm_two_snapshot_save(two, two->snapshot);
+   uint64_t saved = ewm_clk_now();
 
-         SDL_RenderCopy(two->scr->renderer, two->scr->chr->textures[c], NULL, &dst);
+   two->cpu->ahead = true;
+   two->cpu->ahead_stopped = false;
+   (void) ewm_two_step_cpu(two, cycles * two->run_ahead);
+
+   uint64_t end = ewm_clk_now();
+   two->snapshot_time = saved - start;
+   two->run_ahead_time += end - start;
+
+   return true;
+}
+
+static void ewm_two_run_ahead_end(struct ewm_two_t *two) {
+   uint64_t start = ewm_clk_now();
+   ewm_two_snapshot_restore(two, two->snapshot);
+   uint64_t end = ewm_clk_now();
+   two->snapshot_time += end - start;
+   two->run_ahead_time += end - start;
+}
+
+// Write back all disks before exiting
+
+static void ewm_two_sync(struct ewm_two_t *two) {
+   ewm_dsk_sync(two->dsk);
+   if (two->hdv != NULL) {
+      ewm_hdv_sync(two->hdv);
+   }
+}
+
+// Report how far the library got preparing disks, when that changed
+
+static void ewm_two_report_library(struct ewm_two_t *two) {
+   int prepared;
+   uint64_t prepare_time;
+   ewm_lib_stats(two->lib, &prepared, &prepare_time);
+   if (prepared != two->lib_prepared) {
+      fprintf(stderr, "[TWO] Prepared %d of %d library disks in the background, taking %.3fs\n",
+         prepared, two->lib->count, prepare_time / 1000000000.0);
+      two->lib_prepared = prepared;
+   }
+}
+
+// Run without SDL video. Frames are virtual, each one is the number
+// of cycles the main loop would run per frame at normal speed.
+
+static int ewm_two_run_headless(struct ewm_two_t *two, uint32_t fps, uint64_t cycles, uint64_t frames, char *dump_path) {
+   Uint64 start = SDL_GetPerformanceCounter();
+
+   uint64_t frame = 0;
+   while ((cycles == 0 || two->cpu->counter < cycles) && (frames == 0 || frame < frames)) {
+      int n = EWM_TWO_SPEED / fps;
+      if (cycles != 0 && (cycles - two->cpu->counter) < (uint64_t) n) {
+         n = cycles - two->cpu->counter;
+      }
+      if (!ewm_two_step_cpu(two, n)) {
+         return 1;
       }
+      frame++;
+   }
+
+   double seconds = (double) (SDL_GetPerformanceCounter() - start) / SDL_GetPerformanceFrequency();
+   fprintf(stderr, "[TWO] Ran %" PRIu64 " cycles in %" PRIu64 " frames in %.3fs (%.3f MHz)\n",
+      two->cpu->counter, frame, seconds, seconds > 0 ? (two->cpu->counter / seconds) / 1000000.0 : 0.0);
+   fprintf(stderr, "[TWO] Skipped %" PRIu64 " idle loops, %" PRIu64 " cycles (%.1f%%)\n",
+      two->cpu->idle_hits, two->cpu->idle_cycles, two->cpu->counter ? (100.0 * two->cpu->idle_cycles) / two->cpu->counter : 0.0);
+   fprintf(stderr, "[TWO] Skipped %" PRIu64 " delay loops, %" PRIu64 " cycles (%.1f%%)\n",
+      two->cpu->delay_hits, two->cpu->delay_cycles, two->cpu->counter ? (100.0 * two->cpu->delay_cycles) / two->cpu->counter : 0.0);
+   if (two->dsk->sync_hits != 0) {
+      fprintf(stderr, "[TWO] Skipped %" PRIu64 " sync loops, %" PRIu64 " cycles (%.1f%%)\n",
+         two->dsk->sync_hits, two->dsk->sync_cycles, two->cpu->counter ? (100.0 * two->dsk->sync_cycles) / two->cpu->counter : 0.0);
+   }
+   if (two->dsk->rwts_sectors != 0) {
+      fprintf(stderr, "[TWO] Read or wrote %" PRIu64 " sectors through RWTS\n", two->dsk->rwts_sectors);
    }
+   if (two->warp_saved != 0) {
+      fprintf(stderr, "[TWO] Warping saved %.3fs of disk access\n", two->warp_saved);
+   }
+   if (two->hdv != NULL) {
+      fprintf(stderr, "[TWO] Read %" PRIu64 " and wrote %" PRIu64 " ProDOS blocks\n", two->hdv->blocks_read, two->hdv->blocks_written);
+   }
+   if (two->lib != NULL) {
+      ewm_two_report_library(two);
+   }
+
+   if (dump_path != NULL) {
+      ewm_scr_update(two->scr, 1, fps);
+      if (SDL_SaveBMP(two->scr->surface, dump_path) != 0) {
+         fprintf(stderr, "[TWO] Cannot save screen to %s: %s\n", dump_path, SDL_GetError());
+         return 1;
+      }
+   }
+
+   return 0;
 }
 
-#define EWM_TWO_OPT_HELP   (0)
-#define EWM_TWO_OPT_DRIVE1 (1)
-#define EWM_TWO_OPT_DRIVE2 (2)
-#define EWM_TWO_OPT_COLOR  (3)
-#define EWM_TWO_OPT_FPS    (4)
-#define EWM_TWO_OPT_MEMORY (5)
-#define EWM_TWO_OPT_TRACE  (6)
-#define EWM_TWO_OPT_STRICT (7)
-#define EWM_TWO_OPT_DEBUG  (8)
+#define EWM_TWO_OPT_HELP     (0)
+#define EWM_TWO_OPT_DRIVE1   (1)
+#define EWM_TWO_OPT_DRIVE2   (2)
+#define EWM_TWO_OPT_COLOR    (3)
+#define EWM_TWO_OPT_FPS      (4)
+#define EWM_TWO_OPT_MEMORY   (5)
+#define EWM_TWO_OPT_TRACE    (6)
+#define EWM_TWO_OPT_STRICT   (7)
+#define EWM_TWO_OPT_DEBUG    (8)
+#define EWM_TWO_OPT_HEADLESS (9)
+#define EWM_TWO_OPT_CYCLES   (10)
+#define EWM_TWO_OPT_FRAMES   (11)
+#define EWM_TWO_OPT_DUMP     (12)
+#define EWM_TWO_OPT_SPEED    (13)
+#define EWM_TWO_OPT_WARP     (14)
+#define EWM_TWO_OPT_SKIP     (15)
+#define EWM_TWO_OPT_SLICES   (16)
+#define EWM_TWO_OPT_VSYNC    (17)
+#define EWM_TWO_OPT_AHEAD    (18)
+#define EWM_TWO_OPT_THREAD   (19)
+#define EWM_TWO_OPT_ACCEL    (20)
+#define EWM_TWO_OPT_WRITES   (21)
+#define EWM_TWO_OPT_RWTS     (22)
+#define EWM_TWO_OPT_LIBRARY  (23)
+#define EWM_TWO_OPT_COMPRESS (24)
+#define EWM_TWO_OPT_HDV      (25)
 #if defined(EWM_LUA)
-#define EWM_TWO_OPT_SCRIPT (9)
+#define EWM_TWO_OPT_SCRIPT   (26)
 #endif
 
 static struct option one_options[] = {
-   { "help",    no_argument,       NULL, EWM_TWO_OPT_HELP   },
-   { "drive1",  required_argument, NULL, EWM_TWO_OPT_DRIVE1 },
-   { "drive2",  required_argument, NULL, EWM_TWO_OPT_DRIVE2 },
-   { "color",   no_argument,       NULL, EWM_TWO_OPT_COLOR  },
-   { "fps",     required_argument, NULL, EWM_TWO_OPT_FPS    },
-   { "memory",  required_argument, NULL, EWM_TWO_OPT_MEMORY },
-   { "trace",   optional_argument, NULL, EWM_TWO_OPT_TRACE  },
-   { "strict",  no_argument,       NULL, EWM_TWO_OPT_STRICT },
-   { "debug",   no_argument,       NULL, EWM_TWO_OPT_DEBUG  },
+   { "help",     no_argument,       NULL, EWM_TWO_OPT_HELP     },
+   { "drive1",   required_argument, NULL, EWM_TWO_OPT_DRIVE1   },
+   { "drive2",   required_argument, NULL, EWM_TWO_OPT_DRIVE2   },
+   { "color",    no_argument,       NULL, EWM_TWO_OPT_COLOR    },
+   { "fps",      required_argument, NULL, EWM_TWO_OPT_FPS      },
+   { "memory",   required_argument, NULL, EWM_TWO_OPT_MEMORY   },
+   { "trace",    optional_argument, NULL, EWM_TWO_OPT_TRACE    },
+   { "strict",   no_argument,       NULL, EWM_TWO_OPT_STRICT   },
+   { "debug",    no_argument,       NULL, EWM_TWO_OPT_DEBUG    },
+   { "headless", no_argument,       NULL, EWM_TWO_OPT_HEADLESS },
+   { "cycles",   required_argument, NULL, EWM_TWO_OPT_CYCLES   },
+   { "frames",   required_argument, NULL, EWM_TWO_OPT_FRAMES   },
+   { "dump",     required_argument, NULL, EWM_TWO_OPT_DUMP     },
+   { "speed",    required_argument, NULL, EWM_TWO_OPT_SPEED    },
+   { "warp",     optional_argument, NULL, EWM_TWO_OPT_WARP     },
+   { "skip",     required_argument, NULL, EWM_TWO_OPT_SKIP     },
+   { "slices",   required_argument, NULL, EWM_TWO_OPT_SLICES   },
+   { "vsync",    no_argument,       NULL, EWM_TWO_OPT_VSYNC    },
+   { "ahead",    required_argument, NULL, EWM_TWO_OPT_AHEAD    },
+   { "thread",   no_argument,       NULL, EWM_TWO_OPT_THREAD   },
+   { "accel",    required_argument, NULL, EWM_TWO_OPT_ACCEL    },
+   { "disk-writes", required_argument, NULL, EWM_TWO_OPT_WRITES },
+   { "disk-compress", no_argument,   NULL, EWM_TWO_OPT_COMPRESS },
+   { "rwts",     no_argument,       NULL, EWM_TWO_OPT_RWTS     },
+   { "library",  required_argument, NULL, EWM_TWO_OPT_LIBRARY  },
+   { "hdv",      required_argument, NULL, EWM_TWO_OPT_HDV      },
 #if defined(EWM_LUA)
-   { "script",  required_argument, NULL, EWM_TWO_OPT_SCRIPT },
+   { "script",   required_argument, NULL, EWM_TWO_OPT_SCRIPT   },
 #endif
-   { NULL,      0,                 NULL, 0 }
+   { NULL,       0,                 NULL, 0                    }
 };
 
 static void usage() {
    fprintf(stderr, "Usage: ewm two [options]\n");
-   fprintf(stderr, "  --drive1 <path>   load .dsk, .po or nib at path in slot 6 drive 1\n");
-   fprintf(stderr, "  --drive2 <path>   load .dsk, .po or nib at path in slot 6 drive 2\n");
+   fprintf(stderr, "  --drive1 <path>   load .dsk, .po, .nib or .woz at path in slot 6 drive 1\n");
+   fprintf(stderr, "  --drive2 <path>   load .dsk, .po, .nib or .woz at path in slot 6 drive 2\n");
+   fprintf(stderr, "                    images can be gzip compressed, like .dsk.gz, and a\n");
+   fprintf(stderr, "                    directory with NAME.A, .B, .T... files is a DOS 3.3\n");
+   fprintf(stderr, "                    disk with those files\n");
+   fprintf(stderr, "  --hdv <path>      load a .po or .hdv image of up to 32 MB in a ProDOS\n");
+   fprintf(stderr, "                    block device card in slot 7, which boots first\n");
+   fprintf(stderr, "  --library <path>  add a disk or a directory of disks to the library,\n");
+   fprintf(stderr, "                    which is prepared in the background. Cmd-D puts\n");
+   fprintf(stderr, "                    the next disk in drive 1, Cmd-Shift-D in drive 2\n");
+   fprintf(stderr, "  --disk-writes <m> how disk changes are saved: replace the image\n");
+   fprintf(stderr, "                    file (default), session to discard them on\n");
+   fprintf(stderr, "                    exit or persistent to write them in place\n");
+   fprintf(stderr, "  --disk-compress   write changes to .gz images back compressed, they\n");
+   fprintf(stderr, "                    are discarded on exit otherwise\n");
+   fprintf(stderr, "  --rwts            read and write DOS 3.3 sectors directly, without\n");
+   fprintf(stderr, "                    going through the Disk II\n");
    fprintf(stderr, "  --color           enable color\n");
-   fprintf(stderr, "  --fps <fps>       set fps for display (default: 30)\n");
+   fprintf(stderr, "  --fps <fps>       set fps for display (default: 40)\n");
+   fprintf(stderr, "  --vsync           run one video frame of 17030 cycles per display\n");
+   fprintf(stderr, "                    refresh, if the display runs at about 60 Hz\n");
+   fprintf(stderr, "  --speed <speed>   speed multiplier or unlimited (default: 1)\n");
+   fprintf(stderr, "  --accel <n>       run the cpu n times faster like an accelerator\n");
+   fprintf(stderr, "                    card, disk and speaker keep normal timing\n");
+   fprintf(stderr, "  --warp[=<ms>]     run unthrottled while the disk motor is on and\n");
+   fprintf(stderr, "                    for ms emulated milliseconds after (default: 250)\n");
+   fprintf(stderr, "  --skip <frames>   skip at most this many frames in a row when the\n");
+   fprintf(stderr, "                    host cannot keep up, 0 to never skip (default: 4)\n");
+   fprintf(stderr, "  --slices <n>      run the cpu in n slices per frame and handle\n");
+   fprintf(stderr, "                    input between them (default: 4)\n");
+   fprintf(stderr, "  --ahead <frames>  show what happens this many frames ahead, to\n");
+   fprintf(stderr, "                    make input feel faster (default: 0, max: 4)\n");
+   fprintf(stderr, "  --thread          run the machine on its own thread, frames are\n");
+   fprintf(stderr, "                    dropped instead of skipped and --vsync only\n");
+   fprintf(stderr, "                    affects presenting\n");
    fprintf(stderr, "  --memory <region> add memory region (ram|rom:address:path)\n");
    fprintf(stderr, "  --trace <file>    trace cpu to file\n");
    fprintf(stderr, "  --strict          run emulator in strict mode\n");
    fprintf(stderr, "  --debug           print debug info\n");
+   fprintf(stderr, "  --headless        run without a window, as fast as possible\n");
+   fprintf(stderr, "  --cycles <n>      headless: stop after n cycles\n");
+   fprintf(stderr, "  --frames <n>      headless: stop after n frames\n");
+   fprintf(stderr, "  --dump <file>     headless: save the screen as a BMP when done\n");
 #if defined(EWM_LUA)
    fprintf(stderr, "  --script <script> load Lua script into the emulator\n");
 #endif
 }
 
 static void ewm_two_render_status(struct ewm_two_t *two, char *msg) {
-   SDL_SetRenderDrawColor(two->scr->renderer, 0, 0, 0, 224);
-   SDL_RenderFillRect(two->scr->renderer, NULL);
+   // The logical size is 3x larger when the status bar is visible
+   int scale = two->status_bar_visible ? 3 : 1;
+
+   SDL_Rect rect = { .x = 0, .y = 0, .w = 40*7*scale, .h = (24*8 + (two->status_bar_visible ? 9 : 0)) * scale };
+   SDL_Color shade = {0,0,0,224};
+   ewm_chr_batch_add_rect(two->scr->chr, two->batch, &rect, shade);
+
+   char *lines[5] = {
+      "********************",
+      "*                  *",
+      "* -+-  PAUSED  -+- *",
+      "*                  *",
+      "********************"
+   };
+
+   SDL_Color red = {255,0,0,255};
+   for (int i = 0; i < 5; i++) {
+      ewm_chr_batch_add_string(two->scr->chr, two->batch, 10*7*scale, (8+i)*8*scale, scale, lines[i], red);
+   }
+}
 
-   ewm_tty_reset(two->tty);
+// Run the cpu for the cycles that are due. When locked to vsync that
+// is exactly one video frame.
 
-   ewm_tty_set_line(two->tty,  8, "          ********************          ");
-   ewm_tty_set_line(two->tty,  9, "          *                  *          ");
-   ewm_tty_set_line(two->tty, 10, "          * -+-  PAUSED  -+- *          ");
-   ewm_tty_set_line(two->tty, 11, "          *                  *          ");
-   ewm_tty_set_line(two->tty, 12, "          ********************          ");
+static bool ewm_two_run_slice(struct ewm_two_t *two, bool locked) {
+   uint64_t cycles = locked ? EWM_TWO_CYCLES_PER_FRAME : ewm_clk_cycles_due(two->clk, two->cpu->counter);
+   uint64_t start = ewm_clk_now();
+   if (cycles != 0 && !ewm_two_step_cpu(two, (int) cycles)) {
+      return false;
+   }
+   two->emulation_time += ewm_clk_now() - start;
+   if (two->warp) {
+      ewm_two_update_warp(two);
+   }
+   return true;
+}
 
-   ewm_tty_refresh(two->tty, 0, 0);
+// Render the screen into its surface, running ahead if enabled
 
-   SDL_Texture *texture = SDL_CreateTextureFromSurface(two->tty->renderer, two->tty->surface);
-   if (texture != NULL) {
-      SDL_SetRenderDrawBlendMode(two->scr->renderer, SDL_BLENDMODE_BLEND);
-      SDL_RenderCopy(two->tty->renderer, texture, NULL, NULL);
-      SDL_DestroyTexture(texture);
+static void ewm_two_render_screen(struct ewm_two_t *two, int cycles) {
+   bool ahead = ewm_two_run_ahead_begin(two, cycles);
+   ewm_scr_update(two->scr, two->phase, two->fps);
+   if (ahead) {
+      ewm_two_run_ahead_end(two);
    }
+   two->screen_dirty = false;
+}
+
+static void ewm_two_get_status(struct ewm_two_t *two, struct ewm_two_status_t *status) {
+   status->mhz = two->mhz;
+   status->skipped = two->skipped;
+   status->paused = two->state == EWM_TWO_STATE_PAUSED;
+   status->disk_on = two->dsk->on;
+   status->disk_drive = two->dsk->drive;
+}
+
+// Draw a rendered screen with the status bar and overlays and present
+// it. This only touches the UI side of the machine.
+
+static void ewm_two_draw(struct ewm_two_t *two, SDL_Window *window, struct ewm_sdl_display_t *display, SDL_Surface *surface, struct ewm_two_status_t *status) {
+   SDL_Rect dst = { .x = 0, .y = 0, .w = 40*7*3, .h = 24*8*3 };
+   ewm_sdl_display_draw(display, surface, two->status_bar_visible ? &dst : NULL);
+
+   ewm_chr_batch_reset(two->batch);
+
+   if (two->status_bar_visible) {
+      ewm_two_update_status_bar(two, status);
+   }
+
+   if (status->paused) {
+      ewm_two_render_status(two, "PAUSED");
+   }
+
+   if (display->renderer != NULL) {
+      ewm_chr_batch_render(two->scr->chr, two->batch);
+   } else if (two->batch->quads != 0) {
+      // Only the part of the window that the overlays cover is
+      // updated, and the screen below them is drawn again next frame.
+      int scale = SDL_max(1, display->scale / (two->status_bar_visible ? 3 : 1));
+      SDL_Rect bounds;
+      if (ewm_chr_batch_blit(two->scr->chr, two->batch, SDL_GetWindowSurface(window), scale, &bounds) == 0) {
+         ewm_sdl_display_overlay(display, &bounds);
+      }
+   }
+
+   ewm_sdl_display_present(display);
+
+   // Frame times are measured from present to present
+   uint64_t now = ewm_clk_now();
+   if (two->frame_last != 0) {
+      double t = (now - two->frame_last) / 1000000.0;
+      two->frame_count++;
+      two->frame_sum += t;
+      two->frame_sum_squares += t * t;
+   }
+   two->frame_last = now;
+}
+
+// Once per second, on the machine side. Calculates the effective speed
+// over the past second of wall time. Cycles per microsecond is MHz.
+
+static void ewm_two_update_stats(struct ewm_two_t *two) {
+   uint64_t now = ewm_clk_now();
+   two->mhz = (double) (two->cpu->counter - two->mhz_cycles) / ((now - two->mhz_time) / 1000.0);
+   two->mhz_cycles = two->cpu->counter;
+   two->mhz_time = now;
+
+   // Write back disks that changed, but not while the motor runs
+   if (!two->dsk->on) {
+      ewm_dsk_flush(two->dsk);
+   }
+   ewm_dsk_reclaim(two->dsk, two->cpu->counter);
+
+   if (two->hdv != NULL) {
+      ewm_hdv_flush(two->hdv);
+   }
+
+   if (two->debug && two->lib != NULL) {
+      ewm_two_report_library(two);
+   }
+
+   two->skipped = two->frames_skipped - two->skipped_total;
+   two->skipped_total = two->frames_skipped;
+   if (two->debug && two->skipped != 0) {
+      fprintf(stderr, "[TWO] Skipped %" PRIu64 " frames, rendering takes %.3fms\n",
+         two->skipped, two->render_time / 1000000.0);
+   }
+
+   if (two->debug && two->run_ahead != 0 && two->emulation_time != 0) {
+      fprintf(stderr, "[TWO] Running %d frames ahead costs %.2fx, snapshots take %.1fus\n", two->run_ahead,
+         (double) (two->emulation_time + two->run_ahead_time) / two->emulation_time, two->snapshot_time / 1000.0);
+   }
+   two->emulation_time = 0;
+   two->run_ahead_time = 0;
+
+   if (two->debug && two->warp_saved != two->warp_reported) {
+      fprintf(stderr, "[TWO] Warping saved %.3fs of disk access\n", two->warp_saved);
+      two->warp_reported = two->warp_saved;
+   }
+
+   if (two->debug && two->key_latency_count != 0) {
+      fprintf(stderr, "[TWO] Key latency %.3fms average, %.3fms max over %" PRIu64 " keys\n",
+         (two->key_latency_total / two->key_latency_count) / 1000000.0, two->key_latency_max / 1000000.0,
+         two->key_latency_count);
+      two->key_latency_count = 0;
+      two->key_latency_total = 0;
+      two->key_latency_max = 0;
+   }
+}
+
+// Once per second, on the UI side
+
+static void ewm_two_update_frame_stats(struct ewm_two_t *two) {
+   if (two->debug && two->frame_count > 1) {
+      double mean = two->frame_sum / two->frame_count;
+      double variance = (two->frame_sum_squares - two->frame_count * mean * mean) / (two->frame_count - 1);
+      fprintf(stderr, "[TWO] Frame time %.3fms, stddev %.3fms over %" PRIu64 " frames\n",
+         mean, sqrt(variance > 0.0 ? variance : 0.0), two->frame_count);
+   }
+   two->frame_count = 0;
+   two->frame_sum = two->frame_sum_squares = 0.0;
+}
+
+// Run on a single thread. Events are handled between cpu slices and
+// frames are rendered and presented on the same thread.
+
+static int ewm_two_run(struct ewm_two_t *two, SDL_Window *window, struct ewm_sdl_display_t *display, bool vsync) {
+   while (true) {
+      // When throttled, sleep until the next slice is due. When paused
+      // until the next frame. Otherwise run flat out and only poll for
+      // events. When locked to vsync, presenting the frame waits.
+
+      bool throttled = ewm_clk_throttled(two->clk);
+      bool locked = vsync && throttled && two->state == EWM_TWO_STATE_RUNNING && ewm_sdl_window_visible(window);
+
+      uint64_t deadline = 0;
+      if (two->state == EWM_TWO_STATE_PAUSED) {
+         deadline = two->clk->frame_deadline;
+      } else if (throttled && !locked) {
+         deadline = two->clk->slice_deadline;
+      }
+      if (!ewm_two_poll_event(two, window, deadline)) {
+         break;
+      }
+
+      if (two->window_dirty) {
+         two->window_dirty = false;
+         two->screen_dirty = true;
+      }
+
+      bool frame_due = locked || ewm_clk_frame_due(two->clk);
+      bool slice_due = !locked && ewm_clk_slice_due(two->clk);
+
+      if (two->state == EWM_TWO_STATE_RUNNING && (slice_due || locked || !throttled)) {
+         ewm_two_sample_joystick(two);
+         if (!ewm_two_run_slice(two, locked)) {
+            break;
+         }
+      }
+
+      // Keep the clock in step, so that it takes over smoothly when
+      // we are no longer locked.
+      if (locked) {
+         ewm_clk_reset(two->clk, two->cpu->counter);
+      }
+
+      if (frame_due) {
+         ewm_clk_next_frame(two->clk);
+      }
+
+      if (slice_due) {
+         ewm_clk_next_slice(two->clk);
+      }
+
+      if (frame_due) {
+         // While running the screen is drawn every frame. When paused
+         // only when something changed, like the window being exposed,
+         // and once per second for the status bar. Nothing is drawn
+         // while warping or while the window is hidden or minimized.
+
+         if (two->state == EWM_TWO_STATE_RUNNING || two->phase == 0) {
+            two->screen_dirty = true;
+         }
+
+         // If rendering this frame would make us miss the next one, skip
+         // it so that the cpu stays on schedule. But never skip so many
+         // frames in a row that the screen looks frozen.
+
+         bool render = two->screen_dirty && !two->clk->warp && ewm_sdl_window_visible(window);
+         bool late = ewm_clk_now() + two->render_time > two->clk->frame_deadline;
+
+         if (render && late && throttled && !locked && two->frame_skip < two->frame_skip_max) {
+            two->frame_skip++;
+            two->frames_skipped++;
+         } else if (render) {
+            uint64_t render_start = ewm_clk_now();
+            two->frame_skip = 0;
+
+            ewm_two_render_screen(two, locked ? EWM_TWO_CYCLES_PER_FRAME : EWM_TWO_SPEED / two->fps);
+
+            struct ewm_two_status_t status;
+            ewm_two_get_status(two, &status);
+            ewm_two_draw(two, window, display, two->scr->surface, &status);
+
+            two->render_time = (two->render_time * 7 + (ewm_clk_now() - render_start)) / 8;
+         }
+
+         two->phase += 1;
+         if (two->phase == two->fps) {
+            two->phase = 0;
+            ewm_two_update_stats(two);
+            ewm_two_update_frame_stats(two);
+         }
+      }
+   }
+
+   return 0;
+}
+
+// Hand the current screen to the UI. If the UI still holds all frames
+// it is behind and this one is dropped.
+
+static void ewm_two_send_frame(struct ewm_two_t *two) {
+   struct ewm_two_frame_t *frame;
+   if (!ewm_que_pop(two->free_frames, &frame)) {
+      two->frames_skipped++;
+      return;
+   }
+
+   ewm_two_render_screen(two, EWM_TWO_SPEED / two->fps);
+   memcpy(frame->surface->pixels, two->scr->pixels, 4 * EWM_SCR_WIDTH * EWM_SCR_HEIGHT);
+   ewm_two_get_status(two, &frame->status);
+   ewm_que_push(two->frames, &frame);
+
+   SDL_Event event;
+   memset(&event, 0x00, sizeof(event));
+   event.type = two->frame_event;
+   SDL_PushEvent(&event);
+}
+
+// The machine thread. It owns the cpu and all devices and only talks
+// to the UI through the input and frame queues. The screen is rendered
+// into pixels here, the UI only has to draw and present them.
+
+static int ewm_two_machine_thread(void *data) {
+   struct ewm_two_t *two = (struct ewm_two_t*) data;
+
+   while (true) {
+      struct ewm_two_input_t input;
+      while (ewm_que_pop(two->inputs, &input)) {
+         ewm_two_apply_input(two, &input);
+      }
+      if (two->quit) {
+         break;
+      }
+
+      bool throttled = ewm_clk_throttled(two->clk);
+      bool frame_due = ewm_clk_frame_due(two->clk);
+      bool slice_due = ewm_clk_slice_due(two->clk);
+
+      if (two->state == EWM_TWO_STATE_RUNNING && (slice_due || !throttled)) {
+         if (!ewm_two_run_slice(two, false)) {
+            SDL_Event event;
+            memset(&event, 0x00, sizeof(event));
+            event.type = SDL_QUIT;
+            SDL_PushEvent(&event);
+            break;
+         }
+      }
+
+      if (frame_due) {
+         ewm_clk_next_frame(two->clk);
+      }
+
+      if (slice_due) {
+         ewm_clk_next_slice(two->clk);
+      }
+
+      if (frame_due) {
+         if (two->state == EWM_TWO_STATE_RUNNING || two->phase == 0) {
+            two->screen_dirty = true;
+         }
+
+         if (two->screen_dirty && !two->clk->warp) {
+            ewm_two_send_frame(two);
+         }
+
+         two->phase += 1;
+         if (two->phase == two->fps) {
+            two->phase = 0;
+            ewm_two_update_stats(two);
+         }
+      }
+
+      if (two->state == EWM_TWO_STATE_PAUSED) {
+         ewm_clk_sleep_until(two->clk->frame_deadline);
+      } else if (throttled) {
+         ewm_clk_sleep_until(two->clk->slice_deadline);
+      }
+   }
+
+   return 0;
+}
+
+// Run the machine on its own thread, so that slow presents or a busy
+// event queue never delay the emulation. This thread handles events,
+// samples the joystick and shows the newest frame it was handed.
+
+static int ewm_two_run_threaded(struct ewm_two_t *two, SDL_Window *window, struct ewm_sdl_display_t *display) {
+   two->inputs = ewm_que_create(EWM_TWO_INPUT_QUEUE_SIZE, sizeof(struct ewm_two_input_t));
+   two->frames = ewm_que_create(EWM_TWO_FRAME_COUNT, sizeof(struct ewm_two_frame_t*));
+   two->free_frames = ewm_que_create(EWM_TWO_FRAME_COUNT, sizeof(struct ewm_two_frame_t*));
+   if (two->inputs == NULL || two->frames == NULL || two->free_frames == NULL) {
+      fprintf(stderr, "[TWO] Cannot create queues\n");
+      return 1;
+   }
+
+   for (int i = 0; i < EWM_TWO_FRAME_COUNT; i++) {
+      struct ewm_two_frame_t *frame = &two->frame_pool[i];
+      frame->surface = SDL_CreateRGBSurfaceWithFormat(0, EWM_SCR_WIDTH, EWM_SCR_HEIGHT, 32, two->scr->surface->format->format);
+      if (frame->surface == NULL) {
+         fprintf(stderr, "[TWO] Cannot create frame: %s\n", SDL_GetError());
+         return 1;
+      }
+      ewm_que_push(two->free_frames, &frame);
+   }
+
+   two->frame_event = SDL_RegisterEvents(1);
+   if (two->frame_event == (uint32_t) -1) {
+      fprintf(stderr, "[TWO] Cannot register frame event\n");
+      return 1;
+   }
+
+   SDL_Thread *thread = SDL_CreateThread(ewm_two_machine_thread, "machine", two);
+   if (thread == NULL) {
+      fprintf(stderr, "[TWO] Cannot create machine thread: %s\n", SDL_GetError());
+      return 1;
+   }
+
+   struct ewm_two_frame_t *shown = NULL;
+   uint64_t stats_time = ewm_clk_now();
+
+   while (true) {
+      // Sleeps until there is input or the machine pushed a frame
+      if (!ewm_two_poll_event(two, window, ewm_clk_now() + 100000000)) {
+         break;
+      }
+
+      ewm_two_sample_joystick(two);
+
+      // Only the newest frame is shown, older ones go back right away
+      struct ewm_two_frame_t *frame, *newest = NULL;
+      while (ewm_que_pop(two->frames, &frame)) {
+         if (newest != NULL) {
+            ewm_que_push(two->free_frames, &newest);
+         }
+         newest = frame;
+      }
+      if (newest != NULL) {
+         if (shown != NULL) {
+            ewm_que_push(two->free_frames, &shown);
+         }
+         shown = newest;
+      }
+
+      if (shown != NULL && (newest != NULL || two->window_dirty) && ewm_sdl_window_visible(window)) {
+         two->window_dirty = false;
+         ewm_two_draw(two, window, display, shown->surface, &shown->status);
+      }
+
+      uint64_t now = ewm_clk_now();
+      if (now - stats_time >= 1000000000) {
+         ewm_two_update_frame_stats(two);
+         stats_time = now;
+      }
+   }
+
+   ewm_two_input(two, EWM_TWO_INPUT_QUIT, 0, 0);
+   SDL_WaitThread(thread, NULL);
+
+   return 0;
 }
 
 int ewm_two_main(int argc, char **argv) {
@@ -768,6 +1617,24 @@ int ewm_two_main(int argc, char **argv) {
    char *trace_path = NULL;
    bool strict = false;
    bool debug = false;
+   bool headless = false;
+   uint64_t cycles = 0;
+   uint64_t frames = 0;
+   char *dump_path = NULL;
+   double speed = 1.0;
+   int warp = -1;
+   int skip = EWM_TWO_FRAME_SKIP_DEFAULT;
+   int slices = EWM_TWO_SLICES_DEFAULT;
+   bool vsync = false;
+   int ahead = 0;
+   bool thread = false;
+   int accel = 1;
+   int writes = EWM_DSK_WRITES_REPLACE;
+   bool compress = false;
+   char *hdv = NULL;
+   bool rwts = false;
+   char **library = NULL;
+   int library_count = 0;
 #if defined(EWM_LUA)
    char *script_path = NULL;
 #endif
@@ -809,6 +1676,86 @@ int ewm_two_main(int argc, char **argv) {
          case EWM_TWO_OPT_DEBUG:
             debug = true;
             break;
+         case EWM_TWO_OPT_HEADLESS:
+            headless = true;
+            break;
+         case EWM_TWO_OPT_CYCLES:
+            cycles = strtoull(optarg, NULL, 10);
+            break;
+         case EWM_TWO_OPT_FRAMES:
+            frames = strtoull(optarg, NULL, 10);
+            break;
+         case EWM_TWO_OPT_DUMP:
+            dump_path = optarg;
+            break;
+         case EWM_TWO_OPT_SPEED:
+            if (ewm_clk_parse_speed(optarg, &speed) != 0) {
+               fprintf(stderr, "Invalid --speed specified\n");
+               exit(1);
+            }
+            break;
+         case EWM_TWO_OPT_WARP:
+            warp = optarg ? atoi(optarg) : EWM_TWO_WARP_HYSTERESIS_DEFAULT;
+            break;
+         case EWM_TWO_OPT_SKIP:
+            skip = atoi(optarg);
+            if (skip < 0) {
+               fprintf(stderr, "Invalid --skip specified\n");
+               exit(1);
+            }
+            break;
+         case EWM_TWO_OPT_AHEAD:
+            ahead = atoi(optarg);
+            if (ahead < 0 || ahead > EWM_TWO_RUN_AHEAD_MAX) {
+               fprintf(stderr, "Invalid --ahead specified\n");
+               exit(1);
+            }
+            break;
+         case EWM_TWO_OPT_VSYNC:
+            vsync = true;
+            break;
+         case EWM_TWO_OPT_THREAD:
+            thread = true;
+            break;
+         case EWM_TWO_OPT_WRITES:
+            if (strcmp(optarg, "replace") == 0) {
+               writes = EWM_DSK_WRITES_REPLACE;
+            } else if (strcmp(optarg, "session") == 0) {
+               writes = EWM_DSK_WRITES_SESSION;
+            } else if (strcmp(optarg, "persistent") == 0) {
+               writes = EWM_DSK_WRITES_PERSISTENT;
+            } else {
+               fprintf(stderr, "Invalid --disk-writes specified\n");
+               exit(1);
+            }
+            break;
+         case EWM_TWO_OPT_HDV:
+            hdv = optarg;
+            break;
+         case EWM_TWO_OPT_COMPRESS:
+            compress = true;
+            break;
+         case EWM_TWO_OPT_RWTS:
+            rwts = true;
+            break;
+         case EWM_TWO_OPT_LIBRARY:
+            library = realloc(library, (library_count + 1) * sizeof(char*));
+            library[library_count++] = optarg;
+            break;
+         case EWM_TWO_OPT_ACCEL:
+            accel = atoi(optarg);
+            if (accel < 1 || accel > EWM_TWO_ACCEL_MAX) {
+               fprintf(stderr, "Invalid --accel specified\n");
+               exit(1);
+            }
+            break;
+         case EWM_TWO_OPT_SLICES:
+            slices = atoi(optarg);
+            if (slices < 1) {
+               fprintf(stderr, "Invalid --slices specified\n");
+               exit(1);
+            }
+            break;
 #if defined(EWM_LUA)
          case EWM_TWO_OPT_SCRIPT:
             script_path = optarg;
@@ -821,70 +1768,80 @@ int ewm_two_main(int argc, char **argv) {
       }
    }
 
-   // Initialize SDL
-
-   if (SDL_Init(SDL_INIT_VIDEO | SDL_INIT_TIMER | SDL_INIT_EVENTS | SDL_INIT_GAMECONTROLLER) < 0) {
-      fprintf(stderr, "Failed to initialize SDL: %s\n", SDL_GetError());
-      exit(1);
-   }
+   // Initialize SDL, unless we run headless. Without a renderer the
+   // screen only renders into its pixels when it is dumped.
 
-   SDL_Window *window = SDL_CreateWindow("EWM v0.1 / Apple ][+", 400, 60, 280*3, 192*3, SDL_WINDOW_SHOWN);
-   if (window == NULL) {
-      fprintf(stderr, "Failed create window: %s\n", SDL_GetError());
-      exit(1);
-   }
+   SDL_Window *window = NULL;
+   struct ewm_sdl_display_t *display = NULL;
+   SDL_Renderer *renderer = NULL;
+   SDL_GameController *controller = NULL;
+   SDL_Joystick *joystick = NULL;
 
-   SDL_Renderer *renderer = SDL_CreateRenderer(window, -1, SDL_RENDERER_ACCELERATED);
-   if (renderer == NULL) {
-      fprintf(stderr, "Failed to create renderer: %s\n", SDL_GetError());
-      exit(1);
-   }
+   if (!headless) {
+      if (SDL_Init(SDL_INIT_VIDEO | SDL_INIT_TIMER | SDL_INIT_EVENTS | SDL_INIT_GAMECONTROLLER) < 0) {
+         fprintf(stderr, "Failed to initialize SDL: %s\n", SDL_GetError());
+         exit(1);
+      }
 
-   SDL_RenderSetLogicalSize(renderer, 280, 192);
+      window = SDL_CreateWindow("EWM v0.1 / Apple ][+", 400, 60, 280*3, 192*3, SDL_WINDOW_SHOWN);
+      if (window == NULL) {
+         fprintf(stderr, "Failed create window: %s\n", SDL_GetError());
+         exit(1);
+      }
 
-   // Print what renderer we got
+      if (vsync) {
+         SDL_SetHint(SDL_HINT_RENDER_VSYNC, "1");
+      }
 
-   if (debug) {
-      SDL_RendererInfo info;
-      if (SDL_GetRendererInfo(renderer, &info) != 0) {
-         fprintf(stderr, "Failed to get renderer info: %s\n", SDL_GetError());
+      display = ewm_sdl_display_create(window, 280, 192);
+      if (display == NULL) {
+         fprintf(stderr, "Failed to create display: %s\n", SDL_GetError());
          exit(1);
       }
-      char flags[1024] = { 0 };
-      if (info.flags & SDL_RENDERER_SOFTWARE) {
-         strncat(flags, "SOFTWARE", sizeof(flags) - strlen(flags) - 1);
-      }
-      if (info.flags & SDL_RENDERER_ACCELERATED) {
-         if (flags[0] != 0x00) {
-            strncat(flags, "|", sizeof(flags) - strlen(flags) - 1);
+
+      renderer = display->renderer;
+
+      // Print what renderer we got
+
+      if (debug && renderer != NULL) {
+         SDL_RendererInfo info;
+         if (SDL_GetRendererInfo(renderer, &info) != 0) {
+            fprintf(stderr, "Failed to get renderer info: %s\n", SDL_GetError());
+            exit(1);
          }
-         strncat(flags, "ACCELERATED", sizeof(flags) - strlen(flags) - 1);
-      }
-      if (info.flags & SDL_RENDERER_PRESENTVSYNC) {
-         if (flags[0] != 0x00) {
-            strncat(flags, "|", sizeof(flags) - strlen(flags) - 1);
+         char flags[1024] = { 0 };
+         if (info.flags & SDL_RENDERER_SOFTWARE) {
+            strncat(flags, "SOFTWARE", sizeof(flags) - strlen(flags) - 1);
          }
-         strncat(flags, "PRESENTVSYNC", sizeof(flags) - strlen(flags) - 1);
-      }
-      if (info.flags & SDL_RENDERER_TARGETTEXTURE) {
-         if (flags[0] != 0x00) {
-            strncat(flags, "|", sizeof(flags) - strlen(flags) - 1);
+         if (info.flags & SDL_RENDERER_ACCELERATED) {
+            if (flags[0] != 0x00) {
+               strncat(flags, "|", sizeof(flags) - strlen(flags) - 1);
+            }
+            strncat(flags, "ACCELERATED", sizeof(flags) - strlen(flags) - 1);
+         }
+         if (info.flags & SDL_RENDERER_PRESENTVSYNC) {
+            if (flags[0] != 0x00) {
+               strncat(flags, "|", sizeof(flags) - strlen(flags) - 1);
+            }
+            strncat(flags, "PRESENTVSYNC", sizeof(flags) - strlen(flags) - 1);
+         }
+         if (info.flags & SDL_RENDERER_TARGETTEXTURE) {
+            if (flags[0] != 0x00) {
+               strncat(flags, "|", sizeof(flags) - strlen(flags) - 1);
+            }
+            strncat(flags, "TARGETTEXTURE", sizeof(flags) - strlen(flags) - 1);
          }
-         strncat(flags, "TARGETTEXTURE", sizeof(flags) - strlen(flags) - 1);
+         fprintf(stderr, "[TWO] Renderer name=%s flags=%s max_texture_size=(%d,%d)\n",
+                 info.name, flags, info.max_texture_width, info.max_texture_height);
       }
-      fprintf(stderr, "[TWO] Renderer name=%s flags=%s max_texture_size=(%d,%d)\n",
-              info.name, flags, info.max_texture_width, info.max_texture_height);
-   }
-
-   // If we have a joystick, open it
 
-   SDL_GameController *controller = NULL;
-   SDL_Joystick *joystick = NULL;
+      // If we have a joystick, open it
 
-   if (SDL_NumJoysticks() != 0) {
-      controller = SDL_GameControllerOpen(0);
-      SDL_GameControllerEventState(SDL_ENABLE);
-      joystick = SDL_GameControllerGetJoystick(controller);
+      if (SDL_NumJoysticks() != 0) {
+         controller = SDL_GameControllerOpen(0);
+         SDL_GameControllerEventState(SDL_ENABLE);
+         joystick = SDL_GameControllerGetJoystick(controller);
+      }
    }
 
    // Create and configure the Apple II
@@ -896,6 +1853,34 @@ int ewm_two_main(int argc, char **argv) {
       ewm_scr_set_color_scheme(two->scr, EWM_SCR_COLOR_SCHEME_COLOR);
    }
 
+   ewm_dsk_set_writes(two->dsk, writes);
+   ewm_dsk_set_compress(two->dsk, compress);
+   ewm_dsk_set_rwts_trap(two->dsk, two->cpu, rwts);
+
+   if (hdv != NULL) {
+      two->hdv = ewm_hdv_create(two->cpu, EWM_HDV_SLOT_DEFAULT);
+      if (two->hdv == NULL || ewm_hdv_set_image_file(two->hdv, hdv) != 0) {
+         fprintf(stderr, "[A2P] Cannot load ProDOS block device with %s\n", hdv);
+         exit(1);
+      }
+   }
+
+   // The library is prepared while the machine runs
+
+   if (library != NULL) {
+      two->lib = ewm_lib_create(writes, compress);
+      for (int i = 0; i < library_count; i++) {
+         if (ewm_lib_add(two->lib, library[i]) != 0) {
+            fprintf(stderr, "[A2P] Cannot add %s to the library\n", library[i]);
+            exit(1);
+         }
+      }
+      if (ewm_lib_start(two->lib) != 0) {
+         exit(1);
+      }
+      free(library);
+   }
+
    if (drive1 != NULL) {
       if (ewm_two_load_disk(two, EWM_DSK_DRIVE1, drive1) != 0) {
          fprintf(stderr, "[A2P] Cannot load Drive 1 with %s\n", drive1);
@@ -920,9 +1905,16 @@ int ewm_two_main(int argc, char **argv) {
 
    cpu_strict(two->cpu, strict);
    cpu_trace(two->cpu, trace_path);
+   cpu_accelerate(two->cpu, accel);
 
 #if defined(EWM_LUA)
-   // Setup a Lua environment if scripts were specified
+   // Setup a Lua environment if scripts were specified. Scripts call
+   // into the machine from event handlers, so they need a single thread.
+
+   if (script_path != NULL && thread) {
+      fprintf(stderr, "Cannot use --script with --thread\n");
+      exit(1);
+   }
 
    if (script_path != NULL) {
       struct ewm_lua_t *lua = ewm_lua_create();
@@ -945,78 +1937,63 @@ int ewm_two_main(int argc, char **argv) {
 
    cpu_reset(two->cpu);
 
+   if (headless) {
+      int result = ewm_two_run_headless(two, fps, cycles, frames, dump_path);
+      ewm_two_sync(two);
+      return result;
+   }
+
    //
 
    SDL_StartTextInput();
 
-   uint32_t ticks = SDL_GetTicks();
-   uint32_t phase = 1;
-
-   uint64_t counter = two->cpu->counter;
-   double mhz = 1.0;
+   // With vsync every display refresh runs exactly one Apple II video
+   // frame, so scrolling is smooth and nothing tears. This changes the
+   // speed slightly, which is fine as long as the display runs at about
+   // the same rate as the Apple II. Turbo, warp and pause still use the
+   // clock.
 
-   while (true) {
-      if (!ewm_two_poll_event(two, window)) {
-         break;
-      }
-
-      if ((SDL_GetTicks() - ticks) >= (1000 / fps)) {
-
-         if (two->state == EWM_TWO_STATE_RUNNING) {
-            if (!ewm_two_step_cpu(two, EWM_TWO_SPEED / fps)) {
-               break;
-            }
-         }
-
-         // Update the screen when it is flagged dirty or if we enter
-         // the second half of the frames we draw each second. The
-         // latter because that is when we update flashing text.
-
-         two->screen_dirty = 1;
-         if (two->screen_dirty) {
-            SDL_SetRenderDrawColor(two->scr->renderer, 0, 0, 0, 255);
-            SDL_RenderClear(two->scr->renderer);
-
-            ewm_scr_update(two->scr, phase, fps);
-            two->screen_dirty = false;
+   if (vsync && !thread) {
+      vsync = ewm_two_vsync_available(window, renderer, speed, &fps);
+   }
 
-            if (two->status_bar_visible) {
-               ewm_two_update_status_bar(two, mhz);
-            }
+   two->clk = ewm_clk_create(EWM_TWO_SPEED, fps, speed);
+   ewm_clk_set_slices(two->clk, slices, two->cpu->counter);
 
-            SDL_Texture *texture = SDL_CreateTextureFromSurface(two->scr->renderer, two->scr->surface);
-            if (texture != NULL) {
-               SDL_RenderCopy(two->scr->renderer, texture, NULL, NULL);
-               SDL_DestroyTexture(texture);
-            }
+   if (debug) {
+      fprintf(stderr, "[TWO] Running the cpu in %d slices of %d cycles per frame\n", slices, EWM_TWO_SPEED / (fps * slices));
+   }
 
-            if (two->state == EWM_TWO_STATE_PAUSED) {
-               ewm_two_render_status(two, "PAUSED");
-            }
+   if (warp >= 0 && speed != EWM_CLK_SPEED_UNLIMITED) {
+      two->warp = true;
+      two->warp_hysteresis = ((uint64_t) EWM_TWO_SPEED * warp) / 1000;
+   }
 
-            SDL_RenderPresent(two->scr->renderer);
-         }
+   two->frame_skip_max = skip;
 
-         ticks = SDL_GetTicks();
-         phase += 1;
-         if (phase == fps) {
-            phase = 0;
-
-            // Calculate the number of cycles we have done in the past
-            // second. TODO This will always equal 1023000 - It needs
-            // to be actual clock time based instead. Good for now,
-            // but not ideal.
-            mhz = (two->cpu->counter - counter) / 1000000.0;
-            counter = two->cpu->counter;
-         }
+   if (ahead != 0) {
+      two->snapshot = ewm_two_snapshot_create(two);
+      if (two->snapshot == NULL) {
+         fprintf(stderr, "[TWO] Cannot create snapshot to run ahead\n");
+         exit(1);
       }
+      two->run_ahead = ahead;
    }
 
+   two->fps = fps;
+   two->phase = 1;
+   two->mhz = 1.0;
+   two->mhz_cycles = two->cpu->counter;
+   two->mhz_time = ewm_clk_now();
+
+   int result = thread ? ewm_two_run_threaded(two, window, display) : ewm_two_run(two, window, display, vsync);
+   ewm_two_sync(two);
+
    //
 
-   SDL_DestroyRenderer(renderer);
+   ewm_sdl_display_destroy(display);
    SDL_DestroyWindow(window);
    SDL_Quit();
 
-   return 0;
+   return result;
 }
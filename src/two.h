@@ -28,6 +28,8 @@
 
 #include <SDL2/SDL.h>
 
+#include "dsk.h"
+
 #define EWM_TWO_TYPE_APPLE2     0
 #define EWM_TWO_TYPE_APPLE2PLUS 1
 #define EWM_TWO_TYPE_APPLE2E    2
@@ -49,18 +51,90 @@
 #define EWM_A2P_BUTTON3 2
 #define EWM_A2P_BUTTON4 3 // Actually ony exists on the gs?
 #define EWM_A2P_BUTTON_COUNT 4
+#define EWM_A2P_PADDLE_COUNT 4
 
 #define EWM_TWO_FPS_DEFAULT (40)
 #define EWM_TWO_SPEED (1023000)
+#define EWM_TWO_CYCLES_PER_FRAME (17030) // 262 lines of 65 cycles
+
+#define EWM_TWO_VSYNC_MAX_CORRECTION (0.02) // Largest speed change to lock to the display
+
+#define EWM_TWO_WARP_HYSTERESIS_DEFAULT (250) // Emulated milliseconds
+#define EWM_TWO_FRAME_SKIP_DEFAULT (4)        // Consecutive frames
+#define EWM_TWO_SLICES_DEFAULT (4)            // Cpu time slices per frame
+
+#define EWM_TWO_RUN_AHEAD_MAX (4) // Frames
+
+#define EWM_TWO_ACCEL_MAX (16)
+#define EWM_TWO_SPKR_SLOW_DOWN_CYCLES (5115) // 5ms, so that tones keep their pitch
+
+#define EWM_TWO_INPUT_KEY    (0)
+#define EWM_TWO_INPUT_BUTTON (1)
+#define EWM_TWO_INPUT_PADDLE (2)
+#define EWM_TWO_INPUT_RESET  (3)
+#define EWM_TWO_INPUT_PAUSE  (4) // Toggles
+#define EWM_TWO_INPUT_TURBO  (5) // Toggles
+#define EWM_TWO_INPUT_QUIT   (6)
+#define EWM_TWO_INPUT_DISK   (7) // Index is the drive, value the library disk or -1 for the next
+
+#define EWM_TWO_INPUT_QUEUE_SIZE (256)
+#define EWM_TWO_FRAME_COUNT (3) // Frames in flight between the threads
 
 #define EWM_TWO_STATE_RUNNING (0)
 #define EWM_TWO_STATE_PAUSED (1)
 
 struct mem_t;
 struct ewm_dsk_t;
+struct ewm_lib_t;
+struct ewm_hdv_t;
+struct ewm_que_t;
+struct cpu_snapshot_t;
+
+struct ewm_two_input_t {
+   int type;
+   int index;
+   int value;
+   uint64_t time; // Wall time in ns at which the event happened
+};
+
+// What the status bar and overlays show for a frame
+
+struct ewm_two_status_t {
+   double mhz;
+   uint64_t skipped;
+   bool paused;
+   bool disk_on;
+   int disk_drive;
+};
+
+// A rendered frame, handed from the machine thread to the UI
+
+struct ewm_two_frame_t {
+   SDL_Surface *surface;
+   struct ewm_two_status_t status;
+};
+
 struct scr;
 struct ewm_lua_t;
-struct ewm_tty_t;
+struct ewm_chr_batch_t;
+struct ewm_clk_t;
+
+// Everything needed to go back in time: the cpu and memory, the language
+// card, the disk controller and the soft switches.
+
+struct ewm_two_snapshot_t {
+   struct cpu_snapshot_t *cpu;
+   struct ewm_dsk_state_t dsk;
+   int alc_wrtcount;
+   int screen_mode;
+   int screen_graphics_mode;
+   int screen_graphics_style;
+   int screen_page;
+   uint8_t key;
+   uint8_t buttons[EWM_A2P_BUTTON_COUNT];
+   uint64_t padl_time[4];
+   uint8_t padl_value[4];
+};
 
 struct ewm_two_t {
    int type;
@@ -69,6 +143,9 @@ struct ewm_two_t {
    struct ewm_lua_t *lua;
    struct ewm_dsk_t *dsk;
    struct ewm_alc_t *alc;
+   struct ewm_lib_t *lib;      // Disks to swap in, NULL if there is no library
+   struct ewm_hdv_t *hdv;      // ProDOS block device in slot 7, NULL if there is none
+   int lib_prepared;           // Library disks prepared at the last stats update
 
    struct mem_t *ram;
    struct mem_t *roms[6];
@@ -81,7 +158,12 @@ struct ewm_two_t {
    int screen_dirty;
 
    uint8_t key;
+   uint64_t key_time;          // Wall time the key was pressed, until the cpu sees it
+   uint64_t key_latency_count;
+   uint64_t key_latency_total;
+   uint64_t key_latency_max;
    uint8_t buttons[EWM_A2P_BUTTON_COUNT];
+   uint8_t paddles[EWM_A2P_PADDLE_COUNT];
 
    uint64_t padl0_time;
    uint8_t padl0_value;
@@ -92,9 +174,11 @@ struct ewm_two_t {
    uint64_t padl3_time;
    uint8_t padl3_value;
 
-   SDL_Joystick *joystick;
+   SDL_Joystick *joystick;     // Only sampled on the UI side
+   int joystick_values[2];
 
    bool status_bar_visible;
+   bool window_dirty;          // Set on the UI side when the window needs a redraw
 
    bool debug;
 
@@ -102,7 +186,47 @@ struct ewm_two_t {
    int lua_key_up_fn;
 
    int state;
-   struct ewm_tty_t *tty;
+   bool quit;
+   struct ewm_chr_batch_t *batch;
+   struct ewm_clk_t *clk;
+
+   uint32_t fps;
+   uint32_t phase;             // Frame within the current second
+   double mhz;                 // Effective speed over the past second
+   uint64_t mhz_cycles;
+   uint64_t mhz_time;
+   uint64_t skipped;           // Frames skipped over the past second
+   uint64_t skipped_total;
+
+   uint64_t frame_last;        // Time of the last present, in ns
+   uint64_t frame_count;
+   double frame_sum;
+   double frame_sum_squares;
+
+   struct ewm_que_t *inputs;   // Inputs for the machine thread, if there is one
+   struct ewm_que_t *frames;   // Rendered frames for the UI
+   struct ewm_que_t *free_frames; // Frames the UI is done with
+   struct ewm_two_frame_t frame_pool[EWM_TWO_FRAME_COUNT];
+   uint32_t frame_event;
+
+   bool warp;                  // Run unthrottled while the disk motor is on
+   uint64_t warp_hysteresis;   // Cycles to keep warping after the motor turned off
+   uint64_t warp_until;
+   uint64_t warp_start_time;
+   uint64_t warp_start_cycles;
+   double warp_saved;          // Total wall time saved, in seconds
+   double warp_reported;       // What the stats printed last
+
+   int frame_skip_max;         // Most frames skipped in a row, 0 to never skip
+   int frame_skip;             // Frames skipped in a row so far
+   uint64_t frames_skipped;
+   uint64_t render_time;       // Moving average of the time to render a frame, in ns
+
+   int run_ahead;              // Frames to run ahead of what is shown, 0 to not run ahead
+   struct ewm_two_snapshot_t *snapshot;
+   uint64_t run_ahead_time;    // Time spent running ahead, in ns
+   uint64_t emulation_time;    // Time spent running frames that count, in ns
+   uint64_t snapshot_time;     // Time spent in the last save and restore, in ns
 };
 
 struct ewm_two_t *ewm_two_create(int type, SDL_Renderer *renderer, SDL_Joystick *joystick);
@@ -111,6 +235,12 @@ void ewm_two_destroy(struct ewm_two_t *two);
 int ewm_two_init_lua(struct ewm_two_t *two, struct ewm_lua_t *lua);
 
 int ewm_two_load_disk(struct ewm_two_t *two, int drive, char *path);
+int ewm_two_swap_disk(struct ewm_two_t *two, int drive, int disk);
+
+struct ewm_two_snapshot_t *ewm_two_snapshot_create(struct ewm_two_t *two);
+void ewm_two_snapshot_destroy(struct ewm_two_snapshot_t *snapshot);
+void ewm_two_snapshot_save(struct ewm_two_t *two, struct ewm_two_snapshot_t *snapshot);
+void ewm_two_snapshot_restore(struct ewm_two_t *two, struct ewm_two_snapshot_t *snapshot);
 
 int ewm_two_main(int argc, char **argv);
 
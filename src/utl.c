@@ -20,8 +20,13 @@
 // OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
 // SOFTWARE.
 
+#include <errno.h>
 #include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
 
 #if __APPLE__ && __MACH__
 #include <sys/_types/_timespec.h>
@@ -40,6 +45,64 @@ bool ewm_utl_endswith(char *s, char *suffix) {
    return false;
 }
 
+size_t ewm_utl_write_data(int fd, uint8_t *data, size_t length) {
+   size_t written = 0;
+   while (written < length) {
+      ssize_t n = write(fd, data + written, length - written);
+      if (n <= 0) {
+         break;
+      }
+      written += n;
+   }
+   return written;
+}
+
+// Write to a temporary file next to the file and rename it over the
+// file, so that a crash leaves either the old or the new contents. The
+// data is synced before the rename. The file keeps its mode, new files
+// get the usual one. Returns -1 with errno set when this fails.
+
+int ewm_utl_replace_file(char *path, uint8_t *data, size_t length, ewm_utl_write_t write_data) {
+   size_t tmp_length = strlen(path) + 8;
+   char *tmp = malloc(tmp_length);
+   snprintf(tmp, tmp_length, "%s.XXXXXX", path);
+
+   int fd = mkstemp(tmp);
+   if (fd == -1) {
+      free(tmp);
+      return -1;
+   }
+
+   errno = 0;
+
+   struct stat info;
+   if (stat(path, &info) == 0) {
+      (void) fchmod(fd, info.st_mode & 07777);
+   } else {
+      mode_t mask = umask(0);
+      umask(mask);
+      (void) fchmod(fd, 0666 & ~mask);
+   }
+
+   size_t written = (write_data != NULL) ? write_data(fd, data, length) : ewm_utl_write_data(fd, data, length);
+
+   bool ok = (written == length) && (fsync(fd) == 0);
+   if (close(fd) != 0) {
+      ok = false;
+   }
+
+   if (!ok || rename(tmp, path) != 0) {
+      int error = (errno != 0) ? errno : EIO;
+      unlink(tmp);
+      free(tmp);
+      errno = error;
+      return -1;
+   }
+
+   free(tmp);
+   return 0;
+}
+
 #if (defined(__MAC_OS_X_VERSION_MIN_REQUIRED) && __MAC_OS_X_VERSION_MIN_REQUIRED < 101200)
 int clock_gettime(clockid_t clk_id, struct timespec *tp) {
    if (clk_id != CLOCK_REALTIME) {
@@ -24,6 +24,8 @@
 #define EWM_UTL_H
 
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
 
 #if __APPLE__ && __MACH__
 #include <mach/clock.h>
@@ -32,6 +34,10 @@
 
 bool ewm_utl_endswith(char *s, char *suffix);
 
+typedef size_t (*ewm_utl_write_t)(int fd, uint8_t *data, size_t length);
+size_t ewm_utl_write_data(int fd, uint8_t *data, size_t length);
+int ewm_utl_replace_file(char *path, uint8_t *data, size_t length, ewm_utl_write_t write_data);
+
 #if defined(__MAC_OS_X_VERSION_MIN_REQUIRED) && __MAC_OS_X_VERSION_MIN_REQUIRED < 101200
 #define CLOCK_REALTIME CALENDAR_CLOCK
 typedef int clockid_t;
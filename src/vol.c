@@ -0,0 +1,504 @@
+// The MIT License (MIT)
+//
+// Copyright (c) 2017 Stefan Arentz - http://github.com/st3fan/ewm
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#include <ctype.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "utl.h"
+#include "vol.h"
+
+#define VOL_SECTOR(t,s) (((t) << 8) | (s))
+
+static char vol_type_names[] = "TIABSR";
+
+static int vol_type_from_name(char c) {
+   char *p = strchr(vol_type_names, toupper(c));
+   return (c != 0 && p != NULL) ? (1 << (p - vol_type_names)) >> 1 : -1;
+}
+
+static char vol_name_from_type(uint8_t type) {
+   type &= 0x7f;
+   for (int i = 0; vol_type_names[i] != 0; i++) {
+      if (type == ((1 << i) >> 1)) {
+         return vol_type_names[i];
+      }
+   }
+   return 'B';
+}
+
+static uint8_t *vol_sector(uint8_t *image, int track, int sector) {
+   return image + (track * EWM_DSK_SECTORS * EWM_DSK_SECTOR_SIZE) + (sector * EWM_DSK_SECTOR_SIZE);
+}
+
+// Sectors are handed out like DOS does, from the catalog track outwards
+// and from the last sector down. Tracks 0 to 2 are left for DOS.
+
+static int vol_allocate(struct ewm_vol_t *vol, uint8_t kind, uint8_t file, uint16_t index) {
+   int above = EWM_DSK_TRACKS - EWM_VOL_CATALOG_TRACK - 1;
+   for (int i = 0; i < EWM_DSK_TRACKS - 1; i++) {
+      int track = (i < above) ? EWM_VOL_CATALOG_TRACK + 1 + i : EWM_VOL_CATALOG_TRACK - 1 - (i - above);
+      if (track < 3) {
+         continue;
+      }
+      for (int sector = EWM_DSK_SECTORS - 1; sector >= 0; sector--) {
+         struct ewm_vol_sector_t *s = &vol->sectors[track][sector];
+         if (s->kind == EWM_VOL_SECTOR_FREE) {
+            s->kind = kind;
+            s->file = file;
+            s->index = index;
+            return VOL_SECTOR(track, sector);
+         }
+      }
+   }
+   return -1;
+}
+
+static int vol_free_sectors(struct ewm_vol_t *vol) {
+   int count = 0;
+   for (int t = 0; t < EWM_DSK_TRACKS; t++) {
+      for (int s = 0; s < EWM_DSK_SECTORS; s++) {
+         count += (vol->sectors[t][s].kind == EWM_VOL_SECTOR_FREE);
+      }
+   }
+   return count;
+}
+
+// Plan where a file goes, if it fits
+
+static int vol_add_file(struct ewm_vol_t *vol, char *path, char *name, uint8_t type, size_t length) {
+   int data_count = (length + EWM_DSK_SECTOR_SIZE - 1) / EWM_DSK_SECTOR_SIZE;
+   int list_count = (data_count == 0) ? 1 : (data_count + EWM_VOL_TS_PAIRS - 1) / EWM_VOL_TS_PAIRS;
+   if (vol->files_count == EWM_VOL_FILES_MAX || data_count + list_count > vol_free_sectors(vol)) {
+      return -1;
+   }
+
+   int f = vol->files_count++;
+   struct ewm_vol_file_t *file = &vol->files[f];
+   file->path = strdup(path);
+   strcpy(file->name, name);
+   file->type = type;
+   file->length = length;
+   file->data_count = data_count;
+   file->data = malloc((data_count + 1) * sizeof(uint16_t));
+   file->list_count = list_count;
+   file->lists = malloc(list_count * sizeof(uint16_t));
+
+   for (int i = 0; i < data_count + list_count; i++) {
+      // Each list comes before the data sectors it lists
+      int list = i / (EWM_VOL_TS_PAIRS + 1);
+      if (i % (EWM_VOL_TS_PAIRS + 1) == 0) {
+         file->lists[list] = vol_allocate(vol, EWM_VOL_SECTOR_LIST, f, list);
+      } else {
+         int index = i - list - 1;
+         file->data[index] = vol_allocate(vol, EWM_VOL_SECTOR_DATA, f, index);
+      }
+   }
+
+   return 0;
+}
+
+// Host names are NAME.X with X the type. DOS names are upper case and
+// cannot have commas in them.
+
+static bool vol_parse_name(char *host_name, char *name, int *type) {
+   char *dot = strrchr(host_name, '.');
+   if (dot == NULL || dot == host_name || strlen(dot) != 2 || (dot - host_name) > EWM_VOL_NAME_LENGTH) {
+      return false;
+   }
+
+   *type = vol_type_from_name(dot[1]);
+   if (*type == -1) {
+      return false;
+   }
+
+   for (int i = 0; i < (dot - host_name); i++) {
+      if (host_name[i] == ',' || !isprint((unsigned char) host_name[i])) {
+         return false;
+      }
+      name[i] = toupper(host_name[i]);
+   }
+   name[dot - host_name] = 0x00;
+
+   return true;
+}
+
+static int vol_compare_names(const void *a, const void *b) {
+   return strcmp(*((char**) a), *((char**) b));
+}
+
+struct ewm_vol_t *ewm_vol_create(char *path) {
+   DIR *dir = opendir(path);
+   if (dir == NULL) {
+      return NULL;
+   }
+
+   char **names = NULL;
+   int count = 0;
+
+   struct dirent *entry;
+   while ((entry = readdir(dir)) != NULL) {
+      if (entry->d_name[0] != '.') {
+         names = realloc(names, (count + 1) * sizeof(char*));
+         names[count++] = strdup(entry->d_name);
+      }
+   }
+   closedir(dir);
+
+   qsort(names, count, sizeof(char*), vol_compare_names);
+
+   struct ewm_vol_t *vol = (struct ewm_vol_t*) malloc(sizeof(struct ewm_vol_t));
+   memset(vol, 0x00, sizeof(struct ewm_vol_t));
+   vol->path = strdup(path);
+
+   for (int t = 0; t < 3; t++) {
+      for (int s = 0; s < EWM_DSK_SECTORS; s++) {
+         vol->sectors[t][s].kind = EWM_VOL_SECTOR_USED;
+      }
+   }
+   vol->sectors[EWM_VOL_CATALOG_TRACK][0].kind = EWM_VOL_SECTOR_VTOC;
+   for (int s = 1; s < EWM_DSK_SECTORS; s++) {
+      vol->sectors[EWM_VOL_CATALOG_TRACK][s].kind = EWM_VOL_SECTOR_CATALOG;
+      vol->sectors[EWM_VOL_CATALOG_TRACK][s].index = EWM_VOL_CATALOG_SECTORS - s;
+   }
+
+   for (int i = 0; i < count; i++) {
+      char name[EWM_VOL_NAME_LENGTH + 1];
+      int type;
+      char *file_path = malloc(strlen(path) + strlen(names[i]) + 2);
+      sprintf(file_path, "%s/%s", path, names[i]);
+
+      struct stat info;
+      if (vol_parse_name(names[i], name, &type) && stat(file_path, &info) == 0 && S_ISREG(info.st_mode)) {
+         if (vol_add_file(vol, file_path, name, type, info.st_size) != 0) {
+            fprintf(stderr, "[VOL] No room for %s\n", file_path);
+         }
+      }
+
+      free(file_path);
+      free(names[i]);
+   }
+   free(names);
+
+   return vol;
+}
+
+struct ewm_vol_t *ewm_vol_copy(struct ewm_vol_t *vol) {
+   struct ewm_vol_t *copy = (struct ewm_vol_t*) malloc(sizeof(struct ewm_vol_t));
+   memcpy(copy, vol, sizeof(struct ewm_vol_t));
+   copy->path = strdup(vol->path);
+   for (int i = 0; i < vol->files_count; i++) {
+      struct ewm_vol_file_t *file = &copy->files[i];
+      file->path = strdup(vol->files[i].path);
+      file->data = malloc((file->data_count + 1) * sizeof(uint16_t));
+      memcpy(file->data, vol->files[i].data, (file->data_count + 1) * sizeof(uint16_t));
+      file->lists = malloc(file->list_count * sizeof(uint16_t));
+      memcpy(file->lists, vol->files[i].lists, file->list_count * sizeof(uint16_t));
+   }
+   return copy;
+}
+
+void ewm_vol_destroy(struct ewm_vol_t *vol) {
+   if (vol != NULL) {
+      for (int i = 0; i < vol->files_count; i++) {
+         free(vol->files[i].path);
+         free(vol->files[i].data);
+         free(vol->files[i].lists);
+      }
+      free(vol->path);
+      free(vol);
+   }
+}
+
+// Making sectors
+
+static void vol_make_vtoc(struct ewm_vol_t *vol, uint8_t *data) {
+   data[0x01] = EWM_VOL_CATALOG_TRACK;
+   data[0x02] = EWM_DSK_SECTORS - 1;
+   data[0x03] = 3; // DOS release
+   data[0x06] = EWM_VOL_NUMBER;
+   data[0x27] = EWM_VOL_TS_PAIRS;
+   data[0x30] = EWM_VOL_CATALOG_TRACK;
+   data[0x31] = 1;
+   data[0x34] = EWM_DSK_TRACKS;
+   data[0x35] = EWM_DSK_SECTORS;
+   data[0x36] = EWM_DSK_SECTOR_SIZE & 0xff;
+   data[0x37] = EWM_DSK_SECTOR_SIZE >> 8;
+
+   // Four bytes for each track, with a bit for each free sector
+   for (int t = 0; t < EWM_DSK_TRACKS; t++) {
+      uint16_t free_sectors = 0;
+      for (int s = 0; s < EWM_DSK_SECTORS; s++) {
+         if (vol->sectors[t][s].kind == EWM_VOL_SECTOR_FREE) {
+            free_sectors |= (1 << s);
+         }
+      }
+      data[0x38 + t * 4 + 0] = free_sectors >> 8;
+      data[0x38 + t * 4 + 1] = free_sectors & 0xff;
+   }
+}
+
+static void vol_make_catalog(struct ewm_vol_t *vol, int index, int sector, uint8_t *data) {
+   if (sector > 1) {
+      data[0x01] = EWM_VOL_CATALOG_TRACK;
+      data[0x02] = sector - 1;
+   }
+
+   for (int i = 0; i < EWM_VOL_ENTRIES_PER_SECTOR; i++) {
+      int f = index * EWM_VOL_ENTRIES_PER_SECTOR + i;
+      if (f >= vol->files_count) {
+         break;
+      }
+      struct ewm_vol_file_t *file = &vol->files[f];
+      uint8_t *entry = data + 0x0b + i * 35;
+      entry[0x00] = file->lists[0] >> 8;
+      entry[0x01] = file->lists[0] & 0xff;
+      entry[0x02] = file->type;
+      for (int c = 0; c < EWM_VOL_NAME_LENGTH; c++) {
+         entry[0x03 + c] = (c < (int) strlen(file->name) ? file->name[c] : ' ') | 0x80;
+      }
+      int sectors = file->list_count + file->data_count;
+      entry[0x21] = sectors & 0xff;
+      entry[0x22] = sectors >> 8;
+   }
+}
+
+static void vol_make_list(struct ewm_vol_file_t *file, int index, uint8_t *data) {
+   if (index + 1 < file->list_count) {
+      data[0x01] = file->lists[index + 1] >> 8;
+      data[0x02] = file->lists[index + 1] & 0xff;
+   }
+   int first = index * EWM_VOL_TS_PAIRS;
+   data[0x05] = first & 0xff;
+   data[0x06] = first >> 8;
+   for (int i = 0; i < EWM_VOL_TS_PAIRS && first + i < file->data_count; i++) {
+      data[0x0c + i * 2 + 0] = file->data[first + i] >> 8;
+      data[0x0c + i * 2 + 1] = file->data[first + i] & 0xff;
+   }
+}
+
+static void vol_make_data(struct ewm_vol_file_t *file, int index, uint8_t *data) {
+   int fd = open(file->path, O_RDONLY);
+   if (fd == -1 || pread(fd, data, EWM_DSK_SECTOR_SIZE, index * EWM_DSK_SECTOR_SIZE) < 0) {
+      fprintf(stderr, "[VOL] Cannot read %s: %s\n", file->path, strerror(errno));
+   }
+   if (fd != -1) {
+      close(fd);
+   }
+}
+
+// Make the sectors of a track in the image, the first time it is needed
+
+void ewm_vol_fill_track(struct ewm_vol_t *vol, uint8_t *image, int track) {
+   if (vol->filled[track]) {
+      return;
+   }
+
+   for (int s = 0; s < EWM_DSK_SECTORS; s++) {
+      struct ewm_vol_sector_t *sector = &vol->sectors[track][s];
+      uint8_t *data = vol_sector(image, track, s);
+      memset(data, 0x00, EWM_DSK_SECTOR_SIZE);
+      switch (sector->kind) {
+         case EWM_VOL_SECTOR_VTOC:
+            vol_make_vtoc(vol, data);
+            break;
+         case EWM_VOL_SECTOR_CATALOG:
+            vol_make_catalog(vol, sector->index, s, data);
+            break;
+         case EWM_VOL_SECTOR_LIST:
+            vol_make_list(&vol->files[sector->file], sector->index, data);
+            break;
+         case EWM_VOL_SECTOR_DATA:
+            vol_make_data(&vol->files[sector->file], sector->index, data);
+            break;
+      }
+   }
+
+   vol->filled[track] = true;
+}
+
+// Writing back. The catalog in the image is read like DOS would, and
+// every file in it is written to its host file if it changed. Files
+// that were deleted are left alone on the host. The disk writer thread
+// does this on copies of the volume and the image, so the tracks it
+// fills are only filled in the copy.
+
+static size_t vol_file_length(uint8_t type, uint8_t *data, size_t length) {
+   if (data == NULL) {
+      return 0;
+   }
+
+   size_t header = 0, contents = length;
+   switch (type & 0x7f) {
+      case 0x00: // Text ends at the first zero
+         contents = strnlen((char*) data, length);
+         break;
+      case 0x01:
+      case 0x02:
+         header = 2;
+         contents = (length >= 2) ? (data[0] | (data[1] << 8)) : 0;
+         break;
+      case 0x04:
+         header = 4;
+         contents = (length >= 4) ? (data[2] | (data[3] << 8)) : 0;
+         break;
+   }
+   return (header + contents < length) ? header + contents : length;
+}
+
+static bool vol_same_contents(char *path, uint8_t *data, size_t length) {
+   int fd = open(path, O_RDONLY);
+   if (fd == -1) {
+      return false;
+   }
+
+   struct stat info;
+   bool same = false;
+   if (fstat(fd, &info) == 0 && (size_t) info.st_size == length) {
+      uint8_t *contents = malloc(length + 1);
+      same = (read(fd, contents, length) == (ssize_t) length) && memcmp(contents, data, length) == 0;
+      free(contents);
+   }
+   close(fd);
+
+   return same;
+}
+
+static int vol_write_file(char *path, uint8_t *data, size_t length) {
+   if (vol_same_contents(path, data, length)) {
+      return 0;
+   }
+
+   if (ewm_utl_replace_file(path, data, length, NULL) != 0) {
+      fprintf(stderr, "[VOL] Cannot write %s: %s\n", path, strerror(errno));
+      return -1;
+   }
+
+   return 0;
+}
+
+// Collect the data sectors of a file by following its track/sector lists
+
+static uint8_t *vol_read_file(uint8_t *image, int track, int sector, size_t *length) {
+   uint8_t *data = NULL;
+   size_t used = 0;
+
+   for (int lists = 0; (track != 0 || sector != 0) && lists < EWM_DSK_TRACKS * EWM_DSK_SECTORS; lists++) {
+      if (track >= EWM_DSK_TRACKS || sector >= EWM_DSK_SECTORS) {
+         break;
+      }
+      uint8_t *list = vol_sector(image, track, sector);
+      size_t first = (list[0x05] | (list[0x06] << 8)) * EWM_DSK_SECTOR_SIZE;
+      for (int i = 0; i < EWM_VOL_TS_PAIRS; i++) {
+         int t = list[0x0c + i * 2], s = list[0x0c + i * 2 + 1];
+         if ((t == 0 && s == 0) || t >= EWM_DSK_TRACKS || s >= EWM_DSK_SECTORS) {
+            continue;
+         }
+         size_t offset = first + i * EWM_DSK_SECTOR_SIZE;
+         if (offset + EWM_DSK_SECTOR_SIZE > used) {
+            data = realloc(data, offset + EWM_DSK_SECTOR_SIZE);
+            memset(data + used, 0x00, offset + EWM_DSK_SECTOR_SIZE - used);
+            used = offset + EWM_DSK_SECTOR_SIZE;
+         }
+         memcpy(data + offset, vol_sector(image, t, s), EWM_DSK_SECTOR_SIZE);
+      }
+      track = list[0x01];
+      sector = list[0x02];
+   }
+
+   *length = used;
+   return data;
+}
+
+static char *vol_host_path(struct ewm_vol_t *vol, char *name, uint8_t type) {
+   for (int i = 0; i < vol->files_count; i++) {
+      if (strcmp(vol->files[i].name, name) == 0 && vol->files[i].type == (type & 0x7f)) {
+         return strdup(vol->files[i].path);
+      }
+   }
+
+   char *path = malloc(strlen(vol->path) + strlen(name) + 4);
+   sprintf(path, "%s/%s.%c", vol->path, name, vol_name_from_type(type));
+   for (char *p = path + strlen(vol->path) + 1; *p != 0; p++) {
+      if (*p == '/') {
+         *p = '_';
+      }
+   }
+   return path;
+}
+
+int ewm_vol_write_back(struct ewm_vol_t *vol, uint8_t *image) {
+   // Everything the catalog points at has to be in the image
+   for (int t = 0; t < EWM_DSK_TRACKS; t++) {
+      ewm_vol_fill_track(vol, image, t);
+   }
+
+   int result = 0;
+
+   uint8_t *vtoc = vol_sector(image, EWM_VOL_CATALOG_TRACK, 0);
+   int track = vtoc[0x01], sector = vtoc[0x02];
+
+   for (int n = 0; (track != 0 || sector != 0) && n < EWM_DSK_TRACKS * EWM_DSK_SECTORS; n++) {
+      if (track >= EWM_DSK_TRACKS || sector >= EWM_DSK_SECTORS) {
+         break;
+      }
+      uint8_t *catalog = vol_sector(image, track, sector);
+      for (int i = 0; i < EWM_VOL_ENTRIES_PER_SECTOR; i++) {
+         uint8_t *entry = catalog + 0x0b + i * 35;
+         if (entry[0x00] == 0x00 || entry[0x00] == 0xff) {
+            continue; // Never used or deleted
+         }
+
+         char name[EWM_VOL_NAME_LENGTH + 1];
+         for (int c = 0; c < EWM_VOL_NAME_LENGTH; c++) {
+            name[c] = entry[0x03 + c] & 0x7f;
+         }
+         int end = EWM_VOL_NAME_LENGTH;
+         while (end > 0 && name[end - 1] == ' ') {
+            end--;
+         }
+         name[end] = 0x00;
+         if (end == 0) {
+            continue;
+         }
+
+         size_t length;
+         uint8_t *data = vol_read_file(image, entry[0x00], entry[0x01], &length);
+         char *path = vol_host_path(vol, name, entry[0x02]);
+         if (vol_write_file(path, data, vol_file_length(entry[0x02], data, length)) != 0) {
+            result = -1;
+         }
+         free(path);
+         free(data);
+      }
+      track = catalog[0x01];
+      sector = catalog[0x02];
+   }
+
+   return result;
+}
@@ -0,0 +1,87 @@
+// The MIT License (MIT)
+//
+// Copyright (c) 2017 Stefan Arentz - http://github.com/st3fan/ewm
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#ifndef EWM_VOL_H
+#define EWM_VOL_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "dsk.h"
+
+// A DOS 3.3 volume made from the files in a host directory. Only the
+// layout is worked out up front. The sectors of a track are made when
+// the track is first read, with file data read from the host files.
+//
+// Host files are named NAME.T, .I, .A, .B, .S or .R after the DOS file
+// type, and have the data like DOS stores it. So an Applesoft program
+// starts with its length, and a binary file with its address and length.
+
+#define EWM_VOL_NUMBER (254)
+#define EWM_VOL_CATALOG_TRACK (17)
+#define EWM_VOL_CATALOG_SECTORS (15)
+#define EWM_VOL_ENTRIES_PER_SECTOR (7)
+#define EWM_VOL_FILES_MAX (EWM_VOL_CATALOG_SECTORS * EWM_VOL_ENTRIES_PER_SECTOR)
+#define EWM_VOL_NAME_LENGTH (30)
+#define EWM_VOL_TS_PAIRS (122) // Track and sector pairs in a track/sector list
+
+#define EWM_VOL_SECTOR_FREE (0)
+#define EWM_VOL_SECTOR_USED (1) // Where DOS itself would be
+#define EWM_VOL_SECTOR_VTOC (2)
+#define EWM_VOL_SECTOR_CATALOG (3)
+#define EWM_VOL_SECTOR_LIST (4)
+#define EWM_VOL_SECTOR_DATA (5)
+
+struct ewm_vol_file_t {
+   char *path;          // The host file
+   char name[EWM_VOL_NAME_LENGTH + 1];
+   uint8_t type;
+   size_t length;
+   int data_count;
+   uint16_t *data;      // Track and sector of each data sector
+   int list_count;
+   uint16_t *lists;     // Track and sector of each track/sector list
+};
+
+struct ewm_vol_sector_t {
+   uint8_t kind;
+   uint8_t file;
+   uint16_t index;      // Which list, data or catalog sector of the file or catalog
+};
+
+struct ewm_vol_t {
+   char *path;
+   struct ewm_vol_file_t files[EWM_VOL_FILES_MAX];
+   int files_count;
+   struct ewm_vol_sector_t sectors[EWM_DSK_TRACKS][EWM_DSK_SECTORS];
+   bool filled[EWM_DSK_TRACKS]; // Tracks that were made in the image
+};
+
+struct ewm_vol_t *ewm_vol_create(char *path);
+struct ewm_vol_t *ewm_vol_copy(struct ewm_vol_t *vol);
+void ewm_vol_destroy(struct ewm_vol_t *vol);
+
+void ewm_vol_fill_track(struct ewm_vol_t *vol, uint8_t *image, int track);
+int ewm_vol_write_back(struct ewm_vol_t *vol, uint8_t *image);
+
+#endif // EWM_VOL_H